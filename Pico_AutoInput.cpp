@@ -13,6 +13,7 @@
 #include <bsp/board.h>
 #include <tusb.h>
 #include "usb_descriptors.h"
+#include "log_formats.h"
 #include "pico-littlefs-usb/vendor/littlefs/lfs.h"
 #include "WS2812.hpp"
 #include "PNGdec/src/PNGdec.h"
@@ -34,6 +35,7 @@ extern "C"
 
 // allow controlling stdio drivers (USB stdio is disabled via CMake for this target)
 extern bool ExecuteScript(const char *filename);
+extern "C" void ScriptTraceFlush(); // ■ 追加: DEBUG(1) の実行トレースを trace.txt に書き出す
 
 // littlefs configuration provided by pico-littlefs-usb
 extern const struct lfs_config lfs_pico_flash_config;
@@ -55,6 +57,30 @@ extern const struct lfs_config lfs_pico_flash_config;
 
 // littlefs driver
 lfs_t fs;                 /* single shared instance for the program (remove internal linkage) */
+
+// ■ 追加: fs のマウント参照カウント
+// スクリプト実行中はログ (log.txt) とインタプリタ (ページ実行・profile.txt・trace.txt) が同じマウントを使う。
+// 別々の lfs_t でマウントすると、片方の読み込みキャッシュと空きブロックの情報がもう片方の書き込みで古くなり、
+// 使用中のブロックを割り当てたり古いディレクトリで上書きしたりしてファイルシステムを壊すため。
+static int g_fs_mount_refs = 0;
+
+extern "C" int SharedFsMount()
+{
+    if (g_fs_mount_refs == 0)
+    {
+        int err = lfs_mount(&fs, &lfs_pico_flash_config);
+        if (err < 0)
+            return err;
+    }
+    ++g_fs_mount_refs;
+    return 0;
+}
+
+extern "C" void SharedFsUnmount()
+{
+    if (g_fs_mount_refs > 0 && --g_fs_mount_refs == 0)
+        lfs_unmount(&fs);
+}
 WS2812 *ledStrip1 = NULL; // グローバルLEDストリップポインタ (外部から参照可能)
 
 // LED色定義
@@ -69,10 +95,129 @@ static const uint32_t LED_OFF = WS2812::RGB(0, 0, 0);      // 消灯
 static uint32_t g_log_max_size = 20480; // デフォルト20KB
 static bool g_log_overwrite = true;     // デフォルトは上書き(OVERWRITE)
 static bool g_log_enabled = true;       // デフォルト有効
+static bool g_log_binary = false;       // ■ 追加: BINARY のとき log.bin に書式番号と引数だけを書く
+
+// ■ 追加: ログのバッファリング
+// 以前は 1 行ごとに littlefs をマウントし、サイズ確認・追記・アンマウントしていたため 1 行に数十 ms かかっていた。
+// スクリプト実行中 (SystemLogBegin 〜 SystemLogEnd) は最初の書き込みでマウントしたままにし、行は RAM に溜めて
+// 一定量たまったとき・スケジューラのアイドル時・スクリプト終了時にまとめて書き込む。
+// log.txt のサイズも RAM で追跡し、OVERWRITE / STOP の切り替えは従来どおり「上限に達した行の次」で行う。
+static const uint32_t LOG_BUF_SIZE = 4096;
+static const uint32_t LOG_FLUSH_THRESHOLD = 3072; // これ以上たまったら書き込む
+static char g_log_buf[LOG_BUF_SIZE];
+static uint32_t g_log_len = 0;
+static bool g_log_session = false;      // スクリプト実行中 (マウントを保持する)
+static bool g_log_mounted = false;      // セッション中に fs をマウント済み
+static bool g_log_stopped = false;      // STOP モードで上限に達した (以後は捨てる)
+static lfs_soff_t g_log_file_size = -1; // log.txt (log.bin) のサイズ (-1 = 未取得)
+static uint32_t g_log_last_ms = 0;      // バイナリログの直前のレコードの時刻
+static bool g_log_rotate = false;       // バイナリログ: 次の書き込みの前にローテーションする
+
+static const char *log_file_name() { return g_log_binary ? "log.bin" : "log.txt"; }
+static const char *log_bak_name() { return g_log_binary ? "logbak.bin" : "log.bak"; }
+
+static bool log_fs_acquire()
+{
+    if (g_log_mounted)
+        return true;
+    if (SharedFsMount() != 0)
+        return false;
+    g_log_mounted = g_log_session;
+    return true;
+}
+
+static void log_fs_release()
+{
+    if (!g_log_mounted)
+        SharedFsUnmount();
+}
+
+// バッファの内容を log.txt に書き込む (マウント済みで呼ぶ)
+static void log_flush_mounted()
+{
+    if (g_log_file_size < 0)
+    {
+        struct lfs_info info;
+        g_log_file_size = (lfs_stat(&fs, log_file_name(), &info) == 0) ? (lfs_soff_t)info.size : 0;
+    }
+
+    uint32_t pos = 0;
+    while (pos < g_log_len && !g_log_stopped)
+    {
+        // 制限を超えている場合の処理
+        if (g_log_file_size >= (lfs_soff_t)g_log_max_size || g_log_rotate)
+        {
+            g_log_rotate = false;
+            if (!g_log_overwrite)
+            {
+                // STOPモード: bakが存在しなければローテーション、存在すれば停止
+                struct lfs_info info;
+                if (lfs_stat(&fs, log_bak_name(), &info) != LFS_ERR_NOENT)
+                {
+                    g_log_stopped = true;
+                    break;
+                }
+            }
+            lfs_remove(&fs, log_bak_name());                // 古いbakを消す
+            lfs_rename(&fs, log_file_name(), log_bak_name()); // txtをbakへ
+            g_log_file_size = 0;
+        }
+
+        // 上限をまたぐ行の終わりまでを書く
+        // (バイナリログはレコードの途中で分けられないため、上限をまたぐ前にバッファを書き出してある)
+        uint32_t end = g_log_len;
+        const uint32_t room = g_log_max_size - (uint32_t)g_log_file_size;
+        if (!g_log_binary && g_log_len - pos > room)
+        {
+            end = pos + room;
+            while (end < g_log_len && g_log_buf[end - 1] != '\n')
+                ++end;
+        }
+
+        lfs_file_t f;
+        if (lfs_file_open(&fs, &f, log_file_name(), LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND) != 0)
+            break;
+        if (g_log_binary && g_log_file_size == 0)
+        {
+            const uint8_t header[8] = {(uint8_t)kLogBinMagic[0], (uint8_t)kLogBinMagic[1], (uint8_t)kLogBinMagic[2],
+                                       (uint8_t)kLogBinMagic[3], kLogBinVersion, 0, (uint8_t)LOGF_COUNT, 0};
+            lfs_file_write(&fs, &f, header, sizeof(header));
+            g_log_file_size += sizeof(header);
+        }
+        lfs_file_write(&fs, &f, g_log_buf + pos, end - pos);
+        lfs_file_close(&fs, &f);
+        g_log_file_size += end - pos;
+        pos = end;
+    }
+    g_log_len = 0;
+}
+
+static void log_flush()
+{
+    if (g_log_len == 0)
+        return;
+    if (!g_log_session)
+        g_log_file_size = -1; // 実行中でなければ USB 経由で変更されている可能性がある
+    if (!log_fs_acquire())
+    {
+        g_log_len = 0;
+        return;
+    }
+    log_flush_mounted();
+    log_fs_release();
+}
 
 // --- ログ設定関数 (ScriptProcessorから呼ばれる) ---
-extern "C" void ConfigureLog(uint32_t size_kb, bool overwrite)
+extern "C" void ConfigureLog(uint32_t size_kb, bool overwrite, bool binary)
 {
+    log_flush(); // ここまでの行は変更前の設定で書く
+    g_log_stopped = false;
+    g_log_rotate = false;
+    if (binary != g_log_binary)
+    {
+        g_log_binary = binary;
+        g_log_file_size = -1; // 書き込み先のファイルが変わる
+    }
     if (size_kb == 0)
     {
         g_log_enabled = false;
@@ -83,83 +228,203 @@ extern "C" void ConfigureLog(uint32_t size_kb, bool overwrite)
         g_log_enabled = true;
         g_log_max_size = size_kb * 1024;
         g_log_overwrite = overwrite;
-        printf("LOG: Configured max=%lu bytes, mode=%s\n", g_log_max_size, overwrite ? "OVERWRITE" : "STOP");
+        printf("LOG: Configured max=%lu bytes, mode=%s, %s\n", g_log_max_size, overwrite ? "OVERWRITE" : "STOP", binary ? "BINARY" : "TEXT");
     }
 }
 
-// --- システムログ関数 (UART + ファイル出力) ---
-extern "C" void SystemLog(const char *fmt, ...)
+// ■ 追加: スクリプト実行の開始・終了 (ExecuteScript から呼ばれる)
+extern "C" void SystemLogBegin()
 {
-    char buf[256];
+    g_log_session = true;
+    g_log_stopped = false;
+    g_log_rotate = false;
+    g_log_file_size = -1;
+}
 
-    // 文字列整形
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    va_end(args);
+extern "C" void SystemLogEnd()
+{
+    log_flush();
+    if (g_log_mounted)
+    {
+        SharedFsUnmount();
+        g_log_mounted = false;
+    }
+    g_log_session = false;
+}
 
-    // 1. UARTに出力 (常に実行)
-    printf("%s", buf);
+// ■ 追加: スケジューラに十分な空き時間があるときに呼ばれる (書き込んだら true)
+extern "C" bool SystemLogIdle()
+{
+    if (g_log_len == 0)
+        return false;
+    log_flush();
+    return true;
+}
 
-    // 2. ファイルに出力 (有効な場合のみ)
-    if (g_log_enabled && lfs_mount(&fs, &lfs_pico_flash_config) == 0)
+// ■ 追加: バイナリログのレコードを作ってバッファに追加する (書式は log_formats.h)
+// 整形 (特に double の vsnprintf) をせず、引数の値をそのまま詰めるので、テキストより速く小さい。
+static uint8_t *log_put_varint(uint8_t *w, uint64_t v)
+{
+    while (v >= 0x80)
     {
+        *w++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *w++ = (uint8_t)v;
+    return w;
+}
 
-        // サイズチェック
-        lfs_file_t f;
-        int err = lfs_file_open(&fs, &f, "log.txt", LFS_O_RDONLY);
-        lfs_soff_t size = 0;
-        if (err == 0)
-        {
-            size = lfs_file_size(&fs, &f);
-            lfs_file_close(&fs, &f);
-        }
+static inline uint64_t log_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
 
-        // 制限を超えている場合の処理
-        if (size >= g_log_max_size)
+static void log_append_binary_va(unsigned id, va_list args)
+{
+    uint8_t rec[320];
+    uint8_t *w = rec + 8; // 先頭は書式番号と経過時間のために空けておく
+    const char *p = kLogFormats[id];
+    for (LogArg a; (a = log_next_arg(p)) != LogArg::NONE;)
+    {
+        if (a == LogArg::INT32)
+            w = log_put_varint(w, log_zigzag((int32_t)va_arg(args, int)));
+        else if (a == LogArg::INT64)
+            w = log_put_varint(w, log_zigzag((int64_t)va_arg(args, long long)));
+        else if (a == LogArg::DOUBLE)
         {
-            bool do_rotate = false;
-
-            if (g_log_overwrite)
-            {
-                // OVERWRITEモード: 常にローテーション(古いbakを上書き)
-                do_rotate = true;
-            }
+            const double d = va_arg(args, double);
+            if (d > -4503599627370496.0 && d < 4503599627370496.0 && d == (double)(int64_t)d) // 整数値 (|d| < 2^52)
+                w = log_put_varint(w, log_zigzag((int64_t)d) << 1);
             else
             {
-                // STOPモード: bakが存在しなければローテーション、存在すれば停止
-                struct lfs_info info;
-                int bak_err = lfs_stat(&fs, "log.bak", &info);
-                if (bak_err == LFS_ERR_NOENT)
-                {
-                    do_rotate = true; // まだbakがないので作る
-                }
-                else
-                {
-                    // bakが既にある -> 停止 (何もしない)
-                    lfs_unmount(&fs);
-                    return;
-                }
-            }
-
-            if (do_rotate)
-            {
-                lfs_remove(&fs, "log.bak");            // 古いbakを消す
-                lfs_rename(&fs, "log.txt", "log.bak"); // txtをbakへ
-                // 新しい log.txt はこの後の書き込みで作成される
+                *w++ = 1;
+                memcpy(w, &d, sizeof(d));
+                w += sizeof(d);
             }
         }
-
-        // 追記モードで書き込み
-        err = lfs_file_open(&fs, &f, "log.txt", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
-        if (err == 0)
+        else
         {
-            lfs_file_write(&fs, &f, buf, strlen(buf));
-            lfs_file_close(&fs, &f);
+            const char *str = va_arg(args, const char *);
+            size_t n = str ? strlen(str) : 0;
+            const size_t left = (size_t)(rec + sizeof(rec) - w);
+            const size_t room = left > 24 ? left - 24 : 0; // 後に続く数値の引数の分を残す
+            if (n > room)
+                n = room;
+            if (n > 255)
+                n = 255;
+            *w++ = (uint8_t)n;
+            memcpy(w, str, n);
+            w += n;
         }
+    }
+    const uint32_t body = (uint32_t)(w - (rec + 8));
 
-        lfs_unmount(&fs);
+    // 上限をまたぐ前に書き出して、ローテーションがレコードの境目で起きるようにする
+    if (g_log_file_size < 0 && log_fs_acquire())
+    {
+        struct lfs_info info;
+        g_log_file_size = (lfs_stat(&fs, log_file_name(), &info) == 0) ? (lfs_soff_t)info.size : 0;
+        log_fs_release();
+    }
+    const uint32_t worst = 5 + 1 + 5 + body; // SYNC + 書式番号 + 経過時間 + 引数
+    bool full = g_log_file_size > 0 && g_log_file_size + g_log_len + worst > (lfs_soff_t)g_log_max_size;
+    if (g_log_len > 0 && (full || g_log_len + worst > LOG_BUF_SIZE))
+    {
+        log_flush();
+        full = g_log_file_size > 0 && g_log_file_size + worst > (lfs_soff_t)g_log_max_size;
+    }
+    if (full)
+        g_log_rotate = true; // このレコードは次のファイルの先頭になる
+    if (g_log_stopped)
+        return;
+
+    const uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    uint8_t *out = (uint8_t *)g_log_buf + g_log_len;
+    if (g_log_len == 0)
+    {
+        // 書き込みのまとまりの先頭には絶対時刻を置く (ローテーション後のファイルも単独で読める)
+        *out++ = LOGF_SYNC;
+        memcpy(out, &now_ms, sizeof(now_ms));
+        out += sizeof(now_ms);
+        g_log_last_ms = now_ms;
+    }
+    *out++ = (uint8_t)id;
+    out = log_put_varint(out, now_ms - g_log_last_ms);
+    g_log_last_ms = now_ms;
+    memcpy(out, rec + 8, body);
+    out += body;
+    g_log_len = (uint32_t)(out - (uint8_t *)g_log_buf);
+    if (!g_log_session || g_log_len >= LOG_FLUSH_THRESHOLD)
+        log_flush();
+}
+
+static void log_append_binary(unsigned id, ...)
+{
+    va_list args;
+    va_start(args, id);
+    log_append_binary_va(id, args);
+    va_end(args);
+}
+
+// テキストの 1 行を UART とバッファに出力する
+static void log_append_text(const char *buf)
+{
+    // 1. UARTに出力 (常に実行)
+    printf("%s", buf);
+
+    // 2. ファイルに出力 (有効な場合のみ)
+    // ■ 変更: バッファに溜める。スクリプト実行中でなければすぐに書き込む
+    if (!g_log_enabled || g_log_stopped)
+        return;
+    const uint32_t len = (uint32_t)strlen(buf);
+    if (g_log_len + len > LOG_BUF_SIZE)
+        log_flush();
+    memcpy(g_log_buf + g_log_len, buf, len);
+    g_log_len += len;
+    if (!g_log_session || g_log_len >= LOG_FLUSH_THRESHOLD)
+        log_flush();
+}
+
+// --- システムログ関数 (UART + ファイル出力) ---
+// ■ 変更: バイナリログのときは UART には出さず、整形済みの文字列を LOGF_TEXT として記録する
+extern "C" void SystemLog(const char *fmt, ...)
+{
+    char buf[256];
+
+    // 文字列整形
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (g_log_binary)
+    {
+        if (g_log_enabled && !g_log_stopped)
+            log_append_binary(LOGF_TEXT, buf);
+        return;
     }
+    log_append_text(buf);
+}
+
+// ■ 追加: 書式表の番号で記録する。バイナリログでは整形せずに引数をそのまま書き込む
+extern "C" void SystemLogFmt(unsigned id, ...)
+{
+    if (id == LOGF_SYNC || id >= LOGF_COUNT)
+        return;
+    va_list args;
+    va_start(args, id);
+    if (g_log_binary)
+    {
+        if (g_log_enabled && !g_log_stopped)
+            log_append_binary_va(id, args);
+    }
+    else
+    {
+        char buf[256];
+        vsnprintf(buf, sizeof(buf), kLogFormats[id], args);
+        log_append_text(buf);
+    }
+    va_end(args);
 }
 // Helper used by ScriptProcessor to apply color without pulling WS2812 header into that TU
 // Matches extern declaration in ScriptProcessor.cpp: extern void ApplyStripColor(int r, int g, int b);
@@ -789,7 +1054,9 @@ extern "C" void SignalRuntimeError(const char *msg, int line_num, const char *li
     printf("Msg  : %s\n", msg);
 
     // 2. ログファイルへの保存 (LittleFS)
-    if (lfs_mount(&fs, &lfs_pico_flash_config) == 0)
+    // ■ 変更: 溜まっているログを先に書き、実行中のログのマウントがあればそれを使う
+    log_flush();
+    if (log_fs_acquire())
     {
         lfs_file_t f;
         // 追記モード(APPEND)で開く。ファイルがなければ作成(CREAT)
@@ -821,8 +1088,12 @@ extern "C" void SignalRuntimeError(const char *msg, int line_num, const char *li
         {
             printf("Failed to open errorlog.txt (err=%d)\n", err);
         }
-        lfs_unmount(&fs);
+        log_fs_release();
     }
+    SystemLogEnd(); // 溜まっているログを書き切ってからトレースを書く (マウントはインタプリタと共有)
+
+    // ■ 追加: 2.5 エラーに至るまでの実行トレースを保存 (DEBUG(1) のときのみ)
+    ScriptTraceFlush();
 
     // 3. LED通知 (紫色点滅)
     if (ledStrip1)
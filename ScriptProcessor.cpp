@@ -9,18 +9,26 @@
 #include <cmath>
 #include <random>
 #include <cstdarg>
+#include <algorithm>
+#include <strings.h> // strcasecmp用
 #include <malloc.h> // mallinfo用
 #include <unistd.h> // sbrk用
 #include <new>      // std::bad_alloc用
+#include <memory>
 // 外部関数宣言の更新
 extern "C" void SignalRuntimeError(const char *msg, int line_num, const char *line_content, const char *expanded_content);
 
 // スタックポインタを取得するインラインアセンブラ
 static inline uint32_t get_stack_pointer()
 {
+#if defined(__arm__)
     uint32_t sp;
     __asm__ volatile("mov %0, sp" : "=r"(sp));
     return sp;
+#else
+    // ■ 追加: ホスト用シミュレータ (sim/) ではフレームアドレスで代用する (伸びの差分にしか使わない)
+    return (uint32_t)(uintptr_t)__builtin_frame_address(0);
+#endif
 }
 
 // メモリ監視用定数 (3KB)
@@ -33,6 +41,10 @@ static const size_t MAX_STACK_DEPTH = 4096;
 // 空きメモリ計算
 static uint32_t get_free_memory()
 {
+#if !defined(__arm__)
+    // ■ 追加: ホストではスタックとヒープの位置関係が RP2040 と違うため、RAM の不足は模擬しない
+    return 64u * 1024 * 1024;
+#else
     char *heap_end = (char *)sbrk(0);  // 現在のヒープ末尾
     uint32_t sp = get_stack_pointer(); // 現在のスタック位置
     struct mallinfo m = mallinfo();
@@ -43,12 +55,67 @@ static uint32_t get_free_memory()
         return (uint32_t)((uintptr_t)sp - (uintptr_t)heap_end) + m.fordblks;
     }
     return m.fordblks;
+#endif
 }
+
+// ■ 追加: 軽量メモリガード
+// get_free_memory() は mallinfo() によるヒープ全走査を伴うため毎行は呼ばない。
+// 完全チェック時の「空き - MIN_FREE_MEMORY_BYTES」を予算として保持し、
+//   - インタプリタが確保した領域 (memory_guard_charge / memory_guard_reserve で申告したバイト数)
+//   - 完全チェック時からのスタックの伸び (スタックポインタのウォーターマーク)
+// を差し引いて、予算を使い切ったとき・ヒープ末尾 (sbrk) が動いたとき・一定行数ごとにだけ完全チェックする。
+// 申告しない確保 (式の一時文字列や littlefs のバッファ等) は sbrk の変化と定期チェックで拾う。
+static const uint32_t MEM_FULL_CHECK_INTERVAL = 256; // 何行ごとに必ず完全チェックするか
+static volatile int32_t g_mem_budget = 0;            // 予算 (バイト)。0 以下で完全チェック要求
+static uint32_t g_mem_check_sp = 0;                  // 完全チェック時のスタックポインタ
+static char *g_mem_check_heap_end = nullptr;         // 完全チェック時のヒープ末尾
+static uint32_t g_mem_check_countdown = 0;
+
+static bool memory_guard_ok()
+{
+    uint32_t sp = get_stack_pointer();
+    int32_t stack_growth = (sp < g_mem_check_sp) ? (int32_t)(g_mem_check_sp - sp) : 0;
+    if (g_mem_budget - stack_growth > 0 && --g_mem_check_countdown > 0 && (char *)sbrk(0) == g_mem_check_heap_end)
+        return true;
+
+    uint32_t free_mem = get_free_memory();
+    g_mem_check_sp = sp;
+    g_mem_check_heap_end = (char *)sbrk(0);
+    g_mem_check_countdown = MEM_FULL_CHECK_INTERVAL;
+    g_mem_budget = (int32_t)free_mem - (int32_t)MIN_FREE_MEMORY_BYTES;
+    return free_mem >= MIN_FREE_MEMORY_BYTES;
+}
+
+// ■ 変更: インタプリタが実行中に確保する領域は、確保の前にここで予算から差し引く
+// (グローバルな operator new は置き換えない。USB・LED・littlefs などインタプリタ以外の確保には関わらない)
+// 小さな確保は charge で差し引くだけ、DIM の配列などの大きな確保は reserve で予算を確かめてから差し引く。
+static inline void memory_guard_charge(size_t bytes)
+{
+    g_mem_budget -= (int32_t)std::min<size_t>(bytes, INT32_MAX);
+}
+
+// 予算が足りなければ完全チェックで測り直し、それでも足りなければ false (呼び出し側は確保しない)
+static bool memory_guard_reserve(size_t bytes)
+{
+    if (bytes > INT32_MAX)
+        return false;
+    if (g_mem_budget < (int32_t)bytes)
+        g_mem_budget = 0;
+    if (!memory_guard_ok() || g_mem_budget < (int32_t)bytes)
+        return false;
+    g_mem_budget -= (int32_t)bytes;
+    return true;
+}
+
 // 外部関数の宣言に追加
-extern "C" void ConfigureLog(uint32_t size_kb, bool overwrite);
+extern "C" void ConfigureLog(uint32_t size_kb, bool overwrite, bool binary);
 
 // ■ 追加: 外部関数の宣言
 extern "C" void SystemLog(const char *fmt, ...);
+extern "C" void SystemLogBegin(); // ■ 追加: 実行中はログを RAM に溜め、マウントを保持する
+extern "C" void SystemLogEnd();
+extern "C" bool SystemLogIdle();
+extern "C" void SystemLogFmt(unsigned id, ...);
 
 static bool g_script_debug = false;
 
@@ -72,10 +139,24 @@ static void dbg_printf(const char *fmt, ...)
 // redirect printf in this TU to dbg_printf so DEBUG(...) controls output
 #define printf(...) dbg_printf(__VA_ARGS__)
 
+// ■ 追加: 実行中によく出るメッセージは書式表 (log_formats.h) の番号で記録する。
+// バイナリログ (LogConfig(..., BINARY)) では整形せずに引数だけを書き込むので、double の整形も行われない。
+#define log_fmt(id, ...)                      \
+    do                                        \
+    {                                         \
+        if (g_script_debug)                   \
+            SystemLogFmt((id), __VA_ARGS__);  \
+    } while (0)
+
 #include "pico/stdlib.h"
+#include "hardware/divider.h"
+#include "hardware/sync.h"
+#include "hardware/structs/rosc.h"
 #include "lfs.h"
 #include "tusb.h"
 #include "usb_descriptors.h"
+#include "log_formats.h"
+#include "script_stats.h"
 
 #include "tinyexpr-plusplus/tinyexpr.h"
 #include "TinyUSB_Mouse_and_Keyboard/TinyUSB_Mouse_and_Keyboard.h"
@@ -97,13 +178,28 @@ extern void ApplyStripColor(int r, int g, int b);
 //
 // 注意／簡略化点:
 // - ジャンプは生の char* ではなく行インデックス (int) を使用します。
-// - 変数は全て double 型で map に保存し、tinyexpr にはポインタで渡します。
+// - 変数は全て double 型で、ロード時に割り当てたスロット配列に保存し、tinyexpr にはポインタで渡します。
 // - コマンド名は大文字小文字を区別しません。変数名・ラベル名は区別します。
 // - 式の評価には tinyexpr-plusplus を使用します。
 // - スクリプト読み込みは FATFS (FF) を利用します。
 
-extern const struct lfs_config lfs_pico_flash_config;
-static lfs_t g_lfs;
+// ■ 変更: ログ (Pico_AutoInput.cpp の SystemLog) と同じ lfs_t を参照カウント付きで共有する
+// ページ実行中はスクリプトファイルを開いたままにするため、MOUSERUN などもマウント済みの g_lfs を使う。
+// 別の lfs_t でマウントすると、ログの書き込みで空きブロックの情報が古くなり、後の書き込みで壊れる。
+extern lfs_t fs;
+extern "C" int SharedFsMount();
+extern "C" void SharedFsUnmount();
+static lfs_t &g_lfs = fs;
+
+static int script_fs_mount()
+{
+    return SharedFsMount();
+}
+
+static void script_fs_unmount()
+{
+    SharedFsUnmount();
+}
 
 // tud_task wrapper: call underlying tud_task() only when forced or at least 5ms elapsed since last call.
 // This reduces excessive invocations while allowing HID operations to request immediate processing.
@@ -143,19 +239,138 @@ static uint64_t g_script_start_us = 0; // script start in microseconds
 // and can bloat the binary). Seed the engine at script start instead.
 static std::mt19937_64 g_rand_engine;
 
+// ■ 追加: 乱数エンジン
+// 既定は xoshiro128** (32bit の加算・XOR・シフト・回転だけで 1 語を作る。M0+ で 64bit 演算も浮動小数点も使わない)。
+// RandEngine(MT19937) で従来の std::mt19937_64 に切り替えられる。Rand / RandInt / RandNormal はどちらのエンジンでも
+// rand_u32() の 32bit の値から作る (分布オブジェクトは毎回作らない)。
+// 種はスクリプト開始時にリングオシレータ (ROSC) の乱数ビットと時刻から作り、Seed(n) で固定できる (再現用)。
+enum class RandEngineKind : uint8_t
+{
+    XOSHIRO128,
+    MT19937,
+};
+static RandEngineKind g_rand_kind = RandEngineKind::XOSHIRO128;
+static uint32_t g_xoshiro[4] = {1, 2, 3, 4};
+static bool g_normal_has_spare = false; // RandNormal は 2 個ずつ作るので、残りの 1 個を次の呼び出しで返す
+static float g_normal_spare = 0.0f;
+
+static inline uint32_t rotl32(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t rand_u32()
+{
+    if (g_rand_kind == RandEngineKind::MT19937)
+        return static_cast<uint32_t>(g_rand_engine() >> 32);
+    uint32_t *s = g_xoshiro;
+    const uint32_t result = rotl32(s[1] * 5u, 7) * 9u;
+    const uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl32(s[3], 11);
+    return result;
+}
+
+static inline uint32_t splitmix32(uint32_t &x)
+{
+    uint32_t z = (x += 0x9e3779b9u);
+    z = (z ^ (z >> 16)) * 0x85ebca6bu;
+    z = (z ^ (z >> 13)) * 0xc2b2ae35u;
+    return z ^ (z >> 16);
+}
+
+// 両方のエンジンに同じ種を与える (xoshiro の状態は splitmix32 で広げ、全 0 にならないようにする)
+static void rand_seed(uint64_t seed)
+{
+    uint32_t lo = static_cast<uint32_t>(seed);
+    uint32_t hi = static_cast<uint32_t>(seed >> 32);
+    for (uint32_t &w : g_xoshiro)
+        w = splitmix32(lo) ^ rotl32(splitmix32(hi), 16);
+    if ((g_xoshiro[0] | g_xoshiro[1] | g_xoshiro[2] | g_xoshiro[3]) == 0)
+        g_xoshiro[0] = 1;
+    g_rand_engine.seed(seed);
+    g_normal_has_spare = false;
+}
+
+// ROSC の乱数ビット (クロックのジッタ) と起動からの時刻を混ぜた 64bit の種
+static uint64_t rand_entropy_seed()
+{
+    uint64_t v = time_us_64();
+    for (int i = 0; i < 64; ++i)
+    {
+        v = (v << 1 | v >> 63) ^ (rosc_hw->randombit & 1u);
+        for (volatile int d = 0; d < 8; ++d) // 連続した読み出しの相関を弱める
+        {
+        }
+    }
+    return v ^ ((uint64_t)time_us_64() << 32);
+}
+
 static te_type te_IsPressed()
 {
     return bb_get_bootsel_button() ? static_cast<te_type>(1.0) : static_cast<te_type>(0.0);
 }
 
+// ■ 変更: [a, b) の一様乱数 (32bit の分解能)
 static te_type te_Rand(te_type a, te_type b)
 {
     if (a > b)
     {
         std::swap(a, b);
     }
-    std::uniform_real_distribution<double> dist(static_cast<double>(a), static_cast<double>(b));
-    return static_cast<te_type>(dist(g_rand_engine));
+    return static_cast<te_type>(a + (b - a) * (rand_u32() * (1.0 / 4294967296.0)));
+}
+
+// ■ 追加: [a, b] の整数の一様乱数 (端は四捨五入。偏りのない Lemire の方法)
+static te_type te_RandInt(te_type a, te_type b)
+{
+    if (a > b)
+    {
+        std::swap(a, b);
+    }
+    const int32_t lo = static_cast<int32_t>(round(a));
+    const int32_t hi = static_cast<int32_t>(round(b));
+    const uint32_t range = static_cast<uint32_t>(hi) - static_cast<uint32_t>(lo) + 1u; // 0 なら 2^32 通り
+    if (range == 0)
+        return static_cast<te_type>(static_cast<int32_t>(rand_u32()));
+    uint64_t m = (uint64_t)rand_u32() * range;
+    if ((uint32_t)m < range)
+    {
+        const uint32_t threshold = (0u - range) % range;
+        while ((uint32_t)m < threshold)
+            m = (uint64_t)rand_u32() * range;
+    }
+    return static_cast<te_type>(lo + static_cast<int32_t>(m >> 32));
+}
+
+// ■ 追加: 平均 mean・標準偏差 sd の正規乱数 (Marsaglia の極座標法。単精度で計算する)
+static te_type te_RandNormal(te_type mean, te_type sd)
+{
+    float z;
+    if (g_normal_has_spare)
+    {
+        g_normal_has_spare = false;
+        z = g_normal_spare;
+    }
+    else
+    {
+        float u, v, s;
+        do
+        {
+            u = static_cast<int32_t>(rand_u32()) * (1.0f / 2147483648.0f);
+            v = static_cast<int32_t>(rand_u32()) * (1.0f / 2147483648.0f);
+            s = u * u + v * v;
+        } while (s >= 1.0f || s == 0.0f);
+        const float m = sqrtf(-2.0f * logf(s) / s);
+        g_normal_spare = v * m;
+        g_normal_has_spare = true;
+        z = u * m;
+    }
+    return mean + sd * static_cast<te_type>(z);
 }
 
 static te_type te_GetTime()
@@ -168,6 +383,15 @@ static te_type te_GetTime()
     uint64_t ms = delta_us / 1000u;
     return static_cast<te_type>(ms);
 }
+
+// ■ 追加: スクリプト開始からの経過時間 (us)
+static te_type te_GetTimeUs()
+{
+    if (g_script_start_us == 0)
+        return static_cast<te_type>(0.0);
+    uint64_t now_us = time_us_64();
+    return static_cast<te_type>((now_us >= g_script_start_us) ? (now_us - g_script_start_us) : 0);
+}
 // --- 数学ヘルパー関数 ---
 static te_type te_deg2rad(te_type deg)
 {
@@ -179,13 +403,436 @@ static te_type te_rad2deg(te_type rad)
     return rad * 180.0 / 3.14159265358979323846;
 }
 
+// ■ 追加: 配列 (DIM)。式中の name(i) はコンパイル時に __A(<配列番号>, i) へ置き換えて参照する
+static std::vector<std::vector<double>> *g_script_arrays = nullptr; // 実行中スクリプトの配列
+static const char *g_expr_error = nullptr; // 式の評価中に検出したエラーの詳細 (NaN を返したときのメッセージ)
+
+// 配列要素へのポインタ (添字の小数部は切り捨て)。範囲外なら g_expr_error を設定して nullptr
+static double *array_elem(int id, double idx)
+{
+    std::vector<double> &arr = (*g_script_arrays)[id];
+    if (!(idx >= 0.0 && idx < static_cast<double>(arr.size())))
+    {
+        g_expr_error = arr.empty() ? "Array not dimensioned (DIM)" : "Array index out of range";
+        return nullptr;
+    }
+    return &arr[static_cast<size_t>(idx)];
+}
+
+static te_type te_ArrayGet(te_type id, te_type idx)
+{
+    const double *p = array_elem(static_cast<int>(id), idx);
+    return p ? *p : std::numeric_limits<te_type>::quiet_NaN();
+}
+
+// ■ 追加: コンパイル済み命令のオペコード
+enum class Op : uint8_t
+{
+    NOP, // 空行・コメント・LABEL・未知のコマンド
+    END,
+    WAIT,
+    WAIT_US,    // ■ 追加: WAITUS <microseconds>
+    WAIT_UNTIL, // ■ 追加: WAITUNTIL <cond>, <timeout>, <poll>[, <var>]
+    AT,         // ■ 追加: AT <seconds>  (スクリプト開始からの絶対時刻まで待つ)
+    PRINT,
+    SET,
+    SETI, // ■ 追加: SETI <var> = <expression> (32bit 整数で評価)
+    // ■ 追加: 配列
+    DIM,        // DIM <name>(<size>)
+    SET_ARRAY,  // SET <name>(<index>) = <expression>
+    LOAD_TABLE, // LoadTable("file", <name>[, <count_var>])
+    // ■ 追加: 協調マルチタスク
+    SPAWN, // SPAWN <label>  (target から新しいタスクを開始)
+    JOIN,  // SPAWN したタスクがすべて終わるまで待つ
+    // ■ 追加: イベントハンドラ
+    ON_EVENT, // ON PRESS|RELEASE GOSUB <label> / ON PRESS|RELEASE OFF
+    EVERY,    // EVERY <sec> GOSUB <label>  (sec <= 0 で解除)
+    IF_GOTO,
+    GOTO,
+    GOSUB,
+    RETURN,
+    LOG_CONFIG,
+    MODE,
+    USE_LED,
+    DEBUG,
+    PROFILE, // ■ 追加
+    SEED,        // ■ 追加: Seed(<expression>)
+    RAND_ENGINE, // ■ 追加: RandEngine(XOSHIRO128|MT19937)
+    TIMING_RESYNC, // ■ 追加: TimingResync(<expression>)
+    SET_LED,
+    KEY_PRESS,
+    KEY_RELEASE,
+    KEY_PUSH_FOR,
+    KEY_TYPE,
+    MOUSE_MOVE,
+    MOUSE_PRESS,
+    MOUSE_RELEASE,
+    MOUSE_PUSH_FOR,
+    MOUSERUN,
+    PROCON_PRESS,
+    PROCON_RELEASE,
+    PROCON_PUSH_FOR,
+    PROCON_HAT,
+    PROCON_JOY,
+    // ■ 追加: 構造化制御構文
+    FOR,           // FOR <var> = <start> TO <limit> [STEP <step>]  (範囲外なら target = NEXT の次へ)
+    NEXT,          // カウンタ更新と終了判定をネイティブに行い、継続なら target = FOR の次へ
+    JUMP_IF_FALSE, // WHILE / IF ... THEN (偽なら target へ)
+};
+
+// ■ 追加: 数値モード (Numeric ディレクティブ)
+// DOUBLE は従来通り tinyexpr で double 評価する。FLOAT32 / FIXED16_16 では式をネイティブの命令列 (RpnProgram) に
+// 変換し、float (RP2040 では bootrom の高速ルーチン) または Q16.16 整数演算で評価する。
+// 変換できない式 (未対応の関数・あいまいな優先順位など) は tinyexpr で評価し、結果をモードの精度に丸める。
+enum class NumMode : uint8_t
+{
+    DOUBLE,
+    FLOAT32,
+    FIXED16_16,
+};
+
+enum class RpnOp : uint8_t
+{
+    CONST,
+    VAR,
+    NEG,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    MOD,
+    POW,
+    LT,
+    LE,
+    GT,
+    GE,
+    EQ,
+    NE,
+    AND,
+    OR,
+    CALL,
+    ARRAY, // 添字を取り出し、配列 i の要素を積む
+};
+
+enum class RpnFn : uint8_t
+{
+    SIN,
+    COS,
+    TAN,
+    ASIN,
+    ACOS,
+    ATAN,
+    SQRT,
+    ABS,
+    FLOOR,
+    CEIL,
+    ROUND,
+    TRUNC,
+    EXP,
+    LN,
+    LOG10,
+    DEG2RAD,
+    RAD2DEG,
+    ATAN2,
+    POW,
+    MOD,
+    MIN,
+    MAX,
+    ISPRESSED,
+    GETTIME,
+    GETTIMEUS,
+    RAND,
+    RANDINT,
+    RANDNORMAL,
+};
+
+struct RpnInstr
+{
+    RpnOp op = RpnOp::CONST;
+    RpnFn fn = RpnFn::SIN;
+    int32_t i = 0; // VAR: スロット / ARRAY: 配列番号 / CONST (FIXED16_16): Q16.16 値
+    int32_t n = 0; // CONST (SETI): 整数値
+    float f = 0.0f; // CONST (FLOAT32)
+};
+
+struct RpnProgram
+{
+    std::vector<RpnInstr> code;
+    bool int_ok = true; // 整数以外の定数や整数で計算できない関数を含まない (SETI でネイティブ評価できる)
+};
+
+// ■ 追加: 式の実行時キャッシュ
+// 同じ式を何度実行しても tinyexpr のコンパイルは一度だけ行い、以後は evaluate() のみを呼ぶ。
+// 変数はポインタで束縛されるため値の変化には追従する。新しい変数が登場したとき
+// (var_epoch が進んだとき) だけ、識別子の解釈が変わりうるので再コンパイルする。
+struct ScriptExpr
+{
+    std::string text;                  // 元の式 (ログ用)
+    std::unique_ptr<te_parser> parser; // コンパイル済みの式
+    uint32_t var_epoch = 0;            // コンパイル時の変数世代 (0 = 未コンパイル)
+    bool is_const = false;             // 数値リテラルのみの式は tinyexpr を使わない
+    double const_val = 0.0;
+    // ■ 追加: オプティマイザの結果
+    std::vector<int> memos;            // 評価前に有効化するメモ (式中で直接参照する __M_k)
+    int direct_memo = -1;              // 式全体がメモと同じ場合はその番号 (tinyexpr を通さない)
+    uint16_t folded = 0;               // コンパイル時に畳み込んだ部分式の数 (統計用)
+    uint16_t memo_dups = 0;            // 同じメモを 2 回目以降に参照する箇所の数 (統計用)
+    // ■ 追加: FLOAT32 / FIXED16_16 モードのネイティブ命令列 (変換できない式は nullptr のまま)
+    std::unique_ptr<RpnProgram> rpn;
+    bool rpn_tried = false;
+
+    ScriptExpr(std::string t) : text(std::move(t))
+    {
+        // "0.3" や "-255" のような単純な数値リテラルはロード時に確定させる
+        const char *p = text.c_str();
+        if (*p == '-')
+            ++p;
+        bool digits = false;
+        bool simple = (*p != '\0');
+        for (; *p; ++p)
+        {
+            if (*p >= '0' && *p <= '9')
+                digits = true;
+            else if (*p != '.')
+                simple = false;
+        }
+        if (simple && digits)
+        {
+            char *endp = nullptr;
+            const_val = strtod(text.c_str(), &endp);
+            is_const = (endp && *endp == '\0');
+        }
+    }
+};
+
+// ■ 追加: 1行分のコンパイル結果 (オペコード + 解析済みオペランド)
+struct Instr
+{
+    Op op = Op::NOP;
+    int target = -1;                // 解決済みジャンプ先の行インデックス (未定義ラベルは -1)
+    int ival = 0;                   // 変数スロット / キーコード / ボタン / Hat / USBモード / LogConfigのモード
+    int aux = 0;                    // FOR / NEXT のループ番号 / LoadTable の件数を受け取る変数スロット (-1 なし) / LogConfig の BINARY
+    std::string text;               // KeyPress/KeyTypeのキー列、Mouserun/LoadTableのファイル名
+    std::vector<ScriptExpr> exprs;  // 実行時に評価する式
+};
+
+// ■ 追加: ページ実行モード
+// RAM に載りきらないスクリプトは全体を読み込まず、SCRIPT_PAGE_LINES 行単位の「ページ」として
+// littlefs から必要なときに読み込み、その場でコンパイルして小さな LRU キャッシュに保持する。
+static const int SCRIPT_PAGE_LINES = 32; // 1ページの行数
+static const int SCRIPT_PAGE_CACHE = 4;  // キャッシュするページ数
+
+struct ScriptPage
+{
+    int page_no = -1;                     // 保持しているページ番号 (-1 = 空き)
+    uint32_t last_use = 0;                // LRU 用の最終使用時刻 (use_clock の値)
+    std::unique_ptr<char[]> text;         // ページ内の行テキスト ('\0' 終端。page_buf_size で一度だけ確保し使い回す)
+    std::vector<std::string_view> lines;  // text 内の各行
+    std::vector<Instr> program;           // lines に対応するコンパイル済み命令
+};
+
+struct PagedScript
+{
+    lfs_file_t fp;                        // 実行中は開いたままにする
+    bool open = false;
+    std::vector<uint32_t> page_offsets;   // 各ページ先頭行のファイル内オフセット (末尾にファイルサイズ)
+    ScriptPage pages[SCRIPT_PAGE_CACHE];
+    uint32_t page_buf_size = 0;           // 各ページのバッファの大きさ (最も長いページ + 1)
+    ScriptPage *current = nullptr;        // 直前に使ったページ (連続実行時は LRU 走査を省く)
+    uint32_t use_clock = 0;
+    // 統計
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint64_t stall_us = 0;                // ページ読み込み＋コンパイルに費やした時間
+};
+
+// ■ 追加: 構造化制御構文 (FOR/NEXT, WHILE/WEND, IF THEN/ELSE/ENDIF) の対応情報
+// プリパスで各ブロックの開始・中間・終了行を対応付けてジャンプ先を記録し、コンパイル時に命令へ埋め込む。
+struct BlockLink
+{
+    int target = -1; // ジャンプ先の行インデックス
+    int loop = -1;   // FOR / NEXT のループ番号 (for_loops の添字)
+};
+
+// FOR ループごとの実行時情報。終了値と増分は FOR 実行時に一度だけ評価する。
+struct ForLoop
+{
+    std::string var;
+    double limit = 0.0;
+    double step = 1.0;
+};
+
+// ■ 追加: 共通部分式／ループ不変式のメモ
+// 値は隠し変数 __M_k のスロットに置き、依存する変数が set_var で書き換えられたときだけ無効化する。
+struct MemoSlot
+{
+    ScriptExpr expr; // メモの定義式 (内側のメモは __M_k に置換済み)
+    int slot = -1;   // 値を置く変数スロット
+    bool valid = false;
+
+    MemoSlot(std::string t, int s) : expr(std::move(t)), slot(s) {}
+};
+
+// ■ 追加: 協調マルチタスク (SPAWN)
+// 各タスクはプログラムカウンタ・GOSUB スタック・待機期限を個別に持つ。WAIT や *PushFor などは眠らずに
+// 期限を設定して制御を返し、スケジューラはその間に実行可能な他のタスクを進める。
+static const int MAX_TASKS = 8;             // メインタスクを含む同時実行数の上限
+static const int TASK_SLICE = 32;           // 1 回の割り当てで続けて実行する最大行数
+static const size_t TASK_STACK_DEPTH = 256; // SPAWN したタスクの GOSUB の深さ上限
+
+struct ScriptTask
+{
+    int pc = 0;
+    bool alive = false;
+    bool joining = false;           // JOIN で他のタスクの終了を待っている
+    uint64_t wake_us = 0;           // この時刻 (time_us_64) まで実行しない
+    uint64_t anchor_us = 0;         // ■ 追加: 直前の待機の期限 (次の待機はここから測る)
+    bool timed = false;             // ■ 追加: wake_us まで眠っている (再開時にオーバーシュートを集計する)
+    int phase = 0;                  // 待機をはさんで複数回に分けて実行する命令 (KeyPushFor など) の進み具合
+    double arg0 = 0.0, arg1 = 0.0;  // 同上の命令が最初に評価した値
+    uint64_t deadline_us = 0;       // ■ 追加: WAITUNTIL の期限 (time_us_64、0 なら無期限)
+    size_t stack_limit = MAX_STACK_DEPTH;
+    std::vector<int> gosub_stack;
+    int event = -1; // ■ 追加: イベントハンドラとして起動したタスクならそのイベント番号
+    int wait_line = -1;      // ■ 追加: プロファイル用。待機に入った行と、その時刻
+    uint64_t wait_from = 0;
+};
+
+// ■ 追加: イベントハンドラ (ON PRESS / ON RELEASE / EVERY)
+// ハンドラは文の実行時に登録 (解除) され、イベントが起きるとラベルから GOSUB と同じように実行する。
+// 割り込まれた側の待機 (WAIT や KeyPushFor の押下中) を壊さないよう、ハンドラは専用のタスクとして起動して最優先で実行する。
+// スケジューラは文の合間に保留中のイベントを調べるので、ハンドラは発生から 1 文以内に始まる。
+//   - BOOTSEL ボタンの読み取りは Flash のチップセレクトを操作するため文ごとには行わず、
+//     タイマー割り込みで周期的にサンプリングして変化を g_event_pending に立てる
+//   - EVERY の期限は時刻の比較だけなので、スケジューラが文の合間とアイドル時に調べる
+static const int MAX_EVERY = 6;                 // EVERY に使えるラベルの数
+static const int EVENT_PRESS = 0;               // イベント番号 (0: PRESS, 1: RELEASE, 2..: EVERY)
+static const int EVENT_RELEASE = 1;
+static const int EVENT_EVERY = 2;
+static const int EVENT_COUNT = EVENT_EVERY + MAX_EVERY;
+static const int64_t EVENT_SAMPLE_US = 5000;     // ボタンのサンプリング周期
+static const uint64_t EVENT_IDLE_STEP_US = 1000; // ボタンのハンドラがある間、アイドル時に一度に眠る上限
+static const uint64_t LOG_IDLE_FLUSH_GAP_US = 100000; // ■ 追加: アイドル時、次の期限までこれ以上あれば溜まったログを書き込む
+static const uint64_t EVERY_MIN_PERIOD_US = 1000;
+
+static volatile uint32_t g_event_pending = 0; // 割り込みで検出したイベント (ビット = イベント番号)
+static volatile uint32_t g_event_watch = 0;   // 割り込みで監視するイベント (PRESS / RELEASE のビット)
+static volatile bool g_event_last_button = false;
+static repeating_timer_t g_event_timer;
+static bool g_event_timer_on = false;
+
+static bool event_timer_cb(repeating_timer_t *)
+{
+    const uint32_t watch = g_event_watch;
+    if (watch)
+    {
+        bool button = bb_get_bootsel_button();
+        if (button != g_event_last_button)
+        {
+            g_event_last_button = button;
+            g_event_pending |= watch & (1u << (button ? EVENT_PRESS : EVENT_RELEASE));
+        }
+    }
+    return true;
+}
+
+struct EventHandler
+{
+    int target = -1;        // ハンドラの行 (-1 = 未登録)
+    int task = -1;          // ハンドラを実行中のタスク
+    uint64_t period_us = 0; // EVERY の周期
+    uint64_t due_us = 0;    // EVERY の次の期限
+};
+
 // ScriptState 定義 (current_line_indexを追加)
+// ■ 追加: 行ごとのプロファイル (PROFILE(1) またはビルド時の SCRIPT_PROFILE=1 で有効)
+// 時間は time_us_64 の差分で測り、32 ビットの値は飽和させる (約 71 分で頭打ち)
+#ifndef SCRIPT_PROFILE
+#define SCRIPT_PROFILE 0
+#endif
+struct LineProfile
+{
+    uint32_t count = 0;   // 実行回数 (待機をはさんで再開した分は数えない)
+    uint32_t exec_us = 0; // 文の実行にかかった時間 (式の評価を含み、待機は含まない)
+    uint32_t eval_us = 0; // そのうち eval_expression の時間
+    uint64_t wait_us = 0; // この行で待機していた時間 (WAIT / KeyPushFor / JOIN など)
+};
+
+// ■ 追加: 実行トレース (DEBUG(1) のとき)
+// 行ごとに SystemLog (littlefs のマウント・追記) を呼ぶとスクリプトが桁違いに遅くなりタイミングも変わるため、
+// 実行した行は RAM のリングバッファに記録するだけにし、スクリプトの終了時 (END / EOF / エラー) に trace.txt へ書き出す。
+static const uint32_t TRACE_ENTRIES = 512; // 直近の何行分を残すか (1 件 20 バイト)
+struct TraceEntry
+{
+    uint32_t t_us;  // スクリプト開始からの時間 (約 71 分で一周する)
+    uint32_t line;  // 行インデックス
+    uint8_t op;     // Op
+    uint8_t task;   // 実行したタスク
+    int32_t key;    // 命令の整数オペランド (キーコード / ボタン / 変数スロットなど)
+    float value;    // その行で最後に評価した式の値 (評価しなかった行は NaN)
+};
+struct TraceBuffer
+{
+    std::unique_ptr<TraceEntry[]> entries; // DEBUG(1) を最初に実行したときに確保する
+    uint32_t total = 0;                    // 記録した件数 (entries[total % TRACE_ENTRIES] が次の書き込み先)
+    TraceEntry *cur = nullptr;             // 実行中の行のエントリ (式の値を書き込む)
+    bool flushed = false;
+};
+
+// ■ 追加: 待機の時間軸を測り直すまでの遅れの既定値 (TimingResync で変更できる)
+static const uint64_t TIMING_RESYNC_DEFAULT_US = 50000;
+
 struct ScriptState
 {
-    std::vector<std::string> lines;
+    // ■ 変更: スクリプトはファイル全体を 1 つの連続バッファ (arena) に読み込み、各行はその中を指すビューで持つ。
+    // 各行は arena 内で '\0' 終端されている (改行・'\r' は取り除き済み) ため、data() をそのまま C 文字列として使える。
+    std::unique_ptr<char[]> arena;
+    std::vector<std::string_view> lines;
+    std::vector<Instr> program; // ■ 追加: lines と同じインデックスで対応するコンパイル済み命令
+    // ■ 追加: 総行数と、ページ実行モードの状態 (paged の間は lines / program / arena は空)
+    size_t line_count = 0;
+    bool paged = false;
+    PagedScript pager;
     std::map<std::string, int> label_to_index;
-    std::vector<int> gosub_stack;
-    std::map<std::string, double> vars;
+    std::map<int, BlockLink> block_links; // ■ 追加: 行インデックス -> ブロックのジャンプ先
+    std::vector<ForLoop> for_loops;       // ■ 追加
+    // ■ 変更: GOSUB スタックはタスクごとに持つ (tasks[0] がメインタスク)
+    std::vector<ScriptTask> tasks;
+    int cur_task = 0;
+    bool yield = false; // 実行中のタスクが待機に入った (スケジューラに制御を返す)
+    // ■ 追加: イベントハンドラ
+    EventHandler events[EVENT_COUNT];
+    std::map<std::string, int> every_ids; // EVERY のラベル -> イベント番号 (プリパスで割り当てる)
+    uint32_t events_armed = 0;            // 登録中のイベント
+    uint32_t events_due = 0;              // 発生したがまだハンドラを起動していないイベント
+    uint64_t every_next_us = UINT64_MAX;  // 登録中の EVERY のうち最も早い期限
+    int urgent_task = -1;                 // 次に必ず実行するタスク (起動したばかりのハンドラ)
+    // ■ 変更: 変数はロード時に整数スロットへ割り当て、値は固定長の配列に保持する。
+    // var_values はコンパイル後にサイズが確定し以後再確保しないため、tinyexpr は要素へのポインタを直接保持できる。
+    // (ページ実行モードのみ、新しいページで変数が増えたときに拡張し var_epoch を進める)
+    // 名前 -> スロットの表は式のコンパイルと診断 (expand_line_variables, エラーログ) にのみ使う。
+    std::map<std::string, int> var_slots;
+    std::vector<std::string> var_names;
+    std::vector<double> var_values;
+    std::vector<uint8_t> var_defined; // 一度でも SET されたスロットは 1 (未定義変数の参照はエラーのまま)
+    // ■ 追加: 配列。名前と番号はプリパスで DIM から登録し、要素は DIM / LoadTable の実行時に確保する
+    std::map<std::string, int> array_ids;
+    std::vector<std::vector<double>> arrays;
+    // ■ 追加: 変数の世代。新しい変数が作られるたびに進め、式キャッシュを無効化する
+    uint32_t var_epoch = 1;
+    // ■ 追加: オプティマイザのメモと、変数スロット -> そのスロットに依存するメモの表 (通常モードのみ)
+    std::vector<MemoSlot> memos;
+    std::vector<std::vector<int>> slot_memos;
+    uint32_t opt_memo_hits = 0;    // 有効なメモを再利用した回数 (= 省略した評価回数)
+    uint32_t opt_memo_evals = 0;   // メモを計算し直した回数
+    uint32_t opt_folded_evals = 0; // 畳み込み済みの部分式により省略した評価回数
+    // ■ 追加: 数値モードと、ネイティブ評価／tinyexpr に回った式の数
+    NumMode num_mode = NumMode::DOUBLE;
+    uint32_t num_native_exprs = 0;
+    uint32_t num_fallback_exprs = 0;
+    // ■ 追加: tinyexpr に渡す変数／関数集合 (te_vars_epoch == var_epoch の間は再利用する)
+    std::set<te_variable> te_vars;
+    uint32_t te_vars_epoch = 0;
     bool end_flag = false;
     bool use_led = false;
     bool debug_exec = false;
@@ -193,16 +840,103 @@ struct ScriptState
 
     // ■ 追加: 現在実行中の行番号
     int current_line_index = 0;
+
+    // ■ 追加: 実行した命令数 (行/秒の計測用)
+    uint32_t executed_count = 0;
+    uint64_t eval_count = 0; // ■ 追加: eval_expression の呼び出し回数 (ScriptGetRunStats 用)
+
+    // ■ 追加: TimingResync(sec)。時間軸からこれ以上遅れたら今から測り直す (0 = 測り直さず遅れを取り戻す)
+    uint64_t resync_us = TIMING_RESYNC_DEFAULT_US;
+
+    // ■ 追加: 実行トレース
+    TraceBuffer trace;
+
+    // ■ 追加: プロファイル (prof は最初に有効にしたとき line_count 要素で確保し、以後は再確保しない)
+    bool profile = false;
+    std::vector<LineProfile> prof;
 };
 
+// ■ 追加: 行テキスト (エラーログ・デバッグ表示用) を C 文字列で返す。
+// ページ実行モードでは読み込み済みのページだけを見る (実行中の行は必ず読み込み済み)。
+static const char *line_cstr(const ScriptState &st, int idx, const char *fallback)
+{
+    if (idx < 0 || idx >= (int)st.line_count)
+        return fallback;
+    if (!st.paged)
+        return st.lines[idx].data();
+    const int page_no = idx / SCRIPT_PAGE_LINES;
+    for (const ScriptPage &p : st.pager.pages)
+    {
+        if (p.page_no == page_no && (size_t)(idx % SCRIPT_PAGE_LINES) < p.lines.size())
+            return p.lines[idx % SCRIPT_PAGE_LINES].data();
+    }
+    return fallback;
+}
+
+// ■ 追加: プロファイル
+static inline void prof_add(uint32_t &acc, uint64_t us)
+{
+    const uint64_t v = (uint64_t)acc + us;
+    acc = v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+// 集計表は実行中に再確保しないよう、最初に有効にしたときに全行分を確保する
+static void profile_enable(ScriptState &st, bool on)
+{
+    if (on && st.prof.empty())
+    {
+        const uint32_t req = (uint32_t)(st.line_count * sizeof(LineProfile)) + 4096;
+        if (st.line_count == 0 || !memory_guard_reserve(req))
+        {
+            printf("PROFILE: not enough memory (Req: %lu)\r\n", (unsigned long)req);
+            st.profile = false;
+            return;
+        }
+        st.prof.resize(st.line_count);
+    }
+    st.profile = on;
+}
+
+// ■ 追加: 実行トレース
+static void trace_enable(ScriptState &st)
+{
+    if (st.trace.entries)
+        return;
+    const uint32_t req = TRACE_ENTRIES * sizeof(TraceEntry) + 4096;
+    if (!memory_guard_reserve(req))
+    {
+        printf("DEBUG: not enough memory for the trace buffer (Req: %lu)\r\n", (unsigned long)req);
+        return;
+    }
+    st.trace.entries.reset(new (std::nothrow) TraceEntry[TRACE_ENTRIES]);
+}
+
+static inline void trace_append(ScriptState &st, int line, const Instr &in)
+{
+    TraceBuffer &tr = st.trace;
+    if (!tr.entries)
+        return;
+    TraceEntry &e = tr.entries[tr.total % TRACE_ENTRIES];
+    e.t_us = (uint32_t)(time_us_64() - g_script_start_us);
+    e.line = (uint32_t)line;
+    e.op = (uint8_t)in.op;
+    e.task = (uint8_t)st.cur_task;
+    e.key = in.ival;
+    e.value = NAN;
+    tr.cur = &e;
+    ++tr.total;
+}
+
 // 変数展開ヘルパー (ScriptState定義の後に配置)
 static std::string expand_line_variables(ScriptState &st, const std::string &line)
 {
     std::string expanded = line;
-    for (auto const &kv : st.vars)
+    for (auto const &kv : st.var_slots)
     {
-        std::string name = kv.first;
-        double val = kv.second;
+        if (!st.var_defined[kv.second])
+            continue;
+        const std::string &name = kv.first;
+        double val = st.var_values[kv.second];
         std::string valStr = std::to_string(val);
 
         size_t pos = 0;
@@ -226,7 +960,7 @@ static std::string expand_line_variables(ScriptState &st, const std::string &lin
     return expanded;
 }
 // ヘルパー：文字列の前後の空白を取り除く
-static inline std::string trim(const std::string &s)
+static inline std::string trim(std::string_view s)
 {
     size_t a = 0;
     while (a < s.size() && (s[a] == ' ' || s[a] == '\t' || s[a] == '\r'))
@@ -234,7 +968,7 @@ static inline std::string trim(const std::string &s)
     size_t b = s.size();
     while (b > a && (s[b - 1] == ' ' || s[b - 1] == '\t' || s[b - 1] == '\r' || s[b - 1] == '\n'))
         --b;
-    return s.substr(a, b - a);
+    return std::string(s.substr(a, b - a));
 }
 
 // コマンド比較（大文字小文字を無視する）
@@ -283,7 +1017,24 @@ static std::string mangle_expression_identifiers(ScriptState &st, const std::str
                     break;
             }
             std::string ident = expr.substr(i, j - i);
-            if (st.vars.find(ident) != st.vars.end())
+            // ■ 追加: 配列参照 name( -> __A(<配列番号>,
+            auto ai = st.array_ids.find(ident);
+            if (ai != st.array_ids.end())
+            {
+                size_t k = j;
+                while (k < expr.size() && isspace((unsigned char)expr[k]))
+                    ++k;
+                if (k < expr.size() && expr[k] == '(')
+                {
+                    out += "__A(";
+                    out += std::to_string(ai->second);
+                    out += ",";
+                    i = k + 1;
+                    continue;
+                }
+            }
+            auto it = st.var_slots.find(ident);
+            if (it != st.var_slots.end() && st.var_defined[it->second])
             {
                 out += "__V_";
                 out += ident;
@@ -306,7 +1057,7 @@ static std::string mangle_expression_identifiers(ScriptState &st, const std::str
 /*
  Build te variables using mangled variable names "__V_<Orig>" so that tinyexpr
  treats identifiers in a case-sensitive way while the script language retains
- original-case variable semantics in st.vars.
+ original-case variable semantics in st.var_slots.
 */
 /*
  Build te variables using mangled variable names...
@@ -314,13 +1065,15 @@ static std::string mangle_expression_identifiers(ScriptState &st, const std::str
 static std::set<te_variable> build_te_variables_and_funcs(ScriptState &st)
 {
     std::set<te_variable> vars;
-    // add variables (mangled names)
-    for (auto &kv : st.vars)
+    // add variables (mangled names), bound directly to their slots
+    for (size_t i = 0; i < st.var_names.size(); ++i)
     {
+        if (!st.var_defined[i])
+            continue;
         te_variable v;
-        std::string mname = std::string("__V_") + kv.first;
+        std::string mname = std::string("__V_") + st.var_names[i];
         v.m_name = mname;
-        v.m_value = static_cast<const te_type *>(&kv.second);
+        v.m_value = static_cast<const te_type *>(&st.var_values[i]);
         v.m_type = TE_DEFAULT;
         v.m_context = nullptr;
         vars.insert(std::move(v));
@@ -329,12 +1082,19 @@ static std::set<te_variable> build_te_variables_and_funcs(ScriptState &st)
     // --- 組み込み関数の登録 ---
     vars.insert({"IsPressed", (te_variant_type)te_IsPressed, TE_DEFAULT});
     vars.insert({"Rand", (te_variant_type)te_Rand, TE_DEFAULT});
+    vars.insert({"RandInt", (te_variant_type)te_RandInt, TE_DEFAULT});
+    vars.insert({"RandNormal", (te_variant_type)te_RandNormal, TE_DEFAULT});
     vars.insert({"GetTime", (te_variant_type)te_GetTime, TE_DEFAULT});
+    vars.insert({"GetTimeUs", (te_variant_type)te_GetTimeUs, TE_DEFAULT});
 
     // ■ 追加: 三角関数用変換
     vars.insert({"deg2rad", (te_variant_type)te_deg2rad, TE_DEFAULT});
     vars.insert({"rad2deg", (te_variant_type)te_rad2deg, TE_DEFAULT});
 
+    // ■ 追加: 配列参照 (name(i) を置き換えた先)
+    if (!st.array_ids.empty())
+        vars.insert({"__A", (te_variant_type)te_ArrayGet, TE_DEFAULT});
+
     return vars;
 }
 // Helper: map human-friendly key names to Arduino/TinyUSB keyboard codes or ASCII.
@@ -540,1354 +1300,4339 @@ static uint8_t key_name_to_hid(const std::string &name)
 }
 
 // ... (後略) ...
-static std::pair<bool, double> eval_expression(ScriptState &st, const std::string &expr)
+// ■ 追加: 数値モード用のネイティブ式評価
+// 対応する文法は tinyexpr の部分集合で、tinyexpr と解釈が分かれうる書き方
+// (同じ括弧内での && と || の混在、比較演算子の連鎖、^ の連鎖や単項マイナスとの組み合わせ) は変換しない。
+struct RpnFnDef
 {
-    // エラー時の行内容取得用
-    const char *current_line_str = (st.current_line_index >= 0 && st.current_line_index < (int)st.lines.size())
-                                       ? st.lines[st.current_line_index].c_str()
-                                       : "Unknown";
+    const char *name;
+    RpnFn fn;
+    uint8_t argc;
+};
 
-    try
-    {
-        te_parser p;
-        auto vars = build_te_variables_and_funcs(st);
-        p.set_variables_and_functions(vars);
-        std::string transformed = mangle_expression_identifiers(st, expr);
+static const RpnFnDef kRpnFns[] = {
+    {"sin", RpnFn::SIN, 1},
+    {"cos", RpnFn::COS, 1},
+    {"tan", RpnFn::TAN, 1},
+    {"asin", RpnFn::ASIN, 1},
+    {"acos", RpnFn::ACOS, 1},
+    {"atan", RpnFn::ATAN, 1},
+    {"sqrt", RpnFn::SQRT, 1},
+    {"abs", RpnFn::ABS, 1},
+    {"floor", RpnFn::FLOOR, 1},
+    {"ceil", RpnFn::CEIL, 1},
+    {"round", RpnFn::ROUND, 1},
+    {"trunc", RpnFn::TRUNC, 1},
+    {"exp", RpnFn::EXP, 1},
+    {"ln", RpnFn::LN, 1},
+    {"log10", RpnFn::LOG10, 1},
+    {"deg2rad", RpnFn::DEG2RAD, 1},
+    {"rad2deg", RpnFn::RAD2DEG, 1},
+    {"atan2", RpnFn::ATAN2, 2},
+    {"pow", RpnFn::POW, 2},
+    {"mod", RpnFn::MOD, 2},
+    {"min", RpnFn::MIN, 2},
+    {"max", RpnFn::MAX, 2},
+    {"IsPressed", RpnFn::ISPRESSED, 0},
+    {"GetTime", RpnFn::GETTIME, 0},
+    {"GetTimeUs", RpnFn::GETTIMEUS, 0},
+    {"Rand", RpnFn::RAND, 2},
+    {"RandInt", RpnFn::RANDINT, 2},
+    {"RandNormal", RpnFn::RANDNORMAL, 2},
+};
 
-        printf("eval_expression: original='%s'\r\n", expr.c_str());
-        tud_task();
+static const int RPN_MAX_STACK = 16;
 
-        p.compile(transformed);
-        double r = static_cast<double>(p.evaluate());
-        if (std::isnan(r) || std::isinf(r))
-        {
-            printf("eval_expression: result is NaN/Inf\r\n");
-            // 変数を展開してログに残す
-            std::string expanded = expand_line_variables(st, current_line_str);
-            SignalRuntimeError("Math Error (NaN/Inf)", st.current_line_index + 1, current_line_str, expanded.c_str());
-            st.end_flag = true;
-            return {false, 0.0};
-        }
-        return {true, r};
+struct RpnParser
+{
+    const std::string &s;
+    const ScriptState &st;
+    std::vector<RpnInstr> &out;
+    size_t i = 0;
+    int depth = 0;
+    bool ok = true;
+    bool int_ok = true;
+
+    RpnParser(const std::string &text, const ScriptState &state, std::vector<RpnInstr> &code) : s(text), st(state), out(code) {}
+
+    void ws()
+    {
+        while (i < s.size() && isspace((unsigned char)s[i]))
+            ++i;
     }
-    catch (const std::exception &e)
+    bool peek2(const char *t) const { return s.compare(i, 2, t) == 0; }
+    void emit(RpnOp op, int pops, int pushes = 1)
     {
-        printf("eval_expression: failed %s\r\n", e.what());
-        std::string expanded = expand_line_variables(st, current_line_str);
-        SignalRuntimeError("Math Error (Zero Div, etc)", st.current_line_index + 1, current_line_str, expanded.c_str());
-        st.end_flag = true;
-        return {false, 0.0};
+        RpnInstr in;
+        in.op = op;
+        out.push_back(in);
+        depth += pushes - pops;
     }
-}
-// プリパス：行を走査してラベル辞書を作成する
-static void prepass_script(ScriptState &st)
-{
-    st.label_to_index.clear();
-    printf("prepass_script: scanning %zu lines for LABELs\r\n", st.lines.size());
-    tud_task();
-    for (size_t i = 0; i < st.lines.size(); ++i)
+    void push_const(double v)
     {
-        std::string line = trim(st.lines[i]);
-        if (line.empty())
-            continue;
-        // Comments: REM or #
-        // detect case-insensitive REM
-        if (starts_with_cmd(line, "REM") || line[0] == '#')
-            continue;
-        // LABEL <name>
-        if (starts_with_cmd(line, "LABEL"))
-        {
-            // extract token after LABEL
-            size_t pos = 5;
-            while (pos < line.size() && isspace((unsigned char)line[pos]))
-                ++pos;
-            std::string name = line.substr(pos);
-            name = trim(name);
-            // label points to next line index
-            st.label_to_index[name] = static_cast<int>(i + 1);
-            printf("prepass_script: found LABEL '%s' -> %d\r\n", name.c_str(), static_cast<int>(i + 1));
-            tud_task();
-        }
+        RpnInstr in;
+        in.op = RpnOp::CONST;
+        in.f = static_cast<float>(v);
+        double q = v * 65536.0;
+        in.i = (q >= 2147483647.0) ? INT32_MAX : (q <= -2147483648.0) ? INT32_MIN : static_cast<int32_t>(llround(q));
+        if (v == trunc(v) && v >= -2147483648.0 && v <= 2147483647.0)
+            in.n = static_cast<int32_t>(v);
+        else
+            int_ok = false;
+        out.push_back(in);
+        if (++depth > RPN_MAX_STACK)
+            ok = false;
     }
-    printf("prepass_script: completed, %zu labels registered\r\n", st.label_to_index.size());
-    tud_task();
-}
 
-// コマンド後の簡易トークン解析用ヘルパー
-static inline std::string token_after(const std::string &line, size_t start)
-{
-    size_t i = start;
-    while (i < line.size() && isspace((unsigned char)line[i]))
-        ++i;
-    if (i >= line.size())
-        return "";
-    // if starts with quote then read up to matching quote
-    if (line[i] == '\"')
+    void primary()
     {
-        ++i;
-        size_t j = i;
-        while (j < line.size() && line[j] != '\"')
-            ++j;
-        return line.substr(i, j - i);
-    }
-    // else take until space
-    size_t j = i;
-    while (j < line.size() && !isspace((unsigned char)line[j]))
-        ++j;
-    return line.substr(i, j - i);
-}
-
-// Helper: split a substring by top-level commas only (respecting quotes, escapes and nested parentheses)
-// Returns trimmed parts.
-static std::vector<std::string> split_top_level_args(const std::string &s, size_t start = 0, size_t end = std::string::npos)
-{
-    std::vector<std::string> parts;
-    if (end == std::string::npos)
-        end = s.size();
-    if (start >= end)
-        return parts;
-    bool in_q = false;
-    int depth = 0;
-    size_t last = start;
-    for (size_t i = start; i < end; ++i)
-    {
-        char ch = s[i];
-        if (ch == '\\')
+        ws();
+        if (i >= s.size())
+        {
+            ok = false;
+            return;
+        }
+        char c = s[i];
+        if (c == '(')
         {
-            // skip escaped char (inside or outside quotes)
             ++i;
-            continue;
+            logic();
+            ws();
+            if (i < s.size() && s[i] == ')')
+                ++i;
+            else
+                ok = false;
+            return;
         }
-        if (ch == '\"')
+        if (isdigit((unsigned char)c) || c == '.')
         {
-            in_q = !in_q;
-            continue;
+            char *endp = nullptr;
+            double v = strtod(s.c_str() + i, &endp);
+            if (!endp || endp == s.c_str() + i)
+            {
+                ok = false;
+                return;
+            }
+            i = endp - s.c_str();
+            push_const(v);
+            return;
         }
-        if (!in_q)
+        if (isalpha((unsigned char)c) || c == '_')
         {
-            if (ch == '(')
+            size_t j = i;
+            while (j < s.size() && (isalnum((unsigned char)s[j]) || s[j] == '_'))
+                ++j;
+            std::string name = s.substr(i, j - i);
+            i = j;
+            ws();
+            if (i < s.size() && s[i] == '(')
             {
-                ++depth;
-                continue;
+                ++i;
+                auto ai = st.array_ids.find(name);
+                if (ai != st.array_ids.end())
+                {
+                    logic();
+                    ws();
+                    if (i < s.size() && s[i] == ')')
+                        ++i;
+                    else
+                        ok = false;
+                    RpnInstr in;
+                    in.op = RpnOp::ARRAY;
+                    in.i = ai->second;
+                    out.push_back(in);
+                    return;
+                }
+                const RpnFnDef *def = nullptr;
+                for (const RpnFnDef &d : kRpnFns)
+                {
+                    if (strcasecmp(d.name, name.c_str()) == 0)
+                        def = &d;
+                }
+                if (!def)
+                {
+                    ok = false;
+                    return;
+                }
+                int argc = 0;
+                ws();
+                if (i < s.size() && s[i] == ')')
+                    ++i;
+                else
+                {
+                    while (ok)
+                    {
+                        logic();
+                        ++argc;
+                        ws();
+                        if (i < s.size() && s[i] == ',')
+                        {
+                            ++i;
+                            continue;
+                        }
+                        if (i < s.size() && s[i] == ')')
+                        {
+                            ++i;
+                            break;
+                        }
+                        ok = false;
+                    }
+                }
+                if (argc != def->argc)
+                {
+                    ok = false;
+                    return;
+                }
+                RpnInstr in;
+                in.op = RpnOp::CALL;
+                in.fn = def->fn;
+                out.push_back(in);
+                switch (def->fn)
+                {
+                case RpnFn::ABS:
+                case RpnFn::POW:
+                case RpnFn::MOD:
+                case RpnFn::MIN:
+                case RpnFn::MAX:
+                case RpnFn::ISPRESSED:
+                case RpnFn::GETTIME:
+                case RpnFn::GETTIMEUS:
+                case RpnFn::RAND:
+                case RpnFn::RANDINT:
+                case RpnFn::RANDNORMAL:
+                    break;
+                default:
+                    int_ok = false; // 三角関数など整数にならない関数
+                    break;
+                }
+                depth += 1 - argc;
+                if (depth > RPN_MAX_STACK)
+                    ok = false;
+                return;
             }
-            if (ch == ')')
+            bool is_pi = strcasecmp(name.c_str(), "pi") == 0;
+            bool is_e = strcasecmp(name.c_str(), "e") == 0;
+            auto it = st.var_slots.find(name);
+            if (it != st.var_slots.end() && !is_pi && !is_e)
             {
-                if (depth > 0)
-                    --depth;
-                continue;
+                RpnInstr in;
+                in.op = RpnOp::VAR;
+                in.i = it->second;
+                out.push_back(in);
+                if (++depth > RPN_MAX_STACK)
+                    ok = false;
+                return;
             }
-            if (ch == ',' && depth == 0)
+            if ((is_pi || is_e) && it == st.var_slots.end())
             {
-                parts.push_back(trim(s.substr(last, i - last)));
-                last = i + 1;
+                push_const(is_pi ? 3.14159265358979323846 : 2.71828182845904523536);
+                return;
             }
+            ok = false;
+            return;
         }
+        ok = false;
     }
-    if (last < end)
-        parts.push_back(trim(s.substr(last, end - last)));
-    return parts;
-}
 
-// Mouserun 実装：Flash から CSV を読み込み再生する
-static void do_mouserun(ScriptState &st, const std::string &filename, double time_scale, double angle_rad, double scale)
-{
-    printf("do_mouserun: start '%s'\r\n", filename.c_str());
-    tud_task();
+    // 単項演算子。has_unary は単項演算子が付いたかどうか (^ との組み合わせ判定用)
+    void unary(bool &has_unary)
+    {
+        ws();
+        if (i < s.size() && (s[i] == '-' || s[i] == '+'))
+        {
+            char c = s[i++];
+            has_unary = true;
+            bool dummy = false;
+            unary(dummy);
+            if (c == '-')
+                emit(RpnOp::NEG, 1);
+            return;
+        }
+        primary();
+    }
 
-    int err = lfs_mount(&g_lfs, &lfs_pico_flash_config);
-    if (err < 0)
+    void power()
     {
-        printf("do_mouserun: lfs_mount failed %d\r\n", err);
-        return;
+        bool u1 = false;
+        unary(u1);
+        ws();
+        if (ok && i < s.size() && s[i] == '^')
+        {
+            ++i;
+            bool u2 = false;
+            unary(u2);
+            emit(RpnOp::POW, 2);
+            ws();
+            if (u1 || (i < s.size() && s[i] == '^'))
+                ok = false;
+        }
     }
 
-    lfs_file_t fp;
-    int rc = lfs_file_open(&g_lfs, &fp, filename.c_str(), LFS_O_RDONLY);
-    if (rc < 0)
+    void term()
     {
-        lfs_unmount(&g_lfs);
-        const char *current_line_str = (st.current_line_index >= 0 && st.current_line_index < (int)st.lines.size())
-                                           ? st.lines[st.current_line_index].c_str()
-                                           : "Mouserun";
+        power();
+        while (ok)
+        {
+            ws();
+            if (i >= s.size() || (s[i] != '*' && s[i] != '/' && s[i] != '%'))
+                break;
+            char c = s[i++];
+            power();
+            emit(c == '*' ? RpnOp::MUL : c == '/' ? RpnOp::DIV : RpnOp::MOD, 2);
+        }
+    }
 
-        SignalRuntimeError("Mouserun: File not found", st.current_line_index + 1, current_line_str, "");
-        st.end_flag = true;
-        return;
+    void sum()
+    {
+        term();
+        while (ok)
+        {
+            ws();
+            if (i >= s.size() || (s[i] != '+' && s[i] != '-'))
+                break;
+            char c = s[i++];
+            term();
+            emit(c == '+' ? RpnOp::ADD : RpnOp::SUB, 2);
+        }
     }
 
-    // read file in chunks and split into lines to avoid dependency on f_gets
-    char chunk[256];
-    std::string accum;
-    int br = 0;
-    while (true)
+    bool cmp_op(RpnOp &op)
     {
-        br = (int)lfs_file_read(&g_lfs, &fp, chunk, sizeof(chunk));
-        if (br <= 0)
-            break;
-        for (int i = 0; i < br; ++i)
+        ws();
+        if (i >= s.size())
+            return false;
+        if (peek2("<=")) { op = RpnOp::LE; i += 2; return true; }
+        if (peek2(">=")) { op = RpnOp::GE; i += 2; return true; }
+        if (peek2("==")) { op = RpnOp::EQ; i += 2; return true; }
+        if (peek2("!=") || peek2("<>")) { op = RpnOp::NE; i += 2; return true; }
+        if (peek2("<<") || peek2(">>"))
         {
-            char c = chunk[i];
-            if (c == '\r')
-                continue;
-            if (c == '\n')
-            {
-                std::string l = trim(accum);
-                accum.clear();
-                if (l.empty())
-                    continue;
-                if (l[0] == '#' || starts_with_cmd(l, "REM"))
-                    continue;
-                // make a mutable copy for strtok parsing
-                char linebuf2[256];
-                strncpy(linebuf2, l.c_str(), sizeof(linebuf2));
-                linebuf2[sizeof(linebuf2) - 1] = '\0';
+            ok = false;
+            return false;
+        }
+        if (s[i] == '<') { op = RpnOp::LT; ++i; return true; }
+        if (s[i] == '>') { op = RpnOp::GT; ++i; return true; }
+        if (s[i] == '=') { op = RpnOp::EQ; ++i; return true; }
+        return false;
+    }
 
-                // parse CSV: x,y,rel,LEFT,RIGHT,MIDDLE,time(ms)
-                int x = 0, y = 0, rel = 0;
-                int left = 0, right = 0, middle = 0;
-                unsigned long time_ms = 0;
-                char *p = linebuf2;
-                char *tok = strtok(p, ",");
-                if (!tok)
-                    continue;
-                x = atoi(tok);
-                tok = strtok(nullptr, ",");
-                if (!tok)
-                    continue;
-                y = atoi(tok);
-                tok = strtok(nullptr, ",");
-                if (!tok)
-                    continue;
-                rel = atoi(tok);
-                tok = strtok(nullptr, ",");
-                if (!tok)
-                    continue;
-                left = atoi(tok);
-                tok = strtok(nullptr, ",");
-                if (!tok)
-                    continue;
-                right = atoi(tok);
-                tok = strtok(nullptr, ",");
-                if (!tok)
-                    continue;
-                middle = atoi(tok);
-                tok = strtok(nullptr, ",");
-                if (!tok)
-                    continue;
-                time_ms = (unsigned long)strtoul(tok, nullptr, 10);
+    void cmp()
+    {
+        sum();
+        RpnOp op;
+        if (ok && cmp_op(op))
+        {
+            sum();
+            emit(op, 2);
+            RpnOp again;
+            if (ok && cmp_op(again))
+                ok = false; // 比較の連鎖は変換しない
+        }
+    }
 
-                // apply rotation and scale
-                double dx = static_cast<double>(x);
-                double dy = static_cast<double>(y);
-                double nx = dx * cos(angle_rad) - dy * sin(angle_rad);
-                double ny = dx * sin(angle_rad) + dy * cos(angle_rad);
-                nx *= scale;
-                ny *= scale;
+    void logic()
+    {
+        cmp();
+        char kind = 0;
+        while (ok)
+        {
+            ws();
+            if (!(peek2("&&") || peek2("||")))
+                break;
+            char k = s[i];
+            if (kind && kind != k)
+            {
+                ok = false; // && と || の混在は変換しない
+                break;
+            }
+            kind = k;
+            i += 2;
+            cmp();
+            emit(k == '&' ? RpnOp::AND : RpnOp::OR, 2);
+        }
+    }
+};
 
-                // clamp to -128..127 for Mouse.move signed char
-                int ix = static_cast<int>(round(nx));
-                int iy = static_cast<int>(round(ny));
-                if (ix < -128)
-                    ix = -128;
-                if (ix > 127)
-                    ix = 127;
-                if (iy < -128)
-                    iy = -128;
-                if (iy > 127)
-                    iy = 127;
+static std::unique_ptr<RpnProgram> rpn_compile(const ScriptState &st, const std::string &text)
+{
+    std::unique_ptr<RpnProgram> prog(new RpnProgram());
+    RpnParser ps(text, st, prog->code);
+    ps.logic();
+    ps.ws();
+    if (!ps.ok || ps.i != text.size() || ps.depth != 1)
+        return nullptr;
+    prog->int_ok = ps.int_ok;
+    return prog;
+}
 
-                // マウス移動とボタン状態を送信
-                if (left)
-                    Mouse.press(MOUSE_LEFT);
-                else
-                    Mouse.release(MOUSE_LEFT);
-                if (right)
-                    Mouse.press(MOUSE_RIGHT);
-                else
-                    Mouse.release(MOUSE_RIGHT);
-                if (middle)
-                    Mouse.press(MOUSE_MIDDLE);
-                else
-                    Mouse.release(MOUSE_MIDDLE);
+// float 演算 (RP2040 では pico_float により bootrom の単精度ルーチンが使われる)
+struct RpnFloat
+{
+    using T = float;
+    static T from_d(double v) { return static_cast<float>(v); }
+    static double to_d(T v) { return static_cast<double>(v); }
+    static T konst(const RpnInstr &in) { return in.f; }
+    static T load(double v, bool &) { return from_d(v); }
+    static T from_fn(double v) { return from_d(v); }
+    static T one() { return 1.0f; }
+    static bool truth(T v) { return v != 0.0f; }
+    static T neg(T a) { return -a; }
+    static T add(T a, T b) { return a + b; }
+    static T sub(T a, T b) { return a - b; }
+    static T mul(T a, T b) { return a * b; }
+    static T div(T a, T b, bool &) { return a / b; } // 0 除算は Inf となり呼び出し側で検出
+    static T mod(T a, T b, bool &) { return fmodf(a, b); }
+    static float to_f(T v) { return v; }
+    static T from_f(float v) { return v; }
+    static T abs(T v) { return fabsf(v); }
+    static T pow(T a, T b, bool &) { return powf(a, b); }
+};
 
-                Mouse.move((signed char)ix, (signed char)iy, (signed char)rel);
-                tud_task();
+// Q16.16 固定小数点演算 (範囲は約 ±32767、超えた値は飽和させる)
+struct RpnFixed
+{
+    using T = int32_t;
+    static T sat(int64_t v) { return v > INT32_MAX ? INT32_MAX : (v < INT32_MIN ? INT32_MIN : static_cast<T>(v)); }
+    static T from_d(double v)
+    {
+        double q = v * 65536.0;
+        if (!(q < 2147483647.0))
+            return (q != q) ? 0 : INT32_MAX;
+        if (q <= -2147483648.0)
+            return INT32_MIN;
+        return static_cast<T>(llround(q));
+    }
+    static double to_d(T v) { return static_cast<double>(v) / 65536.0; }
+    static T konst(const RpnInstr &in) { return in.i; }
+    static T load(double v, bool &) { return from_d(v); }
+    static T from_fn(double v) { return from_d(v); }
+    static T one() { return 65536; }
+    static bool truth(T v) { return v != 0; }
+    static T neg(T a) { return sat(-static_cast<int64_t>(a)); }
+    static T add(T a, T b) { return sat(static_cast<int64_t>(a) + b); }
+    static T sub(T a, T b) { return sat(static_cast<int64_t>(a) - b); }
+    static T mul(T a, T b) { return sat((static_cast<int64_t>(a) * b) >> 16); }
+    static T div(T a, T b, bool &err)
+    {
+        if (b == 0)
+        {
+            err = true;
+            return 0;
+        }
+        return sat((static_cast<int64_t>(a) * 65536) / b);
+    }
+    static T mod(T a, T b, bool &err)
+    {
+        if (b == 0)
+        {
+            err = true;
+            return 0;
+        }
+        return a % b; // 両辺とも 2^16 倍なので fmod と同じ結果になる
+    }
+    static float to_f(T v) { return static_cast<float>(v) * (1.0f / 65536.0f); }
+    static T from_f(float v) { return from_d(static_cast<double>(v)); }
+    static T abs(T v) { return v < 0 ? neg(v) : v; }
+    static T pow(T a, T b, bool &) { return from_f(powf(to_f(a), to_f(b))); }
+};
 
-                // スケーリングされた時間だけ待機
-                uint32_t wait_ms = static_cast<uint32_t>(round(time_ms * time_scale));
-                if (wait_ms)
-                {
-                    uint32_t remaining = wait_ms;
-                    while (remaining)
-                    {
-                        uint32_t step = remaining > 20 ? 20 : remaining;
-                        sleep_ms(step);
-                        tud_task();
-                        remaining -= step;
-                    }
-                }
-            }
-            else
-            {
-                accum.push_back(c);
-            }
+// ■ 追加: SETI 用の 32bit 整数演算 (桁あふれは 2 の補数で折り返す)
+// '/' と '%' は SIO のハードウェア除算器で計算する (0 方向への切り捨て)
+struct RpnInt
+{
+    using T = int32_t;
+    static T wrap(uint32_t v) { return static_cast<T>(v); }
+    // 整数でない値・範囲外の値 (関数の戻り値など) は 0 方向に切り捨て、範囲外は飽和させる
+    static T from_d(double v)
+    {
+        if (!(v < 2147483648.0))
+            return (v != v) ? 0 : INT32_MAX;
+        if (v <= -2147483648.0)
+            return INT32_MIN;
+        return static_cast<T>(v);
+    }
+    static double to_d(T v) { return static_cast<double>(v); }
+    static T konst(const RpnInstr &in) { return in.n; }
+    // 変数の値が整数でない場合は err にして、呼び出し側で double の評価に切り替える
+    static T load(double v, bool &err)
+    {
+        if (!(v >= -2147483648.0 && v <= 2147483647.0) || v != trunc(v))
+        {
+            err = true;
+            return 0;
         }
+        return static_cast<T>(v);
     }
-    // process any trailing data as a final line
-    if (!accum.empty())
+    static T from_fn(double v) { return from_d(v); }
+    static T one() { return 1; }
+    static bool truth(T v) { return v != 0; }
+    static T neg(T a) { return wrap(0u - static_cast<uint32_t>(a)); }
+    static T add(T a, T b) { return wrap(static_cast<uint32_t>(a) + static_cast<uint32_t>(b)); }
+    static T sub(T a, T b) { return wrap(static_cast<uint32_t>(a) - static_cast<uint32_t>(b)); }
+    static T mul(T a, T b) { return wrap(static_cast<uint32_t>(a) * static_cast<uint32_t>(b)); }
+    static T div(T a, T b, bool &err)
     {
-        std::string l = trim(accum);
-        if (!(l.empty() || l[0] == '#' || starts_with_cmd(l, "REM")))
+        if (b == 0)
         {
-            char linebuf2[256];
-            strncpy(linebuf2, l.c_str(), sizeof(linebuf2));
-            linebuf2[sizeof(linebuf2) - 1] = '\0';
+            err = true;
+            return 0;
+        }
+        if (b == -1)
+            return neg(a); // INT32_MIN / -1 も折り返す
+        return hw_divider_s32_quotient_inlined(a, b);
+    }
+    static T mod(T a, T b, bool &err)
+    {
+        if (b == 0)
+        {
+            err = true;
+            return 0;
+        }
+        if (b == -1)
+            return 0;
+        return hw_divider_s32_remainder_inlined(a, b);
+    }
+    static float to_f(T v) { return static_cast<float>(v); }
+    static T from_f(float v) { return from_d(static_cast<double>(v)); }
+    static T abs(T v) { return v < 0 ? neg(v) : v; }
+    // 負の指数は整数にならないので double の評価に任せる
+    static T pow(T a, T b, bool &err)
+    {
+        if (b < 0)
+        {
+            err = true;
+            return 0;
+        }
+        uint32_t r = 1, x = static_cast<uint32_t>(a);
+        for (uint32_t e = static_cast<uint32_t>(b); e; e >>= 1)
+        {
+            if (e & 1)
+                r *= x;
+            x *= x;
+        }
+        return wrap(r);
+    }
+};
 
-            int x = 0, y = 0, rel = 0;
-            int left = 0, right = 0, middle = 0;
-            unsigned long time_ms = 0;
-            char *p = linebuf2;
-            char *tok = strtok(p, ",");
-            if (tok)
+template <class N>
+static double rpn_run(const ScriptState &st, const RpnProgram &prog)
+{
+    using T = typename N::T;
+    T stk[RPN_MAX_STACK];
+    int sp = 0;
+    bool err = false;
+    for (const RpnInstr &in : prog.code)
+    {
+        switch (in.op)
+        {
+        case RpnOp::CONST:
+            stk[sp++] = N::konst(in);
+            break;
+        case RpnOp::VAR:
+            if (!st.var_defined[in.i])
+                return NAN; // 未定義変数 (tinyexpr と同じくエラーにする)
+            stk[sp++] = N::load(st.var_values[in.i], err);
+            break;
+        case RpnOp::ARRAY:
+        {
+            const double *p = array_elem(in.i, N::to_d(stk[sp - 1]));
+            if (!p)
+                return NAN;
+            stk[sp - 1] = N::load(*p, err);
+            break;
+        }
+        case RpnOp::NEG:
+            stk[sp - 1] = N::neg(stk[sp - 1]);
+            break;
+        case RpnOp::CALL:
+        {
+            T r = T(0);
+            switch (in.fn)
             {
-                x = atoi(tok);
-                tok = strtok(nullptr, ",");
+            case RpnFn::ISPRESSED:
+                r = N::from_fn(te_IsPressed());
+                break;
+            case RpnFn::GETTIME:
+                r = N::from_fn(te_GetTime());
+                break;
+            case RpnFn::GETTIMEUS:
+                r = N::from_fn(te_GetTimeUs());
+                break;
+            case RpnFn::RAND:
+            case RpnFn::RANDINT:
+            case RpnFn::RANDNORMAL:
+            {
+                sp -= 2;
+                te_type (*f)(te_type, te_type) = in.fn == RpnFn::RAND ? te_Rand : (in.fn == RpnFn::RANDINT ? te_RandInt : te_RandNormal);
+                r = N::from_fn(f(N::to_d(stk[sp]), N::to_d(stk[sp + 1])));
+                break;
             }
-            if (tok)
+            case RpnFn::ATAN2:
+            case RpnFn::POW:
+            case RpnFn::MOD:
+            case RpnFn::MIN:
+            case RpnFn::MAX:
             {
-                y = atoi(tok);
-                tok = strtok(nullptr, ",");
+                sp -= 2;
+                T a = stk[sp], b = stk[sp + 1];
+                if (in.fn == RpnFn::MIN)
+                    r = (b < a) ? b : a;
+                else if (in.fn == RpnFn::MAX)
+                    r = (b > a) ? b : a;
+                else if (in.fn == RpnFn::MOD)
+                    r = N::mod(a, b, err);
+                else if (in.fn == RpnFn::POW)
+                    r = N::pow(a, b, err);
+                else
+                    r = N::from_f(atan2f(N::to_f(a), N::to_f(b)));
+                break;
             }
-            if (tok)
+            default:
             {
-                rel = atoi(tok);
-                tok = strtok(nullptr, ",");
+                T a = stk[--sp];
+                if (in.fn == RpnFn::ABS)
+                {
+                    r = N::abs(a);
+                    break;
+                }
+                float x = N::to_f(a);
+                float y = 0.0f;
+                switch (in.fn)
+                {
+                case RpnFn::SIN: y = sinf(x); break;
+                case RpnFn::COS: y = cosf(x); break;
+                case RpnFn::TAN: y = tanf(x); break;
+                case RpnFn::ASIN: y = asinf(x); break;
+                case RpnFn::ACOS: y = acosf(x); break;
+                case RpnFn::ATAN: y = atanf(x); break;
+                case RpnFn::SQRT: y = sqrtf(x); break;
+                case RpnFn::FLOOR: y = floorf(x); break;
+                case RpnFn::CEIL: y = ceilf(x); break;
+                case RpnFn::ROUND: y = roundf(x); break;
+                case RpnFn::TRUNC: y = truncf(x); break;
+                case RpnFn::EXP: y = expf(x); break;
+                case RpnFn::LN: y = logf(x); break;
+                case RpnFn::LOG10: y = log10f(x); break;
+                case RpnFn::DEG2RAD: y = x * (3.14159265358979323846f / 180.0f); break;
+                case RpnFn::RAD2DEG: y = x * (180.0f / 3.14159265358979323846f); break;
+                default: break;
+                }
+                if (std::isnan(y) || std::isinf(y))
+                    err = true;
+                r = N::from_f(y);
+                break;
             }
-            if (tok)
+            }
+            stk[sp++] = r;
+            break;
+        }
+        default:
+        {
+            T b = stk[--sp];
+            T a = stk[sp - 1];
+            T r;
+            switch (in.op)
             {
-                left = atoi(tok);
-                tok = strtok(nullptr, ",");
+            case RpnOp::ADD: r = N::add(a, b); break;
+            case RpnOp::SUB: r = N::sub(a, b); break;
+            case RpnOp::MUL: r = N::mul(a, b); break;
+            case RpnOp::DIV: r = N::div(a, b, err); break;
+            case RpnOp::MOD: r = N::mod(a, b, err); break;
+            case RpnOp::POW: r = N::pow(a, b, err); break;
+            case RpnOp::LT: r = (a < b) ? N::one() : T(0); break;
+            case RpnOp::LE: r = (a <= b) ? N::one() : T(0); break;
+            case RpnOp::GT: r = (a > b) ? N::one() : T(0); break;
+            case RpnOp::GE: r = (a >= b) ? N::one() : T(0); break;
+            case RpnOp::EQ: r = (a == b) ? N::one() : T(0); break;
+            case RpnOp::NE: r = (a != b) ? N::one() : T(0); break;
+            case RpnOp::AND: r = (N::truth(a) && N::truth(b)) ? N::one() : T(0); break;
+            default: r = (N::truth(a) || N::truth(b)) ? N::one() : T(0); break;
             }
-            if (tok)
+            stk[sp - 1] = r;
+            break;
+        }
+        }
+    }
+    return err ? NAN : N::to_d(stk[0]);
+}
+
+// 値を数値モードの精度に丸める (変数への格納値をモードの精度に揃える)
+static inline double round_to_mode(NumMode mode, double v)
+{
+    if (mode == NumMode::FLOAT32)
+        return static_cast<double>(static_cast<float>(v));
+    if (mode == NumMode::FIXED16_16)
+        return RpnFixed::to_d(RpnFixed::from_d(v));
+    return v;
+}
+
+// 式を (必要なら) コンパイルする。新しい変数が増えていれば束縛し直す
+static void prepare_expr(ScriptState &st, ScriptExpr &expr)
+{
+    if (!expr.parser || expr.var_epoch != st.var_epoch)
+    {
+        if (st.te_vars_epoch != st.var_epoch)
+        {
+            st.te_vars = build_te_variables_and_funcs(st);
+            st.te_vars_epoch = st.var_epoch;
+        }
+        if (!expr.parser)
+            expr.parser.reset(new te_parser());
+        expr.parser->set_variables_and_functions(st.te_vars);
+        expr.parser->compile(mangle_expression_identifiers(st, expr.text));
+        expr.var_epoch = st.var_epoch;
+    }
+}
+
+// ■ 追加: 式のネイティブ命令列 (初回に変換を試み、変換できなければ nullptr)
+static const RpnProgram *rpn_program(ScriptState &st, ScriptExpr &expr)
+{
+    if (!expr.rpn_tried)
+    {
+        expr.rpn_tried = true;
+        expr.rpn = rpn_compile(st, expr.text);
+        if (st.num_mode != NumMode::DOUBLE)
+            ++(expr.rpn ? st.num_native_exprs : st.num_fallback_exprs);
+    }
+    return expr.rpn.get();
+}
+
+// ■ 追加: 式を評価する (NaN/Inf の判定は呼び出し側)。数値モードではネイティブ評価を優先する
+static double eval_raw(ScriptState &st, ScriptExpr &expr)
+{
+    if (st.num_mode != NumMode::DOUBLE)
+    {
+        rpn_program(st, expr);
+        if (expr.rpn)
+            return (st.num_mode == NumMode::FLOAT32) ? rpn_run<RpnFloat>(st, *expr.rpn) : rpn_run<RpnFixed>(st, *expr.rpn);
+    }
+    prepare_expr(st, expr);
+    return static_cast<double>(expr.parser->evaluate());
+}
+
+// ■ 追加: メモを有効にする (無効なら内側のメモから順に計算し直す)
+// メモ自身の NaN/Inf はここでは判定せず、参照する側の式の結果で判定する (元の式と同じ挙動)
+static void memo_refresh(ScriptState &st, int m)
+{
+    MemoSlot &ms = st.memos[m];
+    if (ms.valid)
+    {
+        ++st.opt_memo_hits;
+        return;
+    }
+    for (int c : ms.expr.memos)
+        memo_refresh(st, c);
+    double v = eval_raw(st, ms.expr);
+    ms.valid = !(std::isnan(v) || std::isinf(v)); // 失敗した値は保持しない (未定義変数が後で定義される場合など)
+    st.var_values[ms.slot] = ms.valid ? round_to_mode(st.num_mode, v) : v;
+    ++st.opt_memo_evals;
+}
+
+// ■ 追加: プロファイル中は評価時間を行ごとに積算する (どの return でも集計されるようデストラクタで加算)
+// eval_expression と、それを通らない SETI のネイティブ評価で共用する
+struct EvalTimer
+{
+    LineProfile *p;
+    uint64_t t0;
+    explicit EvalTimer(ScriptState &st) : p(st.profile ? &st.prof[st.current_line_index] : nullptr), t0(p ? time_us_64() : 0) {}
+    ~EvalTimer()
+    {
+        if (p)
+            prof_add(p->eval_us, time_us_64() - t0);
+    }
+};
+
+static std::pair<bool, double> eval_expression(ScriptState &st, ScriptExpr &expr)
+{
+    ++st.eval_count;
+    if (expr.is_const)
+    {
+        st.opt_folded_evals += expr.folded;
+        return {true, st.num_mode == NumMode::DOUBLE ? expr.const_val : round_to_mode(st.num_mode, expr.const_val)};
+    }
+
+    EvalTimer timer(st);
+
+    // エラー時の行内容取得用
+    const char *current_line_str = line_cstr(st, st.current_line_index, "Unknown");
+
+    try
+    {
+        g_expr_error = nullptr;
+
+        double r;
+        if (expr.direct_memo >= 0)
+        {
+            memo_refresh(st, expr.direct_memo);
+            r = st.var_values[st.memos[expr.direct_memo].slot];
+        }
+        else
+        {
+            for (int m : expr.memos)
+                memo_refresh(st, m);
+            r = eval_raw(st, expr);
+            st.opt_memo_hits += expr.memo_dups;
+        }
+        st.opt_folded_evals += expr.folded;
+        if (st.trace.cur)
+            st.trace.cur->value = (float)r;
+        if (std::isnan(r) || std::isinf(r))
+        {
+            printf("eval_expression: result is NaN/Inf\r\n");
+            // 変数を展開してログに残す
+            std::string expanded = expand_line_variables(st, current_line_str);
+            SignalRuntimeError(g_expr_error ? g_expr_error : "Math Error (NaN/Inf)", st.current_line_index + 1, current_line_str, expanded.c_str());
+            st.end_flag = true;
+            return {false, 0.0};
+        }
+        return {true, r};
+    }
+    catch (const std::exception &e)
+    {
+        printf("eval_expression: failed %s\r\n", e.what());
+        std::string expanded = expand_line_variables(st, current_line_str);
+        SignalRuntimeError("Math Error (Zero Div, etc)", st.current_line_index + 1, current_line_str, expanded.c_str());
+        st.end_flag = true;
+        return {false, 0.0};
+    }
+}
+// ■ 追加: 単語としてのキーワード位置を探す (大文字小文字を無視、前後が識別子の文字でないこと)
+static size_t find_keyword(const std::string &s, const char *kw, size_t from = 0)
+{
+    const size_t n = strlen(kw);
+    auto ident = [](char c) { return isalnum((unsigned char)c) || c == '_'; };
+    for (size_t i = from; i + n <= s.size(); ++i)
+    {
+        if (i > 0 && ident(s[i - 1]))
+            continue;
+        if (i + n < s.size() && ident(s[i + n]))
+            continue;
+        bool eq = true;
+        for (size_t k = 0; k < n && eq; ++k)
+            eq = (toupper((unsigned char)s[i + k]) == kw[k]);
+        if (eq)
+            return i;
+    }
+    return std::string::npos;
+}
+
+enum class BlockKw : uint8_t
+{
+    NONE,
+    FOR,
+    NEXT,
+    WHILE,
+    WEND,
+    IF_THEN,
+    ELSE,
+    ENDIF,
+};
+
+// ■ 追加: from から空白を飛ばした次の単語 (識別子の文字の並び) を大文字で返す。end は単語の直後
+// find_keyword と同じく、単語の切れ目は識別子の文字 (英数字と '_') かどうかで決める
+static std::string next_word(const std::string &s, size_t from, size_t &end)
+{
+    auto ident = [](char c) { return isalnum((unsigned char)c) || c == '_'; };
+    size_t i = from;
+    while (i < s.size() && (s[i] == ' ' || s[i] == '\t'))
+        ++i;
+    std::string w;
+    while (i < s.size() && ident(s[i]))
+        w.push_back((char)toupper((unsigned char)s[i++]));
+    end = i;
+    return w;
+}
+
+// ■ 追加: 構造化制御構文の行か判定する (line は trim 済み)
+// ■ 変更: 行頭を単語に区切って判定する ("END IF" は END と IF の 2 語。間の空白の数や大文字小文字によらず ENDIF と同じ)
+// IF は GOTO を含まず、行末の単語が THEN のときだけブロック IF とみなす (IF ... GOTO は従来通り)。
+static BlockKw block_keyword(const std::string &line)
+{
+    size_t end = 0;
+    const std::string w = next_word(line, 0, end);
+    if (end < line.size() && line[end] != ' ' && line[end] != '\t' && line[end] != '(')
+        return BlockKw::NONE; // "FOR=" のような単語の後ろは starts_with_cmd と同じくコマンドとみなさない
+    if (w == "FOR")
+        return BlockKw::FOR;
+    if (w == "NEXT")
+        return BlockKw::NEXT;
+    if (w == "WHILE")
+        return BlockKw::WHILE;
+    if (w == "WEND")
+        return BlockKw::WEND;
+    if (w == "ELSE")
+        return BlockKw::ELSE;
+    if (w == "ENDIF")
+        return BlockKw::ENDIF;
+    if (w == "END")
+    {
+        size_t end2 = 0;
+        return next_word(line, end, end2) == "IF" ? BlockKw::ENDIF : BlockKw::NONE;
+    }
+    if (w == "IF" && find_keyword(line, "GOTO") == std::string::npos)
+    {
+        size_t then = line.size();
+        while (then > end && (isalnum((unsigned char)line[then - 1]) || line[then - 1] == '_'))
+            --then;
+        size_t then_end = 0;
+        if (then > end && next_word(line, then, then_end) == "THEN")
+            return BlockKw::IF_THEN;
+    }
+    return BlockKw::NONE;
+}
+
+// ■ 追加: FOR <var> = <start> TO <limit> [STEP <step>] を分解する
+static bool parse_for_header(const std::string &line, std::string &var, std::string &start, std::string &limit, std::string &step)
+{
+    size_t eq = line.find('=', 3);
+    if (eq == std::string::npos)
+        return false;
+    size_t to = find_keyword(line, "TO", eq + 1);
+    if (to == std::string::npos)
+        return false;
+    size_t stp = find_keyword(line, "STEP", to + 2);
+    var = trim(line.substr(3, eq - 3));
+    start = trim(line.substr(eq + 1, to - eq - 1));
+    limit = trim(line.substr(to + 2, stp == std::string::npos ? std::string::npos : stp - to - 2));
+    step = (stp == std::string::npos) ? std::string("1") : trim(line.substr(stp + 4));
+    return !var.empty() && !start.empty() && !limit.empty() && !step.empty();
+}
+
+// '(' と ')' の間を取り出す。use_last_paren=false のときは最初の ')' を使う (UseLED/DEBUG/ProConRelease の従来挙動)
+static bool paren_args(const std::string &line, std::string &out, bool use_last_paren = true)
+{
+    size_t p = line.find('(');
+    size_t q = use_last_paren ? line.rfind(')') : line.find(')');
+    if (p == std::string::npos || q == std::string::npos || q <= p)
+        return false;
+    out = line.substr(p + 1, q - p - 1);
+    return true;
+}
+
+// ■ 追加: 配列名 -> 配列番号 (初出なら登録する)。要素の確保は DIM / LoadTable の実行時
+static int array_id_for(ScriptState &st, const std::string &name)
+{
+    auto it = st.array_ids.find(name);
+    if (it != st.array_ids.end())
+        return it->second;
+    int id = static_cast<int>(st.arrays.size());
+    st.array_ids.emplace(name, id);
+    st.arrays.emplace_back();
+    return id;
+}
+
+// ■ 追加: "name(index)" を名前と添字式に分ける (DIM と SET name(i) = ... の左辺用)
+static bool split_array_ref(const std::string &ref, std::string &name, std::string &index)
+{
+    size_t p = ref.find('(');
+    size_t q = ref.rfind(')');
+    if (p == std::string::npos || q == std::string::npos || q <= p)
+        return false;
+    name = trim(ref.substr(0, p));
+    index = trim(ref.substr(p + 1, q - p - 1));
+    if (name.empty() || index.empty() || !(isalpha((unsigned char)name[0]) || name[0] == '_'))
+        return false;
+    for (char c : name)
+    {
+        if (!(isalnum((unsigned char)c) || c == '_'))
+            return false;
+    }
+    return true;
+}
+
+// Helper: split a substring by top-level commas only (respecting quotes, escapes and nested parentheses)
+// Returns trimmed parts.
+static std::vector<std::string> split_top_level_args(const std::string &s, size_t start = 0, size_t end = std::string::npos)
+{
+    std::vector<std::string> parts;
+    if (end == std::string::npos)
+        end = s.size();
+    if (start >= end)
+        return parts;
+    bool in_q = false;
+    int depth = 0;
+    size_t last = start;
+    for (size_t i = start; i < end; ++i)
+    {
+        char ch = s[i];
+        if (ch == '\\')
+        {
+            // skip escaped char (inside or outside quotes)
+            ++i;
+            continue;
+        }
+        if (ch == '\"')
+        {
+            in_q = !in_q;
+            continue;
+        }
+        if (!in_q)
+        {
+            if (ch == '(')
             {
-                right = atoi(tok);
-                tok = strtok(nullptr, ",");
+                ++depth;
+                continue;
             }
-            if (tok)
+            if (ch == ')')
             {
-                middle = atoi(tok);
-                tok = strtok(nullptr, ",");
+                if (depth > 0)
+                    --depth;
+                continue;
             }
-            if (tok)
+            if (ch == ',' && depth == 0)
             {
-                time_ms = (unsigned long)strtoul(tok, nullptr, 10);
+                parts.push_back(trim(s.substr(last, i - last)));
+                last = i + 1;
             }
+        }
+    }
+    if (last < end)
+        parts.push_back(trim(s.substr(last, end - last)));
+    return parts;
+}
 
-            double dx = static_cast<double>(x);
-            double dy = static_cast<double>(y);
-            double nx = dx * cos(angle_rad) - dy * sin(angle_rad);
-            double ny = dx * sin(angle_rad) + dy * cos(angle_rad);
-            nx *= scale;
-            ny *= scale;
+// ■ 追加: LoadTable("file", <name>[, <count_var>]) の引数を取り出す
+static bool parse_load_table(const std::string &line, std::string &file, std::string &name, std::string &count_var)
+{
+    std::string args;
+    if (!paren_args(line, args))
+        return false;
+    size_t q1 = args.find('\"');
+    size_t q2 = (q1 == std::string::npos) ? std::string::npos : args.find('\"', q1 + 1);
+    if (q2 == std::string::npos)
+        return false;
+    size_t comma = args.find(',', q2 + 1);
+    if (comma == std::string::npos)
+        return false;
+    auto parts = split_top_level_args(args, comma + 1, args.size());
+    if (parts.empty() || parts[0].empty())
+        return false;
+    file = args.substr(q1 + 1, q2 - q1 - 1);
+    name = parts[0];
+    count_var = (parts.size() >= 2) ? parts[1] : std::string();
+    return true;
+}
 
-            int ix = static_cast<int>(round(nx));
-            int iy = static_cast<int>(round(ny));
-            if (ix < -128)
-                ix = -128;
-            if (ix > 127)
-                ix = 127;
-            if (iy < -128)
-                iy = -128;
-            if (iy > 127)
-                iy = 127;
+// ■ 追加: ON PRESS|RELEASE GOSUB <label> / ON PRESS|RELEASE OFF / EVERY <sec> GOSUB <label> を分解する
+// ev は ON のとき EVENT_PRESS / EVENT_RELEASE、EVERY のとき -1。OFF のとき label は空
+static bool parse_event_line(const std::string &line, int &ev, std::string &sec, std::string &label)
+{
+    if (find_keyword(line, "EVERY") == 0)
+    {
+        size_t g = find_keyword(line, "GOSUB", 5);
+        if (g == std::string::npos)
+            return false;
+        ev = -1;
+        sec = trim(line.substr(5, g - 5));
+        label = trim(line.substr(g + 5));
+        return !sec.empty() && !label.empty();
+    }
+    if (find_keyword(line, "ON") != 0)
+        return false;
+    std::string rest = trim(line.substr(2));
+    size_t sp = 0;
+    while (sp < rest.size() && !isspace((unsigned char)rest[sp]))
+        ++sp;
+    std::string what = rest.substr(0, sp);
+    if (strcasecmp(what.c_str(), "PRESS") == 0)
+        ev = EVENT_PRESS;
+    else if (strcasecmp(what.c_str(), "RELEASE") == 0)
+        ev = EVENT_RELEASE;
+    else
+        return false;
+    rest = trim(rest.substr(sp));
+    label.clear();
+    if (strcasecmp(rest.c_str(), "OFF") == 0)
+        return true;
+    if (find_keyword(rest, "GOSUB") != 0)
+        return false;
+    label = trim(rest.substr(5));
+    return !label.empty();
+}
 
-            if (left)
-                Mouse.press(MOUSE_LEFT);
-            else
-                Mouse.release(MOUSE_LEFT);
-            if (right)
-                Mouse.press(MOUSE_RIGHT);
-            else
-                Mouse.release(MOUSE_RIGHT);
-            if (middle)
-                Mouse.press(MOUSE_MIDDLE);
-            else
-                Mouse.release(MOUSE_MIDDLE);
+// プリパスの途中状態 (開いているブロックの種類と行)
+using OpenBlocks = std::vector<std::pair<BlockKw, int>>;
+
+static void block_error(ScriptState &st, const char *msg, int idx, const std::string &line)
+{
+    if (st.end_flag)
+        return;
+    SignalRuntimeError(msg, idx + 1, line.c_str(), "");
+    st.end_flag = true;
+}
+
+// プリパス：1行分を調べ、LABEL ならラベル辞書に登録する
+// ■ 変更: 構造化制御構文の対応付けも行う
+static void prepass_line(ScriptState &st, std::string_view raw, size_t i, OpenBlocks &open)
+{
+    std::string line = trim(raw);
+    if (line.empty())
+        return;
+    // Comments: REM or #
+    // detect case-insensitive REM
+    if (starts_with_cmd(line, "REM") || line[0] == '#')
+        return;
+    // LABEL <name>
+    if (starts_with_cmd(line, "LABEL"))
+    {
+        // extract token after LABEL
+        size_t pos = 5;
+        while (pos < line.size() && isspace((unsigned char)line[pos]))
+            ++pos;
+        std::string name = line.substr(pos);
+        name = trim(name);
+        // label points to next line index
+        st.label_to_index[name] = static_cast<int>(i + 1);
+        printf("prepass_script: found LABEL '%s' -> %d\r\n", name.c_str(), static_cast<int>(i + 1));
+        tud_task();
+        return;
+    }
+    // ■ 追加: DIM <name>(<size>) の配列名を登録する (前方の行の式からも name(i) を配列参照として扱えるように)
+    if (starts_with_cmd(line, "DIM"))
+    {
+        std::string name, size;
+        bool builtin = false;
+        if (split_array_ref(line.substr(3), name, size))
+        {
+            for (const RpnFnDef &d : kRpnFns)
+                builtin = builtin || strcasecmp(d.name, name.c_str()) == 0;
+        }
+        if (name.empty() || size.empty() || builtin || name.compare(0, 2, "__") == 0)
+            block_error(st, "DIM syntax error (DIM name(size))", static_cast<int>(i), line);
+        else
+            array_id_for(st, name);
+        return;
+    }
+    // ■ 追加: LoadTable の読み込み先も配列として登録する (DIM なしでも使える)
+    if (starts_with_cmd(line, "LoadTable"))
+    {
+        std::string file, name, count_var;
+        if (!parse_load_table(line, file, name, count_var))
+            block_error(st, "LoadTable syntax error (LoadTable(\"file\", name[, count]))", static_cast<int>(i), line);
+        else
+            array_id_for(st, name);
+        return;
+    }
+    // ■ 追加: ON / EVERY の構文を確かめ、EVERY のラベルにイベント番号を割り当てる (ページ実行でも番号が変わらないように)
+    if (find_keyword(line, "ON") == 0 || find_keyword(line, "EVERY") == 0)
+    {
+        int ev = 0;
+        std::string sec, label;
+        if (!parse_event_line(line, ev, sec, label))
+            block_error(st, "ON/EVERY syntax error (ON PRESS|RELEASE GOSUB label, EVERY sec GOSUB label)", static_cast<int>(i), line);
+        else if (ev < 0 && st.every_ids.find(label) == st.every_ids.end())
+        {
+            if (st.every_ids.size() >= (size_t)MAX_EVERY)
+                block_error(st, "EVERY: Too many handlers (max 6 labels)", static_cast<int>(i), line);
+            else
+                st.every_ids.emplace(label, EVENT_EVERY + static_cast<int>(st.every_ids.size()));
+        }
+        return;
+    }
+    // ■ 追加: Numeric(DOUBLE|FLOAT32|FIXED16_16) はスクリプト全体に効くディレクティブ (実行時は何もしない)
+    if (starts_with_cmd(line, "Numeric"))
+    {
+        std::string arg;
+        if (paren_args(line, arg))
+            arg = trim(arg);
+        if (strcasecmp(arg.c_str(), "DOUBLE") == 0)
+            st.num_mode = NumMode::DOUBLE;
+        else if (strcasecmp(arg.c_str(), "FLOAT32") == 0)
+            st.num_mode = NumMode::FLOAT32;
+        else if (strcasecmp(arg.c_str(), "FIXED16_16") == 0)
+            st.num_mode = NumMode::FIXED16_16;
+        else
+            block_error(st, "Numeric mode must be DOUBLE, FLOAT32 or FIXED16_16", static_cast<int>(i), line);
+        return;
+    }
+
+    const int idx = static_cast<int>(i);
+    BlockKw kw = block_keyword(line);
+    switch (kw)
+    {
+    case BlockKw::NONE:
+        return;
+
+    case BlockKw::FOR:
+    {
+        std::string var, start, limit, step;
+        if (!parse_for_header(line, var, start, limit, step))
+        {
+            block_error(st, "FOR syntax error (FOR v = a TO b [STEP c])", idx, line);
+            return;
+        }
+        st.block_links[idx].loop = static_cast<int>(st.for_loops.size());
+        st.for_loops.push_back(ForLoop{var});
+        open.emplace_back(kw, idx);
+        return;
+    }
+
+    case BlockKw::WHILE:
+    case BlockKw::IF_THEN:
+        open.emplace_back(kw, idx);
+        return;
+
+    case BlockKw::NEXT:
+        if (open.empty() || open.back().first != BlockKw::FOR)
+        {
+            block_error(st, "NEXT without FOR", idx, line);
+            return;
+        }
+        st.block_links[open.back().second].target = idx + 1; // 範囲外なら NEXT の次へ
+        st.block_links[idx] = BlockLink{open.back().second + 1, st.block_links[open.back().second].loop};
+        open.pop_back();
+        return;
+
+    case BlockKw::WEND:
+        if (open.empty() || open.back().first != BlockKw::WHILE)
+        {
+            block_error(st, "WEND without WHILE", idx, line);
+            return;
+        }
+        st.block_links[open.back().second].target = idx + 1; // 偽なら WEND の次へ
+        st.block_links[idx].target = open.back().second;      // WEND は WHILE の判定へ戻る
+        open.pop_back();
+        return;
+
+    case BlockKw::ELSE:
+        if (open.empty() || open.back().first != BlockKw::IF_THEN)
+        {
+            block_error(st, "ELSE without IF ... THEN", idx, line);
+            return;
+        }
+        st.block_links[open.back().second].target = idx + 1; // 偽なら ELSE の次へ
+        open.back() = {BlockKw::ELSE, idx};
+        return;
+
+    case BlockKw::ENDIF:
+        if (open.empty() || (open.back().first != BlockKw::IF_THEN && open.back().first != BlockKw::ELSE))
+        {
+            block_error(st, "ENDIF without IF ... THEN", idx, line);
+            return;
+        }
+        st.block_links[open.back().second].target = idx + 1; // IF の偽 / ELSE の終端は ENDIF の次へ
+        open.pop_back();
+        return;
+    }
+}
+
+// プリパス終了時に閉じられていないブロックを報告する
+static void prepass_finish_blocks(ScriptState &st, const OpenBlocks &open)
+{
+    if (open.empty())
+        return;
+    const char *msg = "IF ... THEN without ENDIF";
+    if (open.back().first == BlockKw::FOR)
+        msg = "FOR without NEXT";
+    else if (open.back().first == BlockKw::WHILE)
+        msg = "WHILE without WEND";
+    block_error(st, msg, open.back().second, trim(line_cstr(st, open.back().second, "")));
+}
+
+// ■ 追加: ページのバッファを最も長いページに合わせてまとめて確保する
+// ページを入れ替えるたびに確保し直すとヒープが断片化するため、実行中はこのバッファを使い回す。
+// (最も長いページはオフセット表ができるまで分からないので、プリパスの後で呼ぶ)
+static bool alloc_page_buffers(ScriptState &st)
+{
+    PagedScript &pg = st.pager;
+    uint32_t max_len = 0;
+    for (size_t k = 0; k + 1 < pg.page_offsets.size(); ++k)
+        max_len = std::max(max_len, pg.page_offsets[k + 1] - pg.page_offsets[k]);
+    pg.page_buf_size = max_len + 1;
+    if (!memory_guard_reserve((size_t)pg.page_buf_size * SCRIPT_PAGE_CACHE + 4096))
+    {
+        printf("paged: not enough memory for %d page buffers of %lu bytes\r\n", SCRIPT_PAGE_CACHE, (unsigned long)pg.page_buf_size);
+        return false;
+    }
+    for (ScriptPage &p : pg.pages)
+    {
+        p.text.reset(new (std::nothrow) char[pg.page_buf_size]);
+        if (!p.text)
+            return false;
+        p.lines.reserve(SCRIPT_PAGE_LINES);
+        p.program.reserve(SCRIPT_PAGE_LINES);
+    }
+    return true;
+}
+
+// ■ 追加: ページ実行モードのプリパス
+// ファイルを先頭から流し読みし、ラベル辞書と同時にページ先頭行のオフセット表を作る。
+static bool prepass_paged_script(ScriptState &st)
+{
+    PagedScript &pg = st.pager;
+    pg.page_offsets.clear();
+    lfs_file_seek(&g_lfs, &pg.fp, 0, LFS_SEEK_SET);
+
+    char chunk[256];
+    std::string accum;
+    OpenBlocks open;
+    uint32_t pos = 0;      // 読み込み済みバイト数
+    size_t line_idx = 0;   // 現在の行番号
+    bool at_line_start = true;
+    while (true)
+    {
+        int br = (int)lfs_file_read(&g_lfs, &pg.fp, chunk, sizeof(chunk));
+        if (br < 0)
+            return false;
+        if (br == 0)
+            break;
+        for (int k = 0; k < br; ++k, ++pos)
+        {
+            if (at_line_start)
+            {
+                if (line_idx % SCRIPT_PAGE_LINES == 0)
+                    pg.page_offsets.push_back(pos);
+                at_line_start = false;
+            }
+            char c = chunk[k];
+            if (c == '\r')
+                continue;
+            if (c == '\n')
+            {
+                prepass_line(st, accum, line_idx, open);
+                accum.clear();
+                ++line_idx;
+                at_line_start = true;
+            }
+            else
+            {
+                accum.push_back(c);
+            }
+        }
+        tud_task();
+    }
+    if (!at_line_start)
+    {
+        prepass_line(st, accum, line_idx, open);
+        ++line_idx;
+    }
+    pg.page_offsets.push_back(pos);
+    st.line_count = line_idx;
+    prepass_finish_blocks(st, open);
+    return true;
+}
+
+// プリパス：行を走査してラベル辞書を作成する
+static void prepass_script(ScriptState &st)
+{
+    st.label_to_index.clear();
+    st.block_links.clear();
+    st.for_loops.clear();
+    if (st.paged)
+    {
+        printf("prepass_script: indexing paged script\r\n");
+        tud_task();
+        if (!prepass_paged_script(st))
+        {
+            SignalRuntimeError("Script read failed", 0, "prepass", "");
+            st.end_flag = true;
+        }
+        else if (!alloc_page_buffers(st))
+        {
+            SignalRuntimeError("Out of Memory (script pages)", 0, "prepass", "");
+            st.end_flag = true;
+        }
+        printf("prepass_script: completed, %zu lines / %zu pages, %zu labels registered\r\n",
+               st.line_count, st.pager.page_offsets.size() - 1, st.label_to_index.size());
+        tud_task();
+        return;
+    }
+    printf("prepass_script: scanning %zu lines for LABELs\r\n", st.lines.size());
+    tud_task();
+    OpenBlocks open;
+    for (size_t i = 0; i < st.lines.size(); ++i)
+        prepass_line(st, st.lines[i], i, open);
+    prepass_finish_blocks(st, open);
+    printf("prepass_script: completed, %zu labels registered\r\n", st.label_to_index.size());
+    tud_task();
+}
+
+// コマンド後の簡易トークン解析用ヘルパー
+static inline std::string token_after(const std::string &line, size_t start)
+{
+    size_t i = start;
+    while (i < line.size() && isspace((unsigned char)line[i]))
+        ++i;
+    if (i >= line.size())
+        return "";
+    // if starts with quote then read up to matching quote
+    if (line[i] == '\"')
+    {
+        ++i;
+        size_t j = i;
+        while (j < line.size() && line[j] != '\"')
+            ++j;
+        return line.substr(i, j - i);
+    }
+    // else take until space
+    size_t j = i;
+    while (j < line.size() && !isspace((unsigned char)line[j]))
+        ++j;
+    return line.substr(i, j - i);
+}
+
+// ■ 追加: ドリフトしない待機 (すべての時間待ちの共通部分)
+// 待機は相対時間ではなく絶対時刻の期限で管理する。各タスクは直前の待機の期限 (anchor_us) を持ち、次の待機は
+// 「今」ではなくその期限から測る。行の解釈・式の評価・tud_task() にかかった時間が待ち時間に上乗せされないので、
+// WAIT 0.01 のループも長い記録の再生も、スクリプト開始時刻 (g_script_start_us) に固定した時間軸からずれない。
+// ■ 変更: 遅れが TIMING_RESYNC_DEFAULT_US (TimingResync(sec) で変更) 未満なら測り直さず、次の待機を短くして取り戻す。
+// それ以上遅れたとき (待たずにボタンを待つループの後など) は今を起点に測り直し、後の待機が続けて 0 になるのを防ぐ。
+// TimingResync(0) なら測り直さず、どれだけ遅れても取り戻す。
+// 押している時間 (KeyPushFor などの押下から解放まで) は遅れを取り戻すのに使わず、実際に押した時刻から測る (task_hold_us)。
+
+// 秒単位の値をマイクロ秒に変換する (負の値は 0)
+static inline uint64_t seconds_to_us(double sec)
+{
+    return sec > 0.0 ? static_cast<uint64_t>(llround(sec * 1000000.0)) : 0;
+}
+
+// 次の待機の起点 (実行中のタスクの時間軸上の「今」)
+static uint64_t task_timeline_base(ScriptState &st)
+{
+    const uint64_t now = time_us_64();
+    const uint64_t anchor = st.tasks[st.cur_task].anchor_us;
+    if (anchor > now)
+        return now;
+    return (st.resync_us && now - anchor >= st.resync_us) ? now : anchor;
+}
+
+// 実行中のタスクを絶対時刻 deadline まで待機させる (眠らずにスケジューラへ制御を返す)
+static void task_sleep_until_us(ScriptState &st, uint64_t deadline)
+{
+    ScriptTask &t = st.tasks[st.cur_task];
+    t.anchor_us = deadline;
+    t.wake_us = deadline;
+    t.timed = deadline > time_us_64(); // 実際に眠る待機だけオーバーシュートを集計する
+    st.yield = true;
+}
+
+static void task_sleep_us(ScriptState &st, uint64_t us)
+{
+    task_sleep_until_us(st, task_timeline_base(st) + us);
+}
+
+static void task_sleep_ms(ScriptState &st, uint32_t ms)
+{
+    task_sleep_us(st, (uint64_t)ms * 1000u);
+}
+
+// ■ 追加: 押している時間の待機。起きる時刻は実際に押した今から測り (押下が 0 秒に縮まない)、
+// 時間軸は押下時間の分だけ進める (押すまでの遅れは後の待機で取り戻す)
+static void task_hold_us(ScriptState &st, uint64_t us)
+{
+    const uint64_t base = task_timeline_base(st);
+    task_sleep_until_us(st, time_us_64() + us);
+    st.tasks[st.cur_task].anchor_us = base + us;
+}
+
+static void task_hold_ms(ScriptState &st, uint32_t ms)
+{
+    task_hold_us(st, (uint64_t)ms * 1000u);
+}
+
+// ■ 追加: 期限ちょうどに起きるための眠り (ハードウェアタイマーのアラーム + 短いビジーウェイト)
+// sleep_until はアラーム割り込みで起きるが、割り込みの応答などで期限より少し遅れる。そこで tail_us だけ早めに起き、
+// 残りは time_us_64() を見ながら回る。tail_us は sleep_until の実際の遅れ (の 2 倍) に 1/8 ずつ近づけて較正する。
+// 期限からの遅れ (オーバーシュート) は集計し、スクリプト終了時に表示する。
+static const int32_t TIMING_TAIL_MIN_US = 10;
+static const int32_t TIMING_TAIL_MAX_US = 500;
+
+struct TimingStats
+{
+    int32_t tail_us = 50;           // 期限の何 us 前に起きてビジーウェイトに切り替えるか
+    uint32_t waits = 0;             // 集計した待機の数
+    uint64_t overshoot_sum_us = 0;
+    uint32_t overshoot_max_us = 0;
+    uint32_t late_100us = 0;        // 100us 以上遅れた数
+};
+static TimingStats g_timing;
+
+static void record_overshoot(uint64_t deadline, uint64_t now)
+{
+    const uint32_t late = now > deadline ? static_cast<uint32_t>(now - deadline) : 0;
+    ++g_timing.waits;
+    g_timing.overshoot_sum_us += late;
+    if (late > g_timing.overshoot_max_us)
+        g_timing.overshoot_max_us = late;
+    if (late >= 100)
+        ++g_timing.late_100us;
+}
+
+static void precise_sleep_until(uint64_t deadline)
+{
+    uint64_t now = time_us_64();
+    if (deadline > now + (uint64_t)g_timing.tail_us)
+    {
+        const uint64_t early = deadline - g_timing.tail_us;
+        sleep_until(from_us_since_boot(early));
+        now = time_us_64();
+        int32_t want = std::min(static_cast<int32_t>(std::min<uint64_t>(now - early, TIMING_TAIL_MAX_US)) * 2, TIMING_TAIL_MAX_US);
+        want = std::max(want, TIMING_TAIL_MIN_US);
+        g_timing.tail_us += (want - g_timing.tail_us) / 8;
+    }
+    while (now < deadline)
+    {
+        tight_loop_contents();
+        now = time_us_64();
+    }
+}
+
+// 絶対時刻 deadline まで、20ms ごとに USB を処理しながら眠る (全タスクを止める Mouserun 用)
+static void sleep_until_with_usb(uint64_t deadline)
+{
+    for (uint64_t now = time_us_64(); now < deadline; now = time_us_64())
+    {
+        if (deadline - now > 20000)
+        {
+            sleep_until(from_us_since_boot(now + 20000));
+            tud_task();
+            continue;
+        }
+        precise_sleep_until(deadline);
+        record_overshoot(deadline, time_us_64());
+        break;
+    }
+}
+
+// Mouserun 実装：Flash から CSV を読み込み再生する
+static void do_mouserun(ScriptState &st, const std::string &filename, double time_scale, double angle_rad, double scale)
+{
+    printf("do_mouserun: start '%s'\r\n", filename.c_str());
+    tud_task();
+
+    int err = script_fs_mount();
+    if (err < 0)
+    {
+        printf("do_mouserun: lfs_mount failed %d\r\n", err);
+        return;
+    }
+
+    lfs_file_t fp;
+    int rc = lfs_file_open(&g_lfs, &fp, filename.c_str(), LFS_O_RDONLY);
+    if (rc < 0)
+    {
+        script_fs_unmount();
+        const char *current_line_str = line_cstr(st, st.current_line_index, "Mouserun");
+
+        SignalRuntimeError("Mouserun: File not found", st.current_line_index + 1, current_line_str, "");
+        st.end_flag = true;
+        return;
+    }
+
+    // ■ 変更: 各行の待ち時間は期限に積み上げ、ファイル読み込みや HID 送信にかかった時間の分ずれないようにする
+    uint64_t deadline = task_timeline_base(st);
+
+    // read file in chunks and split into lines to avoid dependency on f_gets
+    char chunk[256];
+    std::string accum;
+    int br = 0;
+    while (true)
+    {
+        br = (int)lfs_file_read(&g_lfs, &fp, chunk, sizeof(chunk));
+        if (br <= 0)
+            break;
+        for (int i = 0; i < br; ++i)
+        {
+            char c = chunk[i];
+            if (c == '\r')
+                continue;
+            if (c == '\n')
+            {
+                std::string l = trim(accum);
+                accum.clear();
+                if (l.empty())
+                    continue;
+                if (l[0] == '#' || starts_with_cmd(l, "REM"))
+                    continue;
+                // make a mutable copy for strtok parsing
+                char linebuf2[256];
+                strncpy(linebuf2, l.c_str(), sizeof(linebuf2));
+                linebuf2[sizeof(linebuf2) - 1] = '\0';
+
+                // parse CSV: x,y,rel,LEFT,RIGHT,MIDDLE,time(ms)
+                int x = 0, y = 0, rel = 0;
+                int left = 0, right = 0, middle = 0;
+                unsigned long time_ms = 0;
+                char *p = linebuf2;
+                char *tok = strtok(p, ",");
+                if (!tok)
+                    continue;
+                x = atoi(tok);
+                tok = strtok(nullptr, ",");
+                if (!tok)
+                    continue;
+                y = atoi(tok);
+                tok = strtok(nullptr, ",");
+                if (!tok)
+                    continue;
+                rel = atoi(tok);
+                tok = strtok(nullptr, ",");
+                if (!tok)
+                    continue;
+                left = atoi(tok);
+                tok = strtok(nullptr, ",");
+                if (!tok)
+                    continue;
+                right = atoi(tok);
+                tok = strtok(nullptr, ",");
+                if (!tok)
+                    continue;
+                middle = atoi(tok);
+                tok = strtok(nullptr, ",");
+                if (!tok)
+                    continue;
+                time_ms = (unsigned long)strtoul(tok, nullptr, 10);
+
+                // apply rotation and scale
+                double dx = static_cast<double>(x);
+                double dy = static_cast<double>(y);
+                double nx = dx * cos(angle_rad) - dy * sin(angle_rad);
+                double ny = dx * sin(angle_rad) + dy * cos(angle_rad);
+                nx *= scale;
+                ny *= scale;
+
+                // clamp to -128..127 for Mouse.move signed char
+                int ix = static_cast<int>(round(nx));
+                int iy = static_cast<int>(round(ny));
+                if (ix < -128)
+                    ix = -128;
+                if (ix > 127)
+                    ix = 127;
+                if (iy < -128)
+                    iy = -128;
+                if (iy > 127)
+                    iy = 127;
+
+                // マウス移動とボタン状態を送信
+                if (left)
+                    Mouse.press(MOUSE_LEFT);
+                else
+                    Mouse.release(MOUSE_LEFT);
+                if (right)
+                    Mouse.press(MOUSE_RIGHT);
+                else
+                    Mouse.release(MOUSE_RIGHT);
+                if (middle)
+                    Mouse.press(MOUSE_MIDDLE);
+                else
+                    Mouse.release(MOUSE_MIDDLE);
+
+                Mouse.move((signed char)ix, (signed char)iy, (signed char)rel);
+                tud_task();
+
+                // スケーリングされた時間だけ待機
+                uint64_t wait_us = seconds_to_us(time_ms * time_scale / 1000.0);
+                if (wait_us)
+                {
+                    deadline += wait_us;
+                    sleep_until_with_usb(deadline);
+                }
+            }
+            else
+            {
+                accum.push_back(c);
+            }
+        }
+    }
+    // process any trailing data as a final line
+    if (!accum.empty())
+    {
+        std::string l = trim(accum);
+        if (!(l.empty() || l[0] == '#' || starts_with_cmd(l, "REM")))
+        {
+            char linebuf2[256];
+            strncpy(linebuf2, l.c_str(), sizeof(linebuf2));
+            linebuf2[sizeof(linebuf2) - 1] = '\0';
+
+            int x = 0, y = 0, rel = 0;
+            int left = 0, right = 0, middle = 0;
+            unsigned long time_ms = 0;
+            char *p = linebuf2;
+            char *tok = strtok(p, ",");
+            if (tok)
+            {
+                x = atoi(tok);
+                tok = strtok(nullptr, ",");
+            }
+            if (tok)
+            {
+                y = atoi(tok);
+                tok = strtok(nullptr, ",");
+            }
+            if (tok)
+            {
+                rel = atoi(tok);
+                tok = strtok(nullptr, ",");
+            }
+            if (tok)
+            {
+                left = atoi(tok);
+                tok = strtok(nullptr, ",");
+            }
+            if (tok)
+            {
+                right = atoi(tok);
+                tok = strtok(nullptr, ",");
+            }
+            if (tok)
+            {
+                middle = atoi(tok);
+                tok = strtok(nullptr, ",");
+            }
+            if (tok)
+            {
+                time_ms = (unsigned long)strtoul(tok, nullptr, 10);
+            }
+
+            double dx = static_cast<double>(x);
+            double dy = static_cast<double>(y);
+            double nx = dx * cos(angle_rad) - dy * sin(angle_rad);
+            double ny = dx * sin(angle_rad) + dy * cos(angle_rad);
+            nx *= scale;
+            ny *= scale;
+
+            int ix = static_cast<int>(round(nx));
+            int iy = static_cast<int>(round(ny));
+            if (ix < -128)
+                ix = -128;
+            if (ix > 127)
+                ix = 127;
+            if (iy < -128)
+                iy = -128;
+            if (iy > 127)
+                iy = 127;
+
+            if (left)
+                Mouse.press(MOUSE_LEFT);
+            else
+                Mouse.release(MOUSE_LEFT);
+            if (right)
+                Mouse.press(MOUSE_RIGHT);
+            else
+                Mouse.release(MOUSE_RIGHT);
+            if (middle)
+                Mouse.press(MOUSE_MIDDLE);
+            else
+                Mouse.release(MOUSE_MIDDLE);
+
+            Mouse.move((signed char)ix, (signed char)iy, (signed char)rel);
+            tud_task();
+
+            uint64_t wait_us = seconds_to_us(time_ms * time_scale / 1000.0);
+            if (wait_us)
+            {
+                deadline += wait_us;
+                sleep_until_with_usb(deadline);
+            }
+        }
+    }
+    lfs_file_close(&g_lfs, &fp);
+    script_fs_unmount();
+    st.tasks[st.cur_task].anchor_us = deadline; // 続く待機は再生の終わりの期限から測る
+}
+
+// ---- コンパイル済み命令 ----
+// スクリプトはプリパス後に 1 行 = 1 命令へ変換し、実行時はオペコードで分岐する。
+// コマンド名の照合・引数分割・ラベル解決・キー名/ボタン名の変換はロード時に一度だけ行う。
+
+// キー名 / 数値 / 1文字をキーコードへ解決する
+static int resolve_key_code(const std::string &keytok)
+{
+    if (keytok.empty())
+        return 0;
+    // numeric literal?
+    bool is_num = true;
+    for (char ch : keytok)
+        if (!(ch >= '0' && ch <= '9'))
+        {
+            is_num = false;
+            break;
+        }
+    if (is_num)
+        return atoi(keytok.c_str());
+    // mapped name
+    uint8_t mapped = key_name_to_hid(keytok);
+    if (mapped != 0)
+        return mapped;
+    // single character -> ascii
+    if (keytok.size() == 1)
+        return (int)keytok[0];
+    // fallback: attempt atoi (will yield 0)
+    return atoi(keytok.c_str());
+}
+
+// KeyType 用: エスケープシーケンスを展開する
+static std::string unescape_string(const std::string &inner)
+{
+    std::string s;
+    for (size_t i = 0; i < inner.size(); ++i)
+    {
+        char c = inner[i];
+        if (c == '\\' && i + 1 < inner.size())
+        {
+            char n = inner[++i];
+            switch (n)
+            {
+            case 'n':
+                s.push_back('\n');
+                break;
+            case 'r':
+                s.push_back('\r');
+                break;
+            case 't':
+                s.push_back('\t');
+                break;
+            case '\\':
+                s.push_back('\\');
+                break;
+            case '\"':
+                s.push_back('\"');
+                break;
+            default:
+                // unknown escape -> keep char as-is
+                s.push_back(n);
+                break;
+            }
+        }
+        else
+        {
+            s.push_back(c);
+        }
+    }
+    return s;
+}
+
+// マウスボタン名 -> MOUSE_xxx (未知の名前は 0)
+static int mouse_button_from_name(const std::string &arg)
+{
+    if (arg == "LEFT")
+        return MOUSE_LEFT;
+    if (arg == "RIGHT")
+        return MOUSE_RIGHT;
+    if (arg == "MIDDLE")
+        return MOUSE_MIDDLE;
+    return 0;
+}
+
+// Proコンのボタン名 -> Button (未知の名前は従来どおり A 扱い)
+static Button procon_button_from_name(const std::string &arg)
+{
+    if (arg == "B")
+        return Button::B;
+    if (arg == "X")
+        return Button::X;
+    if (arg == "Y")
+        return Button::Y;
+    if (arg == "L")
+        return Button::L;
+    if (arg == "R")
+        return Button::R;
+    if (arg == "ZL")
+        return Button::ZL;
+    if (arg == "ZR")
+        return Button::ZR;
+    if (arg == "MINUS")
+        return Button::MINUS;
+    if (arg == "PLUS")
+        return Button::PLUS;
+    if (arg == "LCLICK")
+        return Button::LCLICK;
+    if (arg == "RCLICK")
+        return Button::RCLICK;
+    if (arg == "HOME")
+        return Button::HOME;
+    if (arg == "CAPTURE")
+        return Button::CAPTURE;
+    return Button::A;
+}
+
+// ハット方向名 -> Hat (未知の名前は CENTER)
+static Hat procon_hat_from_name(const std::string &arg)
+{
+    if (arg == "UP")
+        return Hat::UP;
+    if (arg == "UP_RIGHT")
+        return Hat::UP_RIGHT;
+    if (arg == "RIGHT")
+        return Hat::RIGHT;
+    if (arg == "RIGHT_DOWN")
+        return Hat::RIGHT_DOWN;
+    if (arg == "DOWN")
+        return Hat::DOWN;
+    if (arg == "DOWN_LEFT")
+        return Hat::DOWN_LEFT;
+    if (arg == "LEFT")
+        return Hat::LEFT;
+    if (arg == "LEFT_UP")
+        return Hat::LEFT_UP;
+    return Hat::CENTER;
+}
+
+// ラベル名 -> 行インデックス (未定義なら -1)
+static int resolve_label(const ScriptState &st, const std::string &label)
+{
+    auto it = st.label_to_index.find(label);
+    return (it != st.label_to_index.end()) ? it->second : -1;
+}
+
+// 変数名 -> スロット番号 (初出ならスロットを割り当てる)
+static int var_slot_for(ScriptState &st, const std::string &name)
+{
+    auto it = st.var_slots.find(name);
+    if (it != st.var_slots.end())
+        return it->second;
+    int slot = static_cast<int>(st.var_names.size());
+    st.var_slots.emplace(name, slot);
+    st.var_names.push_back(name);
+    return slot;
+}
+
+// 変数への代入。初めて定義されたスロットなら式キャッシュを無効化する
+static inline void set_var(ScriptState &st, int slot, double val)
+{
+    // ■ 追加: この変数に依存するメモを無効化する (値が変わらない代入では無効化しない)
+    if ((size_t)slot < st.slot_memos.size() && st.var_values[slot] != val)
+    {
+        for (int m : st.slot_memos[slot])
+            st.memos[m].valid = false;
+    }
+    st.var_values[slot] = val;
+    if (!st.var_defined[slot])
+    {
+        st.var_defined[slot] = 1;
+        ++st.var_epoch;
+    }
+}
+
+// ■ 追加: LoadTable 実装：Flash 上の CSV の数値を先頭から順に配列へ読み込む
+// ファイルはチャンク単位で 1 回だけ読み、数値を直接配列に格納する (行全体を保持しない)。
+// 区切りは ',' ';' 空白 改行。'#' で始まる行はコメント。
+// DIM 済みの配列には先頭から上書きし (要素数を超えたらエラー)、未 DIM の配列は読み込んだ数に合わせて確保する。
+static void do_load_table(ScriptState &st, const Instr &in)
+{
+    printf("do_load_table: start '%s'\r\n", in.text.c_str());
+    tud_task();
+    const char *current_line_str = line_cstr(st, st.current_line_index, "LoadTable");
+
+    int err = script_fs_mount();
+    if (err < 0)
+    {
+        printf("do_load_table: lfs_mount failed %d\r\n", err);
+        SignalRuntimeError("LoadTable: Filesystem mount failed", st.current_line_index + 1, current_line_str, "");
+        st.end_flag = true;
+        return;
+    }
+
+    lfs_file_t fp;
+    int rc = lfs_file_open(&g_lfs, &fp, in.text.c_str(), LFS_O_RDONLY);
+    if (rc < 0)
+    {
+        script_fs_unmount();
+        SignalRuntimeError("LoadTable: File not found", st.current_line_index + 1, current_line_str, in.text.c_str());
+        st.end_flag = true;
+        return;
+    }
+
+    std::vector<double> &arr = st.arrays[in.ival];
+    const bool dimmed = !arr.empty();
+    size_t count = 0;
+    const char *fail = nullptr;
+    char chunk[256];
+    char tok[48];
+    size_t tok_len = 0;
+    bool comment = false;
+    bool line_start = true;
+
+    // 1 トークンを数値に変換して格納する
+    auto flush = [&]() {
+        if (tok_len == 0)
+            return;
+        tok[tok_len] = '\0';
+        tok_len = 0;
+        char *endp = nullptr;
+        double v = strtod(tok, &endp);
+        if (!endp || *endp != '\0' || std::isnan(v) || std::isinf(v))
+        {
+            fail = "LoadTable: invalid number";
+            return;
+        }
+        if (dimmed)
+        {
+            if (count >= arr.size())
+            {
+                fail = "LoadTable: more values than the DIM size";
+                return;
+            }
+            arr[count] = v;
+        }
+        else
+        {
+            // 容量を倍々で広げる前に予算を確かめる
+            if (arr.size() == arr.capacity())
+            {
+                const size_t cap = std::max<size_t>(64, arr.capacity() * 2);
+                if (!memory_guard_reserve((cap - arr.capacity()) * sizeof(double)))
+                {
+                    fail = "Out of Memory (LoadTable)";
+                    return;
+                }
+                arr.reserve(cap);
+            }
+            arr.push_back(v);
+        }
+        ++count;
+    };
+
+    while (!fail)
+    {
+        int br = (int)lfs_file_read(&g_lfs, &fp, chunk, sizeof(chunk));
+        if (br <= 0)
+            break;
+        for (int i = 0; i < br && !fail; ++i)
+        {
+            char c = chunk[i];
+            if (c == '\n')
+            {
+                if (!comment)
+                    flush();
+                comment = false;
+                line_start = true;
+                continue;
+            }
+            if (comment)
+                continue;
+            if (line_start && c == '#')
+            {
+                comment = true;
+                continue;
+            }
+            if (c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\r')
+            {
+                flush();
+                continue;
+            }
+            line_start = false;
+            if (tok_len + 1 >= sizeof(tok))
+            {
+                fail = "LoadTable: invalid number";
+                break;
+            }
+            tok[tok_len++] = c;
+        }
+        tud_task();
+    }
+    if (!fail && !comment)
+        flush();
+
+    lfs_file_close(&g_lfs, &fp);
+    script_fs_unmount();
+
+    if (fail)
+    {
+        SignalRuntimeError(fail, st.current_line_index + 1, current_line_str, in.text.c_str());
+        st.end_flag = true;
+        return;
+    }
+    if (in.aux >= 0)
+        set_var(st, in.aux, static_cast<double>(count));
+    printf("do_load_table: %u values -> array %d\r\n", (unsigned)count, in.ival);
+}
+
+// 1 行をコンパイルする。判定順は旧 execute_line と同じ。
+// ■ 変更: idx は行インデックス (構造化制御構文のジャンプ先を block_links から引く)
+static Instr compile_line(ScriptState &st, std::string_view raw, int idx)
+{
+    Instr in;
+    std::string line = trim(raw);
+    if (line.empty())
+        return in;
+
+    // コメント / LABEL / Numeric は実行時には何もしない
+    if (line[0] == '#' || starts_with_cmd(line, "REM") || starts_with_cmd(line, "LABEL") || starts_with_cmd(line, "Numeric"))
+        return in;
+
+    // ■ 追加: 構造化制御構文 (対応関係はプリパスで解決済み)
+    BlockKw kw = block_keyword(line);
+    if (kw != BlockKw::NONE)
+    {
+        auto it = st.block_links.find(idx);
+        if (it == st.block_links.end())
+            return in; // 対応が取れていない (プリパスでエラー報告済み)
+        const BlockLink &bl = it->second;
+        switch (kw)
+        {
+        case BlockKw::FOR:
+        {
+            std::string var, start, limit, step;
+            if (!parse_for_header(line, var, start, limit, step))
+                return in;
+            in.op = Op::FOR;
+            in.ival = var_slot_for(st, var);
+            in.aux = bl.loop;
+            in.target = bl.target;
+            in.exprs.reserve(3);
+            in.exprs.push_back(start);
+            in.exprs.push_back(limit);
+            in.exprs.push_back(step);
+            break;
+        }
+        case BlockKw::NEXT:
+            in.op = Op::NEXT;
+            in.ival = var_slot_for(st, st.for_loops[bl.loop].var);
+            in.aux = bl.loop;
+            in.target = bl.target;
+            break;
+        case BlockKw::WHILE:
+            in.op = Op::JUMP_IF_FALSE;
+            in.exprs.push_back(trim(line.substr(5)));
+            in.target = bl.target;
+            break;
+        case BlockKw::IF_THEN:
+            in.op = Op::JUMP_IF_FALSE;
+            in.exprs.push_back(trim(line.substr(2, find_keyword(line, "THEN") - 2)));
+            in.target = bl.target;
+            break;
+        case BlockKw::WEND:
+        case BlockKw::ELSE:
+            in.op = Op::GOTO;
+            in.target = bl.target;
+            break;
+        default: // ENDIF は何もしない
+            break;
+        }
+        return in;
+    }
+
+    if (starts_with_cmd(line, "END"))
+    {
+        in.op = Op::END;
+        return in;
+    }
+
+    // ■ 追加: WAITUNTIL <cond>, <timeout>, <poll>[, <var>]  (WAIT より先に判定する)
+    if (starts_with_cmd(line, "WAITUNTIL"))
+    {
+        auto parts = split_top_level_args(line, 9);
+        if (parts.size() < 3 || parts.size() > 4)
+            return in;
+        in.op = Op::WAIT_UNTIL;
+        for (int k = 0; k < 3; ++k)
+            in.exprs.push_back(parts[k]);
+        in.aux = (parts.size() == 4 && !parts[3].empty()) ? var_slot_for(st, parts[3]) : -1;
+        return in;
+    }
+
+    // ■ 追加: WAITUS <expression>  (WAIT より先に判定する)
+    if (starts_with_cmd(line, "WAITUS"))
+    {
+        in.op = Op::WAIT_US;
+        in.exprs.push_back(trim(line.substr(6)));
+        return in;
+    }
+
+    // ■ 追加: AT <expression>
+    if (find_keyword(line, "AT") == 0)
+    {
+        in.op = Op::AT;
+        in.exprs.push_back(trim(line.substr(2)));
+        return in;
+    }
+
+    // WAIT <expression>
+    if (starts_with_cmd(line, "WAIT"))
+    {
+        in.op = Op::WAIT;
+        in.exprs.push_back(trim(line.substr(4)));
+        return in;
+    }
+
+    // PRINT <expression>
+    if (starts_with_cmd(line, "PRINT"))
+    {
+        in.op = Op::PRINT;
+        in.exprs.push_back(trim(line.substr(5)));
+        return in;
+    }
+
+    // ■ 追加: SETI <var> = <expression>
+    if (starts_with_cmd(line, "SETI"))
+    {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            return in;
+        in.op = Op::SETI;
+        in.ival = var_slot_for(st, token_after(trim(line.substr(4, eq - 4)), 0));
+        in.exprs.push_back(trim(line.substr(eq + 1)));
+        return in;
+    }
+
+    // ■ 追加: DIM <name>(<size>)  (名前はプリパスで登録済み)
+    if (starts_with_cmd(line, "DIM"))
+    {
+        std::string name, size;
+        if (!split_array_ref(line.substr(3), name, size) || !st.array_ids.count(name))
+            return in;
+        in.op = Op::DIM;
+        in.ival = st.array_ids[name];
+        in.exprs.push_back(size);
+        return in;
+    }
+
+    // SET <var> = <expression>
+    // ■ 追加: SET <name>(<index>) = <expression> は配列要素への代入
+    if (starts_with_cmd(line, "SET"))
+    {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            return in;
+        std::string name, index;
+        if (split_array_ref(line.substr(3, eq - 3), name, index) && st.array_ids.count(name))
+        {
+            in.op = Op::SET_ARRAY;
+            in.ival = st.array_ids[name];
+            in.exprs.push_back(index);
+            in.exprs.push_back(trim(line.substr(eq + 1)));
+            return in;
+        }
+        in.op = Op::SET;
+        in.ival = var_slot_for(st, token_after(trim(line.substr(3, eq - 3)), 0));
+        in.exprs.push_back(trim(line.substr(eq + 1)));
+        return in;
+    }
+
+    // IF <expr> GOTO <name>  (GOTO が無い IF は後続の判定へ進み、最終的に無視される)
+    if (starts_with_cmd(line, "IF"))
+    {
+        std::string upper = line;
+        for (auto &c : upper)
+            if (c >= 'a' && c <= 'z')
+                c = c - 'a' + 'A';
+        size_t posGoto = upper.find("GOTO");
+        if (posGoto != std::string::npos)
+        {
+            in.op = Op::IF_GOTO;
+            // ■ 追加: "IF <expr> THEN GOTO <name>" も受け付ける
+            size_t expr_end = posGoto;
+            size_t then = find_keyword(line, "THEN");
+            if (then != std::string::npos && then < posGoto)
+                expr_end = then;
+            in.exprs.push_back(trim(line.substr(2, expr_end - 2)));
+            in.target = resolve_label(st, trim(line.substr(posGoto + 4)));
+            return in;
+        }
+    }
+
+    // GOTO <name>
+    if (starts_with_cmd(line, "GOTO"))
+    {
+        in.op = Op::GOTO;
+        in.target = resolve_label(st, token_after(line, 4));
+        return in;
+    }
+
+    // GOSUB <name>
+    if (starts_with_cmd(line, "GOSUB"))
+    {
+        in.op = Op::GOSUB;
+        in.target = resolve_label(st, token_after(line, 5));
+        return in;
+    }
+
+    // RETURN
+    if (starts_with_cmd(line, "RETURN"))
+    {
+        in.op = Op::RETURN;
+        return in;
+    }
+
+    // ■ 追加: SPAWN <label> / JOIN
+    if (starts_with_cmd(line, "SPAWN"))
+    {
+        in.op = Op::SPAWN;
+        in.target = resolve_label(st, token_after(line, 5));
+        return in;
+    }
+    if (starts_with_cmd(line, "JOIN"))
+    {
+        in.op = Op::JOIN;
+        return in;
+    }
+
+    // ■ 追加: ON PRESS|RELEASE GOSUB <label> / ON PRESS|RELEASE OFF / EVERY <sec> GOSUB <label>
+    if (find_keyword(line, "ON") == 0 || find_keyword(line, "EVERY") == 0)
+    {
+        int ev = 0;
+        std::string sec, label;
+        if (!parse_event_line(line, ev, sec, label))
+            return in;
+        in.target = label.empty() ? -1 : resolve_label(st, label);
+        in.aux = label.empty() ? 1 : 0; // 1 = OFF
+        if (ev >= 0)
+        {
+            in.op = Op::ON_EVENT;
+            in.ival = ev;
+            return in;
+        }
+        auto it = st.every_ids.find(label);
+        if (it == st.every_ids.end())
+            return in; // プリパスでエラー済み
+        in.op = Op::EVERY;
+        in.ival = it->second;
+        in.exprs.push_back(sec);
+        return in;
+    }
+
+    // 使用例: LogConfig(20, OVERWRITE) または LogConfig(10, STOP)
+    // ■ 追加: 第3引数に BINARY を指定すると log.bin にバイナリで記録する (既定は TEXT)
+    if (starts_with_cmd(line, "LogConfig"))
+    {
+        std::string args;
+        if (!paren_args(line, args))
+            return in;
+        auto parts = split_top_level_args(args);
+        if (parts.size() < 2)
+            return in;
+        std::string mode = trim(parts[1]); // モード文字列
+        bool overwrite = true;             // デフォルト
+
+        // 大文字小文字無視で判定
+        std::string m_upper = mode;
+        for (auto &c : m_upper)
+            if (c >= 'a' && c <= 'z')
+                c = c - 'a' + 'A';
+
+        if (m_upper == "STOP")
+            overwrite = false;
+        else if (m_upper == "OVERWRITE")
+            overwrite = true;
+        else if (mode == "0") // 数値(0/1)での指定も許容
+            overwrite = false;
+
+        bool binary = false;
+        if (parts.size() >= 3)
+        {
+            std::string format = trim(parts[2]);
+            binary = strcasecmp(format.c_str(), "BINARY") == 0;
+        }
+
+        in.op = Op::LOG_CONFIG;
+        in.ival = overwrite ? 1 : 0;
+        in.aux = binary ? 1 : 0;
+        in.exprs.push_back(parts[0]); // サイズ(KB)
+        return in;
+    }
+
+    // Mode
+    if (starts_with_cmd(line, "Mode"))
+    {
+        std::string arg;
+        if (!paren_args(line, arg))
+            return in;
+        arg = trim(arg);
+        if (arg == "KeyMouse")
+        {
+            in.op = Op::MODE;
+            in.ival = USB_MODE_HID;
+        }
+        else if (arg == "ProController")
+        {
+            in.op = Op::MODE;
+            in.ival = USB_MODE_HID_Switch;
+        }
+        return in;
+    }
+
+    // UseLED / DEBUG
+    if (starts_with_cmd(line, "UseLED") || starts_with_cmd(line, "DEBUG"))
+    {
+        std::string arg;
+        if (!paren_args(line, arg, false))
+            return in;
+        in.op = starts_with_cmd(line, "UseLED") ? Op::USE_LED : Op::DEBUG;
+        in.exprs.push_back(trim(arg));
+        return in;
+    }
+
+    // ■ 追加: PROFILE(<expression>)
+    if (starts_with_cmd(line, "PROFILE"))
+    {
+        std::string arg;
+        if (!paren_args(line, arg, false))
+            return in;
+        in.op = Op::PROFILE;
+        in.exprs.push_back(trim(arg));
+        return in;
+    }
+
+    // ■ 追加: Seed(<expression>) / RandEngine(XOSHIRO128|MT19937)
+    if (starts_with_cmd(line, "Seed"))
+    {
+        std::string arg;
+        if (!paren_args(line, arg))
+            return in;
+        in.op = Op::SEED;
+        in.exprs.push_back(trim(arg));
+        return in;
+    }
+    // ■ 追加: TimingResync(<expression>)
+    if (starts_with_cmd(line, "TimingResync"))
+    {
+        std::string arg;
+        if (!paren_args(line, arg))
+            return in;
+        in.op = Op::TIMING_RESYNC;
+        in.exprs.push_back(trim(arg));
+        return in;
+    }
+    if (starts_with_cmd(line, "RandEngine"))
+    {
+        std::string arg;
+        if (!paren_args(line, arg))
+            return in;
+        arg = trim(arg);
+        if (strcasecmp(arg.c_str(), "XOSHIRO128") == 0)
+            in.ival = static_cast<int>(RandEngineKind::XOSHIRO128);
+        else if (strcasecmp(arg.c_str(), "MT19937") == 0)
+            in.ival = static_cast<int>(RandEngineKind::MT19937);
+        else
+            return in;
+        in.op = Op::RAND_ENGINE;
+        return in;
+    }
+
+    // SetLED
+    if (starts_with_cmd(line, "SetLED"))
+    {
+        std::string args;
+        if (!paren_args(line, args))
+            return in;
+        in.op = Op::SET_LED;
+        auto parts = split_top_level_args(args);
+        if (parts.size() >= 3)
+            in.exprs.assign(parts.begin(), parts.begin() + 3);
+        return in;
+    }
+
+    // KeyPress(key) / KeyRelease(key) / KeyPushFor(key, expr) / KeyType("str", press, release)
+    if (starts_with_cmd(line, "KeyPress") || starts_with_cmd(line, "KeyRelease") ||
+        starts_with_cmd(line, "KeyPushFor") || starts_with_cmd(line, "KeyType"))
+    {
+        // 引数が不正でも USB 状態のデバッグ出力だけは行う (従来挙動)
+        if (starts_with_cmd(line, "KeyPress"))
+            in.op = Op::KEY_PRESS;
+        else if (starts_with_cmd(line, "KeyRelease"))
+            in.op = Op::KEY_RELEASE;
+        else if (starts_with_cmd(line, "KeyPushFor"))
+            in.op = Op::KEY_PUSH_FOR;
+        else
+            in.op = Op::KEY_TYPE;
+
+        std::string args;
+        if (!paren_args(line, args))
+            return in;
+
+        if (in.op == Op::KEY_PRESS || in.op == Op::KEY_RELEASE)
+        {
+            // text には押下／解放するキーコード列を格納する
+            std::string keytok = trim(args);
+            if (!keytok.empty() && keytok.front() == '\"' && keytok.back() == '\"')
+            {
+                in.text = keytok.substr(1, keytok.size() - 2);
+            }
+            else
+            {
+                int code = resolve_key_code(keytok);
+                if (code != 0)
+                    in.text.assign(1, static_cast<char>(code));
+            }
+        }
+        else if (in.op == Op::KEY_PUSH_FOR)
+        {
+            auto parts = split_top_level_args(args);
+            if (parts.size() >= 2)
+            {
+                std::string keytok = trim(parts[0]);
+                int code = 0;
+                if (!keytok.empty() && keytok.front() == '\"' && keytok.back() == '\"')
+                {
+                    std::string s = keytok.substr(1, keytok.size() - 2);
+                    if (!s.empty())
+                        code = (int)s[0];
+                }
+                else
+                {
+                    code = resolve_key_code(keytok);
+                }
+                in.ival = code;
+                in.exprs.push_back(trim(parts[1]));
+            }
+        }
+        else
+        {
+            // KeyType("string", press_duration_expr, release_duration_expr)
+            // 第1引数は必ず引用符付き文字列。第2/第3引数は式。
+            auto parts = split_top_level_args(args);
+            if (parts.size() < 3)
+                return in;
+            std::string raw_first = trim(parts[0]);
+            if (raw_first.size() < 2 || raw_first.front() != '\"' || raw_first.back() != '\"')
+                return in;
+            in.text = unescape_string(raw_first.substr(1, raw_first.size() - 2));
+            in.exprs.push_back(parts[1]);
+            in.exprs.push_back(parts[2]);
+        }
+        return in;
+    }
+
+    // MouseMove(x_expr, y_expr, rel_expr)
+    if (starts_with_cmd(line, "MouseMove"))
+    {
+        std::string args;
+        if (!paren_args(line, args))
+            return in;
+        auto parts = split_top_level_args(args);
+        in.op = Op::MOUSE_MOVE;
+        if (parts.size() >= 3)
+            in.exprs.assign(parts.begin(), parts.begin() + 3);
+        return in;
+    }
+
+    if (starts_with_cmd(line, "MousePress") || starts_with_cmd(line, "MouseRelease"))
+    {
+        std::string arg;
+        if (!paren_args(line, arg))
+            return in;
+        in.op = starts_with_cmd(line, "MousePress") ? Op::MOUSE_PRESS : Op::MOUSE_RELEASE;
+        in.ival = mouse_button_from_name(trim(arg));
+        return in;
+    }
+
+    // MousePushFor(button, expr)
+    if (starts_with_cmd(line, "MousePushFor"))
+    {
+        std::string args;
+        if (!paren_args(line, args))
+            return in;
+        auto parts = split_top_level_args(args);
+        if (parts.size() < 2)
+            return in;
+        in.op = Op::MOUSE_PUSH_FOR;
+        in.ival = mouse_button_from_name(trim(parts[0]));
+        in.exprs.push_back(trim(parts[1]));
+        return in;
+    }
+
+    // Mouserun(filename_string, time_scale_expr, angle_expr, scale_expr)
+    if (starts_with_cmd(line, "Mouserun"))
+    {
+        std::string args;
+        if (!paren_args(line, args))
+            return in;
+        // parse first arg as quoted filename
+        size_t idx = 0;
+        while (idx < args.size() && isspace((unsigned char)args[idx]))
+            ++idx;
+        if (idx < args.size() && args[idx] == '\"')
+        {
+            ++idx;
+            size_t j = idx;
+            while (j < args.size() && args[j] != '\"')
+                ++j;
+            in.text = args.substr(idx, j - idx);
+            idx = j + 1;
+            // skip any whitespace and a following comma so split_top_level_args
+            // does not see an initial empty token (was causing empty first part)
+            while (idx < args.size() && (isspace((unsigned char)args[idx]) || args[idx] == ','))
+                ++idx;
+        }
+        // remaining splits by commas (top-level aware)
+        auto parts = split_top_level_args(args, idx, args.size());
+        in.op = Op::MOUSERUN;
+        if (parts.size() >= 3)
+            in.exprs.assign(parts.begin(), parts.begin() + 3);
+        return in;
+    }
+
+    // ■ 追加: LoadTable("file", <name>[, <count_var>])  (配列名はプリパスで登録済み)
+    if (starts_with_cmd(line, "LoadTable"))
+    {
+        std::string file, name, count_var;
+        if (!parse_load_table(line, file, name, count_var) || !st.array_ids.count(name))
+            return in;
+        in.op = Op::LOAD_TABLE;
+        in.text = file;
+        in.ival = st.array_ids[name];
+        in.aux = count_var.empty() ? -1 : var_slot_for(st, count_var);
+        return in;
+    }
+
+    // ProController functions
+    if (starts_with_cmd(line, "ProConPress") || starts_with_cmd(line, "ProConRelease"))
+    {
+        bool press = starts_with_cmd(line, "ProConPress");
+        std::string arg;
+        if (!paren_args(line, arg, press))
+            return in;
+        in.op = press ? Op::PROCON_PRESS : Op::PROCON_RELEASE;
+        in.ival = static_cast<int>(procon_button_from_name(trim(arg)));
+        return in;
+    }
+
+    if (starts_with_cmd(line, "ProConPushFor"))
+    {
+        std::string args;
+        if (!paren_args(line, args))
+            return in;
+        auto parts = split_top_level_args(args);
+        if (parts.size() < 2)
+            return in;
+        in.op = Op::PROCON_PUSH_FOR;
+        in.ival = static_cast<int>(procon_button_from_name(trim(parts[0])));
+        in.exprs.push_back(trim(parts[1]));
+        return in;
+    }
+
+    if (starts_with_cmd(line, "ProConHat"))
+    {
+        std::string arg;
+        if (!paren_args(line, arg))
+            return in;
+        in.op = Op::PROCON_HAT;
+        in.ival = static_cast<int>(procon_hat_from_name(trim(arg)));
+        return in;
+    }
+
+    if (starts_with_cmd(line, "ProConJoy"))
+    {
+        std::string args;
+        if (!paren_args(line, args))
+            return in;
+        auto parts = split_top_level_args(args);
+        in.op = Op::PROCON_JOY;
+        if (parts.size() >= 4)
+            in.exprs.assign(parts.begin(), parts.begin() + 4);
+        return in;
+    }
+
+    // 未知のコマンドは無視する
+    return in;
+}
+
+// 全行をコンパイルする (prepass_script の後に呼ぶ)
+// ■ 追加: 式オプティマイザ (通常モードのみ)
+// 式を「括弧の中身」「関数呼び出し」「関数の各引数」「式全体」という単位に分けて調べる。
+// 括弧と関数呼び出しの境界は演算子の優先順位に依存しないため、tinyexpr と解釈がずれない。
+//   - 変数を含まない純粋な単位は、コンパイル時に tinyexpr で計算して数値に畳み込む
+//   - 変数を含む純粋な単位のうち、複数箇所に現れるもの、またはループ内で変数が書き換えられないものは
+//     メモ (__M_k) に置き換え、依存する変数が書き換えられるまで値を再利用する
+// Rand / GetTime / IsPressed など呼ぶたびに結果が変わる関数を含む単位は対象外。
+
+// 純粋でない (呼ぶたびに結果や状態が変わる) 組み込み関数
+// ■ 変更: 配列参照も、要素が SET / LoadTable で変わるため対象外とする
+static bool is_impure_function(const ScriptState &st, const std::string &name)
+{
+    if (st.array_ids.count(name))
+        return true;
+    static const char *const kImpure[] = {"IsPressed", "Rand", "RandInt", "RandNormal", "GetTime", "GetTimeUs"};
+    for (const char *f : kImpure)
+    {
+        if (strcasecmp(name.c_str(), f) == 0)
+            return true;
+    }
+    return false;
+}
+
+struct OptUnitInfo
+{
+    bool pure = true;     // 純粋でない関数を含まない
+    bool known = true;    // 未知の識別子 (一度も SET されない変数など) を含まない
+    bool trivial = true;  // 演算子も関数呼び出しも含まない (単一の変数／数値)
+    std::vector<int> vars; // 参照する変数スロット
+
+    void merge(const OptUnitInfo &o)
+    {
+        pure = pure && o.pure;
+        known = known && o.known;
+        trivial = trivial && o.trivial;
+        vars.insert(vars.end(), o.vars.begin(), o.vars.end());
+    }
+};
+
+struct OptCandidate
+{
+    std::map<int, uint32_t> count; // 領域 (最も内側のループ番号, ループ外は -1) ごとの出現回数
+    bool invariant = false; // いずれかのループ内でループ不変
+    int memo = -1;          // 割り当てたメモ番号
+};
+
+struct OptLoop
+{
+    int begin = 0;
+    int end = 0;
+    bool has_call = false;   // GOSUB を含む (書き換えられる変数が分からない)
+    std::set<int> written;   // ループ内で書き換えられる変数スロット
+};
+
+struct OptPass
+{
+    ScriptState &st;
+    bool rewrite = false; // false: 集計パス / true: 書き換えパス
+    int line = 0;
+    std::map<std::string, OptCandidate> cands;
+    std::vector<OptLoop> loops;
+    uint32_t folded = 0;   // 書き換え中の式で畳み込んだ単位の数
+    te_parser folder;      // 畳み込み用
+
+    explicit OptPass(ScriptState &s) : st(s) {}
+};
+
+// 空白を除いた比較用テキスト
+static std::string opt_canonical(const std::string &text)
+{
+    std::string out;
+    out.reserve(text.size());
+    for (char c : text)
+    {
+        if (!isspace((unsigned char)c))
+            out.push_back(c);
+    }
+    return out;
+}
+
+static size_t opt_match_paren(const std::string &s, size_t open)
+{
+    int depth = 0;
+    for (size_t i = open; i < s.size(); ++i)
+    {
+        if (s[i] == '(')
+            ++depth;
+        else if (s[i] == ')' && --depth == 0)
+            return i;
+    }
+    return std::string::npos;
+}
+
+// 式中で直接参照しているメモ番号を集める
+static std::vector<int> opt_memo_refs(const std::string &text)
+{
+    std::vector<int> refs;
+    for (size_t p = text.find("__M_"); p != std::string::npos; p = text.find("__M_", p + 4))
+    {
+        if (p > 0 && (isalnum((unsigned char)text[p - 1]) || text[p - 1] == '_'))
+            continue;
+        int id = atoi(text.c_str() + p + 4);
+        if (std::find(refs.begin(), refs.end(), id) == refs.end())
+            refs.push_back(id);
+    }
+    return refs;
+}
+
+static bool opt_is_invariant(const OptPass &op, const OptUnitInfo &info)
+{
+    for (const OptLoop &lp : op.loops)
+    {
+        if (op.line < lp.begin || op.line > lp.end || lp.has_call)
+            continue;
+        bool inv = true;
+        for (int v : info.vars)
+        {
+            if (lp.written.count(v))
+            {
+                inv = false;
+                break;
+            }
+        }
+        if (inv)
+            return true;
+    }
+    return false;
+}
+
+// 現在の行を含む最も内側のループ番号 (ループ外は -1)
+static int opt_region(const OptPass &op)
+{
+    int best = -1;
+    for (size_t k = 0; k < op.loops.size(); ++k)
+    {
+        const OptLoop &lp = op.loops[k];
+        if (op.line < lp.begin || op.line > lp.end)
+            continue;
+        if (best < 0 || lp.end - lp.begin < op.loops[best].end - op.loops[best].begin)
+            best = static_cast<int>(k);
+    }
+    return best;
+}
+
+// 1 単位の置換を決める。集計パスでは候補を数え、書き換えパスでは置換後のテキストを返す。
+static std::string opt_emit(OptPass &op, const std::string &canon, const OptUnitInfo &info, const std::string &rewritten)
+{
+    if (info.trivial || !info.pure || !info.known)
+        return rewritten;
+
+    if (info.vars.empty())
+    {
+        // 定数の畳み込み (結果が有限のときだけ)
+        if (!op.rewrite)
+            return rewritten;
+        op.folder.set_variables_and_functions(op.st.te_vars);
+        if (!op.folder.compile(rewritten))
+            return rewritten;
+        double v = static_cast<double>(op.folder.evaluate());
+        if (std::isnan(v) || std::isinf(v))
+            return rewritten;
+        char buf[40];
+        snprintf(buf, sizeof(buf), "(%.17g)", v);
+        ++op.folded;
+        return buf;
+    }
+
+    OptCandidate &c = op.cands[canon];
+    if (!op.rewrite)
+    {
+        ++c.count[opt_region(op)];
+        if (!c.invariant)
+            c.invariant = opt_is_invariant(op, info);
+        return rewritten;
+    }
+    // 同じ領域で 2 回以上現れるか、ループ不変ならメモにする
+    // (ループの外と中に 1 回ずつ現れるだけの式は、毎回計算し直しになるので対象外)
+    bool shared = false;
+    for (const auto &kv : c.count)
+        shared = shared || kv.second >= 2;
+    if (!shared && !c.invariant)
+        return rewritten;
+
+    if (c.memo < 0)
+    {
+        c.memo = static_cast<int>(op.st.memos.size());
+        std::string name = "__M_" + std::to_string(c.memo);
+        int slot = var_slot_for(op.st, name);
+        op.st.memos.emplace_back(rewritten, slot);
+        op.st.memos.back().expr.memos = opt_memo_refs(rewritten);
+        if (op.st.slot_memos.size() < op.st.var_names.size())
+            op.st.slot_memos.resize(op.st.var_names.size());
+        for (int v : info.vars)
+        {
+            std::vector<int> &deps = op.st.slot_memos[v];
+            if (std::find(deps.begin(), deps.end(), c.memo) == deps.end())
+                deps.push_back(c.memo);
+        }
+    }
+    return "__M_" + std::to_string(c.memo);
+}
+
+// text を解析し、書き換え後のテキストを out に書く (text 自身の置換は呼び出し側が opt_emit で行う)
+static OptUnitInfo opt_unit(OptPass &op, const std::string &text, std::string &out)
+{
+    OptUnitInfo info;
+    size_t i = 0;
+    const size_t n = text.size();
+    while (i < n)
+    {
+        char c = text[i];
+        if (isalpha((unsigned char)c) || c == '_')
+        {
+            size_t j = i + 1;
+            while (j < n && (isalnum((unsigned char)text[j]) || text[j] == '_'))
+                ++j;
+            std::string name = text.substr(i, j - i);
+            size_t k = j;
+            while (k < n && isspace((unsigned char)text[k]))
+                ++k;
+            if (k < n && text[k] == '(')
+            {
+                // 関数呼び出し: 各引数も 1 単位として扱う
+                size_t close = opt_match_paren(text, k);
+                if (close == std::string::npos)
+                {
+                    info.known = false;
+                    out.append(text, i, std::string::npos);
+                    return info;
+                }
+                OptUnitInfo call;
+                call.trivial = false;
+                call.pure = !is_impure_function(op.st, name);
+                std::string call_out = name + "(";
+                std::vector<std::string> args = split_top_level_args(text, k + 1, close);
+                for (size_t a = 0; a < args.size(); ++a)
+                {
+                    std::string arg_out;
+                    OptUnitInfo ai = opt_unit(op, args[a], arg_out);
+                    if (a)
+                        call_out += ", ";
+                    call_out += opt_emit(op, opt_canonical(args[a]), ai, arg_out);
+                    call.merge(ai);
+                }
+                call_out += ")";
+                call.trivial = false;
+                out += opt_emit(op, opt_canonical(text.substr(i, close + 1 - i)), call, call_out);
+                info.merge(call);
+                i = close + 1;
+                continue;
+            }
+            // 変数または定数
+            auto it = op.st.var_slots.find(name);
+            if (it != op.st.var_slots.end())
+                info.vars.push_back(it->second);
+            else if (strcasecmp(name.c_str(), "pi") != 0 && strcasecmp(name.c_str(), "e") != 0)
+                info.known = false;
+            out += name;
+            i = j;
+            continue;
+        }
+        if (c == '(')
+        {
+            size_t close = opt_match_paren(text, i);
+            if (close == std::string::npos)
+            {
+                info.known = false;
+                out.append(text, i, std::string::npos);
+                return info;
+            }
+            std::string inner = text.substr(i + 1, close - i - 1);
+            std::string inner_out;
+            OptUnitInfo g = opt_unit(op, inner, inner_out);
+            out += opt_emit(op, opt_canonical(inner), g, "(" + inner_out + ")");
+            info.merge(g);
+            i = close + 1;
+            continue;
+        }
+        if (strchr("+-*/%^<>=!&|,", c))
+            info.trivial = false;
+        out.push_back(c);
+        ++i;
+    }
+    return info;
+}
+
+// 式全体が 1 つの括弧または関数呼び出しか (その場合は内側で単位として扱い済み)
+static bool opt_is_single_unit(const std::string &canon)
+{
+    size_t open = 0;
+    while (open < canon.size() && (isalnum((unsigned char)canon[open]) || canon[open] == '_'))
+        ++open;
+    if (open >= canon.size() || canon[open] != '(')
+        return false;
+    return opt_match_paren(canon, open) == canon.size() - 1;
+}
+
+// 1 つの式を解析 (集計パス) または書き換える
+static void opt_expr(OptPass &op, ScriptExpr &expr)
+{
+    if (expr.is_const)
+        return;
+    std::string out;
+    op.folded = 0;
+    OptUnitInfo info = opt_unit(op, expr.text, out);
+    const std::string canon = opt_canonical(expr.text);
+    std::string whole = opt_is_single_unit(canon) ? out : opt_emit(op, canon, info, out);
+    if (!op.rewrite)
+        return;
+
+    expr.folded = static_cast<uint16_t>(op.folded);
+    if (whole.size() > 4 && whole.compare(0, 4, "__M_") == 0 && whole.find_first_not_of("0123456789", 4) == std::string::npos)
+    {
+        expr.direct_memo = atoi(whole.c_str() + 4);
+        return;
+    }
+    if (op.folded && info.vars.empty() && info.known && info.pure)
+    {
+        // 式全体が定数になった
+        char *endp = nullptr;
+        std::string lit = whole.substr(whole.front() == '(' ? 1 : 0);
+        double v = strtod(lit.c_str(), &endp);
+        if (endp && (*endp == ')' || *endp == '\0'))
+        {
+            expr.is_const = true;
+            expr.const_val = v;
+            expr.text = whole;
+            return;
+        }
+    }
+    expr.text = whole;
+    expr.memos = opt_memo_refs(whole);
+    // 同じメモを式中で複数回使う分も省略した評価として数える
+    size_t uses = 0;
+    for (size_t p = whole.find("__M_"); p != std::string::npos; p = whole.find("__M_", p + 4))
+        ++uses;
+    expr.memo_dups = static_cast<uint16_t>(uses - expr.memos.size());
+}
+
+// その命令が書き換える変数スロット (無ければ -1)
+static int instr_written_slot(const Instr &in)
+{
+    switch (in.op)
+    {
+    case Op::SET:
+    case Op::SETI:
+    case Op::FOR:
+    case Op::NEXT:
+        return in.ival;
+    case Op::LOAD_TABLE:
+    case Op::WAIT_UNTIL:
+        return in.aux;
+    default:
+        return -1;
+    }
+}
+
+static void optimize_program(ScriptState &st)
+{
+    OptPass op(st);
+    st.te_vars = build_te_variables_and_funcs(st); // 畳み込み用 (この時点では関数のみ)
+    st.te_vars_epoch = 0;
+
+    // 後方ジャンプからループ範囲を求める
+    for (int j = 0; j < (int)st.program.size(); ++j)
+    {
+        const Instr &in = st.program[j];
+        bool back = (in.op == Op::GOTO || in.op == Op::IF_GOTO || in.op == Op::NEXT) && in.target >= 0 && in.target <= j;
+        if (!back)
+            continue;
+        OptLoop lp;
+        lp.begin = in.target;
+        lp.end = j;
+        for (int k = lp.begin; k <= lp.end; ++k)
+        {
+            const Instr &b = st.program[k];
+            if (b.op == Op::GOSUB)
+                lp.has_call = true;
+            int w = instr_written_slot(b);
+            if (w >= 0)
+                lp.written.insert(w);
+        }
+        op.loops.push_back(std::move(lp));
+    }
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        op.rewrite = (pass == 1);
+        for (int j = 0; j < (int)st.program.size(); ++j)
+        {
+            op.line = j;
+            if (st.program[j].op == Op::SETI)
+                continue; // 整数で評価するため、double で計算したメモや畳み込みは使えない
+            for (ScriptExpr &e : st.program[j].exprs)
+                opt_expr(op, e);
+        }
+    }
+
+    uint32_t folded = 0;
+    for (const Instr &in : st.program)
+        for (const ScriptExpr &e : in.exprs)
+            folded += e.folded;
+    printf("optimize_program: %zu loops, %lu folded subexpressions, %zu memo slots\r\n",
+           op.loops.size(), (unsigned long)folded, st.memos.size());
+    for (size_t m = 0; m < st.memos.size(); ++m)
+        printf("optimize_program: __M_%u = %s\r\n", (unsigned)m, st.memos[m].expr.text.c_str());
+    tud_task();
+}
+
+static void compile_script(ScriptState &st)
+{
+    // ページ実行モードではページ読み込み時にコンパイルする
+    if (st.paged)
+        return;
+    st.program.clear();
+    st.program.reserve(st.lines.size());
+    for (size_t i = 0; i < st.lines.size(); ++i)
+        st.program.push_back(compile_line(st, st.lines[i], static_cast<int>(i)));
+    st.var_defined.assign(st.var_names.size(), 0);
+
+    // ■ 追加: 式の最適化 (メモ用の隠し変数スロットが増える)
+    optimize_program(st);
+
+    // 変数スロットの確保 (以後サイズは変えない)
+    st.var_values.assign(st.var_names.size(), 0.0);
+    st.var_defined.assign(st.var_names.size(), 0);
+    st.slot_memos.resize(st.var_names.size());
+    for (const MemoSlot &m : st.memos)
+        st.var_defined[m.slot] = 1; // メモは常に定義済み (tinyexpr に束縛させる)
+    ++st.var_epoch;
+    printf("compile_script: %zu instructions, %zu variable slots\r\n", st.program.size(), st.var_names.size());
+    tud_task();
+}
+
+// ■ 追加: バッファ内の '\r' をその場で詰め、改行を '\0' に置き換えて各行のビューを out に追加する。
+// buf は len + 1 バイト以上確保されていること (最終行の終端用)。書き込み位置は常に読み込み位置以下。
+static void split_lines_in_place(char *buf, size_t len, std::vector<std::string_view> &out)
+{
+    size_t w = 0;
+    size_t line_start = 0;
+    for (size_t r = 0; r < len; ++r)
+    {
+        char c = buf[r];
+        if (c == '\r')
+            continue;
+        if (c == '\n')
+        {
+            buf[w] = '\0';
+            out.emplace_back(buf + line_start, w - line_start);
+            line_start = ++w;
+        }
+        else
+        {
+            buf[w++] = c;
+        }
+    }
+    if (w > line_start)
+    {
+        buf[w] = '\0';
+        out.emplace_back(buf + line_start, w - line_start);
+    }
+}
+
+// ■ 追加: ページを取得する (キャッシュに無ければ littlefs から読み込んでコンパイルし、最も古いページと入れ替える)
+static ScriptPage *fetch_page(ScriptState &st, int page_no)
+{
+    PagedScript &pg = st.pager;
+    ++pg.use_clock;
+    if (pg.current && pg.current->page_no == page_no)
+    {
+        pg.current->last_use = pg.use_clock;
+        ++pg.hits;
+        return pg.current;
+    }
+    ScriptPage *victim = &pg.pages[0];
+    for (ScriptPage &p : pg.pages)
+    {
+        if (p.page_no == page_no)
+        {
+            p.last_use = pg.use_clock;
+            ++pg.hits;
+            pg.current = &p;
+            return &p;
+        }
+        if (p.last_use < victim->last_use)
+            victim = &p;
+    }
+
+    ++pg.misses;
+    uint64_t t0 = time_us_64();
+    const uint32_t begin = pg.page_offsets[page_no];
+    const uint32_t len = pg.page_offsets[page_no + 1] - begin;
+    victim->page_no = -1;
+    victim->program.clear();
+    victim->lines.clear();
+    char *buf = victim->text.get(); // len < page_buf_size (alloc_page_buffers で確保済み)
+
+    uint32_t total = 0;
+    if (lfs_file_seek(&g_lfs, &pg.fp, (lfs_soff_t)begin, LFS_SEEK_SET) >= 0)
+    {
+        while (total < len)
+        {
+            int br = (int)lfs_file_read(&g_lfs, &pg.fp, buf + total, len - total);
+            if (br <= 0)
+                break;
+            total += (uint32_t)br;
+        }
+    }
+    if (total < len)
+    {
+        pg.current = nullptr;
+        SignalRuntimeError("Script page read failed", page_no * SCRIPT_PAGE_LINES + 1, "Paged script", "");
+        st.end_flag = true;
+        return nullptr;
+    }
+
+    split_lines_in_place(buf, len, victim->lines);
+    // '\r' だけの行などで行数が足りない場合は空行で埋める
+    size_t expected = st.line_count - (size_t)page_no * SCRIPT_PAGE_LINES;
+    if (expected > (size_t)SCRIPT_PAGE_LINES)
+        expected = SCRIPT_PAGE_LINES;
+    while (victim->lines.size() < expected)
+        victim->lines.emplace_back("");
+
+    for (size_t k = 0; k < victim->lines.size(); ++k)
+        victim->program.push_back(compile_line(st, victim->lines[k], page_no * SCRIPT_PAGE_LINES + static_cast<int>(k)));
+
+    // 新しいページで変数が増えたら格納領域を広げる。
+    // 再確保で要素のアドレスが変わるため、世代を進めてキャッシュ済みの式を束縛し直させる。
+    if (st.var_values.size() < st.var_names.size())
+    {
+        st.var_values.resize(st.var_names.size(), 0.0);
+        st.var_defined.resize(st.var_names.size(), 0);
+        memory_guard_charge(st.var_values.capacity() * (sizeof(double) + 1));
+        ++st.var_epoch;
+    }
+
+    victim->page_no = page_no;
+    victim->last_use = pg.use_clock;
+    pg.current = victim;
+    pg.stall_us += time_us_64() - t0;
+    return victim;
+}
+
+// ■ 追加: 行インデックスの命令を取得する (ページ実行モードでは必要に応じてページを読み込む)
+static Instr *fetch_instr(ScriptState &st, int idx)
+{
+    if (!st.paged)
+        return &st.program[idx];
+    ScriptPage *p = fetch_page(st, idx / SCRIPT_PAGE_LINES);
+    return p ? &p->program[idx % SCRIPT_PAGE_LINES] : nullptr;
+}
+
+// 0..255 / -128..127 へのクランプ
+static inline int clamp_int(int v, int lo, int hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// ■ 追加: WAITUNTIL の条件を評価する間隔の下限 (us)
+static const double WAITUNTIL_MIN_POLL_US = 100.0;
+
+// 秒単位の式の値をミリ秒に変換する (KeyPushFor などの従来の丸め)
+static inline uint32_t seconds_to_ms(double sec)
+{
+    return static_cast<uint32_t>(round(sec * 1000.0));
+}
+
+// ■ 追加: 空いているタスク (メインタスク以外) を target から開始する。空きが無ければ nullptr
+static ScriptTask *start_task(ScriptState &st, int target)
+{
+    ScriptTask *nt = nullptr;
+    for (size_t k = 1; k < st.tasks.size(); ++k)
+    {
+        if (!st.tasks[k].alive)
+        {
+            nt = &st.tasks[k]; // 番号の小さい空きから使う (run_tasks の実行順と同じ)
+            break;
+        }
+    }
+    if (!nt && st.tasks.size() < (size_t)MAX_TASKS)
+    {
+        st.tasks.emplace_back(); // 容量は予約済みなので実行中のタスクへの参照は無効にならない
+        nt = &st.tasks.back();
+        nt->stack_limit = TASK_STACK_DEPTH;
+        nt->gosub_stack.reserve(TASK_STACK_DEPTH);
+        memory_guard_charge(TASK_STACK_DEPTH * sizeof(int));
+    }
+    if (!nt)
+        return nullptr;
+    nt->pc = target;
+    nt->alive = true;
+    nt->joining = false;
+    nt->wake_us = 0;
+    nt->anchor_us = time_us_64();
+    nt->phase = 0;
+    nt->event = -1;
+    nt->gosub_stack.clear();
+    return nt;
+}
+
+// ■ 追加: 登録中の EVERY のうち最も早い期限を求め直す
+static void update_every_next(ScriptState &st)
+{
+    st.every_next_us = UINT64_MAX;
+    for (int ev = EVENT_EVERY; ev < EVENT_COUNT; ++ev)
+    {
+        if ((st.events_armed & (1u << ev)) && st.events[ev].due_us < st.every_next_us)
+            st.every_next_us = st.events[ev].due_us;
+    }
+}
+
+// ■ 追加: イベントハンドラを登録する (target < 0 で解除)。period_us は EVERY の周期
+static void set_event_handler(ScriptState &st, int ev, int target, uint64_t period_us)
+{
+    EventHandler &h = st.events[ev];
+    const uint32_t bit = 1u << ev;
+    if (target < 0)
+    {
+        st.events_armed &= ~bit;
+        st.events_due &= ~bit;
+    }
+    else
+    {
+        // 同じ登録を繰り返し実行しても (ループ内など) 周期の起点は動かさない
+        if (!(st.events_armed & bit) || h.period_us != period_us)
+            h.due_us = time_us_64() + period_us;
+        st.events_armed |= bit;
+    }
+    h.target = target;
+    h.period_us = period_us;
+    if (ev >= EVENT_EVERY)
+    {
+        update_every_next(st);
+        return;
+    }
 
-            Mouse.move((signed char)ix, (signed char)iy, (signed char)rel);
-            tud_task();
+    // ボタンの監視を始めるときは現在の状態を基準にする (登録時に押していても PRESS は起こさない)
+    const uint32_t watch = st.events_armed & ((1u << EVENT_PRESS) | (1u << EVENT_RELEASE));
+    const bool button = (watch && !g_event_watch) ? bb_get_bootsel_button() : g_event_last_button;
+    uint32_t ints = save_and_disable_interrupts();
+    g_event_last_button = button;
+    g_event_watch = watch;
+    g_event_pending &= watch;
+    restore_interrupts(ints);
+    if (watch && !g_event_timer_on)
+        g_event_timer_on = add_repeating_timer_us(-EVENT_SAMPLE_US, event_timer_cb, nullptr, &g_event_timer);
+}
 
-            uint32_t wait_ms = static_cast<uint32_t>(round(time_ms * time_scale));
-            if (wait_ms)
-            {
-                uint32_t remaining = wait_ms;
-                while (remaining)
-                {
-                    uint32_t step = remaining > 20 ? 20 : remaining;
-                    sleep_ms(step);
-                    tud_task();
-                    remaining -= step;
-                }
-            }
-        }
-    }
-    lfs_file_close(&g_lfs, &fp);
-    lfs_unmount(&g_lfs);
+// ■ 追加: スクリプト終了時にタイマーを止め、イベントの状態を消す
+static void stop_events()
+{
+    if (g_event_timer_on)
+        cancel_repeating_timer(&g_event_timer);
+    g_event_timer_on = false;
+    g_event_watch = 0;
+    g_event_pending = 0;
 }
 
-// 現在の行インデックスで単一コマンドを実行する。返り値は次に実行する行インデックス。
+// 現在の行インデックスの命令を実行する。返り値は次に実行する行インデックス。
 static int execute_line(ScriptState &st, int current_index)
 {
     // メモリ不足チェック (C++スタック自体の消費を監視)
-    if (get_free_memory() < MIN_FREE_MEMORY_BYTES)
+    if (!memory_guard_ok())
     {
-        const char *line_str = (current_index >= 0 && current_index < (int)st.lines.size())
-                                   ? st.lines[current_index].c_str()
-                                   : "Unknown";
+        const char *line_str = line_cstr(st, current_index, "Unknown");
         SignalRuntimeError("Memory Low (<3KB) - Halting safely", current_index + 1, line_str, "N/A");
         st.end_flag = true;
         return current_index;
     }
 
-    if (current_index < 0 || current_index >= (int)st.lines.size())
+    if (current_index < 0 || current_index >= (int)st.line_count)
         return current_index + 1;
 
+    Instr *inp = fetch_instr(st, current_index);
+    if (!inp)
+        return current_index;
+
     // 現在の行番号を更新
     st.current_line_index = current_index;
+    ++st.executed_count;
 
-    std::string raw = st.lines[current_index];
-    std::string line = trim(raw);
-    if (line.empty())
-        return current_index + 1;
+    Instr &in = *inp;
+    ScriptTask &task = st.tasks[st.cur_task];
 
+    // ■ 変更: 実行した行はログではなくトレースに記録する (待機からの再開は記録しない)
     if (st.debug_exec)
     {
-        printf("EXECUTE[%d]: %s\r\n", current_index, line.c_str());
-        tud_task();
+        st.trace.cur = nullptr;
+        if (task.phase == 0)
+            trace_append(st, current_index, in);
     }
 
-    // コメント
-    if (line[0] == '#' || starts_with_cmd(line, "REM"))
-        return current_index + 1;
+    const int next = current_index + 1;
+    switch (in.op)
+    {
+    case Op::NOP:
+        return next;
 
-    // LABEL: 実行時は無視する
-    if (starts_with_cmd(line, "LABEL"))
+    case Op::END:
+        // ■ 変更: SPAWN したタスクの END はそのタスクだけを終える (イベントハンドラ内の END はスクリプトを終える)
+        if (st.cur_task == 0 || task.event >= 0)
+            st.end_flag = true;
+        else
+            task.alive = false;
+        return current_index;
+
+    case Op::WAIT:
     {
-        return current_index + 1;
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        if (!ok)
+            val = 0.0;
+        task_sleep_us(st, seconds_to_us(val));
+        return next;
     }
 
-    // END
-    if (starts_with_cmd(line, "END"))
+    case Op::WAIT_US:
     {
-        st.end_flag = true;
-        return current_index;
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        task_sleep_us(st, (ok && val > 0.0) ? static_cast<uint64_t>(llround(val)) : 0);
+        return next;
     }
 
-    // WAIT <expression>
-    if (starts_with_cmd(line, "WAIT"))
+    // ■ 追加: スクリプト開始から <expression> 秒の時刻まで待つ (過ぎていれば待たない)。
+    // 以後の待機はこの時刻から測るので、AT と WAIT を組み合わせた時間軸もずれない。
+    case Op::AT:
     {
-        std::string expr = trim(line.substr(4));
-        auto [ok, val] = eval_expression(st, expr);
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
         if (!ok)
-            val = 0.0;
-        uint32_t ms = static_cast<uint32_t>(round(val * 1000.0));
-        uint32_t remaining = ms;
-        while (remaining)
+            return next;
+        const uint64_t deadline = g_script_start_us + seconds_to_us(val);
+        const uint64_t now = time_us_64();
+        if (deadline < now)
+            log_fmt(LOGF_AT_LATE, (long long)(now - deadline));
+        task_sleep_until_us(st, deadline);
+        return next;
+    }
+
+    // ■ 追加: 条件が真になるまで poll 秒ごとに評価して待つ (最長 timeout 秒、0 以下なら無期限)
+    // 待機中はこの命令だけを周期的に再開するので、LABEL / IF / GOTO / WAIT のループのように行を解釈し直さない。
+    // deadline_us = 期限, arg1 = 評価の間隔 (us)
+    case Op::WAIT_UNTIL:
+    {
+        const uint64_t now = time_us_64();
+        if (task.phase == 0)
         {
-            uint32_t step = remaining > 20 ? 20 : remaining;
-            sleep_ms(step);
-            tud_task();
-            remaining -= step;
+            auto [ok_t, timeout] = eval_expression(st, in.exprs[1]);
+            auto [ok_p, poll] = eval_expression(st, in.exprs[2]);
+            if (!ok_t || !ok_p)
+                return next;
+            task.deadline_us = timeout > 0.0 ? now + seconds_to_us(timeout) : 0;
+            task.arg1 = poll > 0.0 ? round(poll * 1000000.0) : 0.0;
+            if (task.arg1 < WAITUNTIL_MIN_POLL_US)
+                task.arg1 = WAITUNTIL_MIN_POLL_US;
+            task.phase = 1;
         }
-        return current_index + 1;
+        auto [ok, cond] = eval_expression(st, in.exprs[0]);
+        const uint64_t deadline = task.deadline_us;
+        const bool met = ok && cond != 0.0;
+        if (!ok || met || (deadline && now >= deadline))
+        {
+            task.phase = 0;
+            if (ok && in.aux >= 0)
+                set_var(st, in.aux, met ? 1.0 : 0.0);
+            return next;
+        }
+        uint64_t wake = now + static_cast<uint64_t>(task.arg1);
+        task_sleep_until_us(st, (deadline && wake > deadline) ? deadline : wake);
+        return current_index;
     }
 
-    // PRINT <expression>
-    if (starts_with_cmd(line, "PRINT"))
+    case Op::PRINT:
     {
-        std::string expr = trim(line.substr(5));
-        auto [ok, val] = eval_expression(st, expr);
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
         if (!ok)
         {
             printf("PRINT: <error evaluating expression>\r\n");
         }
         else
         {
-            printf("PRINT: %.10g\r\n", val);
+            log_fmt(LOGF_PRINT, val);
         }
         tud_task();
-        return current_index + 1;
+        return next;
     }
 
-    // SET <var> = <expression>
-    if (starts_with_cmd(line, "SET"))
+    case Op::SET:
     {
-        size_t eq = line.find('=');
-        if (eq == std::string::npos)
-            return current_index + 1;
-
-        std::string left = trim(line.substr(3, eq - 3));
-        std::string right = trim(line.substr(eq + 1));
-        std::string varname = token_after(left, 0);
-        auto [ok, val] = eval_expression(st, right);
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
         if (ok)
-        {
-            st.vars[varname] = val;
-        }
-        return current_index + 1;
+            set_var(st, in.ival, val);
+        return next;
     }
 
-    // IF <expr> GOTO <name>
-    if (starts_with_cmd(line, "IF"))
+    // ■ 追加: 整数の代入。整数で計算できない式 (三角関数・小数の定数を含む等) や、
+    // 小数部を持つ変数を参照した場合は double で評価してから 0 方向に切り捨てる
+    case Op::SETI:
     {
-        std::string upper = line;
-        for (auto &c : upper)
-            if (c >= 'a' && c <= 'z')
-                c = c - 'a' + 'A';
-        size_t posGoto = upper.find("GOTO");
-        if (posGoto != std::string::npos)
+        // ■ 変更: ネイティブ評価も eval_expression と同じく評価回数・プロファイルの評価時間・トレースの値に数える
+        const RpnProgram *prog = rpn_program(st, in.exprs[0]);
+        double r = NAN;
+        if (prog && prog->int_ok)
         {
-            std::string expr = trim(line.substr(2, posGoto - 2));
-            std::string label = trim(line.substr(posGoto + 4));
-            auto [ok, val] = eval_expression(st, expr);
-            if (ok && val != 0.0)
-            {
-                auto it = st.label_to_index.find(label);
-                if (it != st.label_to_index.end())
-                {
-                    return it->second;
-                }
-            }
-            return current_index + 1;
+            EvalTimer timer(st);
+            r = rpn_run<RpnInt>(st, *prog);
         }
+        if (!std::isnan(r))
+        {
+            ++st.eval_count;
+            if (st.trace.cur)
+                st.trace.cur->value = (float)r;
+        }
+        else
+        {
+            auto [ok, val] = eval_expression(st, in.exprs[0]);
+            if (!ok)
+                return next;
+            r = RpnInt::to_d(RpnInt::from_d(val));
+        }
+        set_var(st, in.ival, r);
+        return next;
     }
 
-    // GOTO <name>
-    if (starts_with_cmd(line, "GOTO"))
+    case Op::IF_GOTO:
     {
-        std::string label = token_after(line, 4);
-        auto it = st.label_to_index.find(label);
-        if (it != st.label_to_index.end())
-            return it->second;
-        return current_index + 1;
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        if (ok && val != 0.0 && in.target >= 0)
+            return in.target;
+        return next;
     }
 
-    // GOSUB <name>
-    if (starts_with_cmd(line, "GOSUB"))
+    case Op::GOTO:
+        return in.target >= 0 ? in.target : next;
+
+    // ■ 追加: 構造化制御構文
+    case Op::JUMP_IF_FALSE:
+    {
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        if (!ok)
+            return next;
+        return (val != 0.0) ? next : in.target;
+    }
+
+    case Op::FOR:
+    {
+        // 開始値・終了値・増分は FOR の実行時に一度だけ評価する
+        auto [ok0, start] = eval_expression(st, in.exprs[0]);
+        auto [ok1, limit] = eval_expression(st, in.exprs[1]);
+        auto [ok2, step] = eval_expression(st, in.exprs[2]);
+        if (!ok0 || !ok1 || !ok2)
+            return next;
+        ForLoop &lp = st.for_loops[in.aux];
+        lp.limit = limit;
+        lp.step = step;
+        set_var(st, in.ival, start);
+        if (step >= 0.0 ? start > limit : start < limit)
+            return in.target; // 一度も実行しない
+        return next;
+    }
+
+    case Op::NEXT:
     {
+        // カウンタの更新と終了判定は tinyexpr を通さず直接行う
+        const ForLoop &lp = st.for_loops[in.aux];
+        double v = round_to_mode(st.num_mode, st.var_values[in.ival] + lp.step);
+        set_var(st, in.ival, v);
+        if (lp.step >= 0.0 ? v <= lp.limit : v >= lp.limit)
+            return in.target;
+        return next;
+    }
+
+    case Op::GOSUB:
         // ■ 修正: 事前確保した容量を超える場合はエラーにする (再確保によるPANIC防止)
-        if (st.gosub_stack.size() >= MAX_STACK_DEPTH)
+        if (task.gosub_stack.size() >= task.stack_limit)
         {
-            SignalRuntimeError("Stack Overflow (Depth Limit)", current_index + 1, line.c_str(), "Recursion too deep (>4096)");
+            SignalRuntimeError("Stack Overflow (Depth Limit)", current_index + 1, trim(line_cstr(st, current_index, "")).c_str(),
+                               st.cur_task == 0 ? "Recursion too deep (>4096)" : "Recursion too deep in task (>256)");
             st.end_flag = true;
-            return current_index + 1;
+            return next;
         }
-
-        std::string label = token_after(line, 5);
-        auto it = st.label_to_index.find(label);
-        if (it != st.label_to_index.end())
+        if (in.target >= 0)
         {
-            st.gosub_stack.push_back(current_index + 1);
-            return it->second;
+            task.gosub_stack.push_back(next);
+            return in.target;
         }
-        return current_index + 1;
-    }
+        return next;
 
-    // RETURN
-    if (starts_with_cmd(line, "RETURN"))
-    {
-        if (!st.gosub_stack.empty())
+    case Op::RETURN:
+        if (!task.gosub_stack.empty())
         {
-            int ret = st.gosub_stack.back();
-            st.gosub_stack.pop_back();
+            int ret = task.gosub_stack.back();
+            task.gosub_stack.pop_back();
             return ret;
         }
-        SignalRuntimeError("RETURN without GOSUB", current_index + 1, line.c_str(), "N/A");
+        // ■ 追加: イベントハンドラの最後の RETURN はそのタスクを終える
+        if (task.event >= 0)
+        {
+            task.alive = false;
+            return current_index;
+        }
+        SignalRuntimeError("RETURN without GOSUB", current_index + 1, trim(line_cstr(st, current_index, "")).c_str(), "N/A");
         st.end_flag = true;
-        return current_index + 1;
+        return next;
+
+    case Op::LOG_CONFIG:
+    {
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        if (ok)
+            ConfigureLog((uint32_t)val, in.ival != 0, in.aux != 0);
+        return next;
     }
-    // 使用例: LogConfig(20, OVERWRITE) または LogConfig(10, STOP)
-    if (starts_with_cmd(line, "LogConfig"))
+
+    case Op::MODE:
+        tud_deinit(BOARD_TUD_RHPORT);
+        sleep_ms(100);
+        if (in.ival == USB_MODE_HID)
+        {
+            g_usb_mode = USB_MODE_HID;
+            Keyboard.begin();
+            Mouse.begin();
+        }
+        else
+        {
+            g_usb_mode = USB_MODE_HID_Switch;
+            switchcontrollerpico_init();
+        }
+        // ■ 追加: USB の再接続にかかった時間は取り戻さず、ここから時間軸を測り直す
+        task.anchor_us = time_us_64();
+        return next;
+
+    // ■ 追加: 乱数の種を固定する (同じ種なら同じ乱数列になる)
+    case Op::SEED:
     {
-        size_t p = line.find('(');
-        size_t q = line.rfind(')');
-        if (p != std::string::npos && q != std::string::npos && q > p)
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        if (!ok)
+            return next;
+        // ■ 変更: NaN / 無限大は整数に変換できないのでエラー。int64 の範囲外は端に丸める
+        if (!std::isfinite(val))
         {
-            std::string args = line.substr(p + 1, q - p - 1);
-            auto parts = split_top_level_args(args);
-            if (parts.size() >= 2)
-            {
-                auto [ok, val] = eval_expression(st, parts[0]); // サイズ(KB)
-                std::string mode = trim(parts[1]);              // モード文字列
+            const char *current_line_str = line_cstr(st, current_index, "Seed");
+            SignalRuntimeError("Seed: value must be a finite number", current_index + 1, current_line_str, "");
+            st.end_flag = true;
+            return next;
+        }
+        int64_t seed;
+        if (val >= 9223372036854775808.0)
+            seed = INT64_MAX;
+        else if (val < -9223372036854775808.0)
+            seed = INT64_MIN;
+        else
+            seed = static_cast<int64_t>(val);
+        rand_seed(static_cast<uint64_t>(seed));
+        return next;
+    }
 
-                if (ok)
-                {
-                    uint32_t kb = (uint32_t)val;
-                    bool overwrite = true; // デフォルト
+    case Op::RAND_ENGINE:
+        g_rand_kind = static_cast<RandEngineKind>(in.ival);
+        g_normal_has_spare = false;
+        return next;
 
-                    // 大文字小文字無視で判定
-                    std::string m_upper = mode;
-                    for (auto &c : m_upper)
-                        if (c >= 'a' && c <= 'z')
-                            c = c - 'a' + 'A';
+    // ■ 追加: 待機の時間軸を測り直すまでの遅れ (秒、0 以下で測り直さない)
+    case Op::TIMING_RESYNC:
+    {
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        if (ok)
+            st.resync_us = seconds_to_us(val);
+        return next;
+    }
 
-                    if (m_upper == "STOP")
-                    {
-                        overwrite = false;
-                    }
-                    else if (m_upper == "OVERWRITE")
-                    {
-                        overwrite = true;
-                    }
-                    else
-                    {
-                        // 数値(0/1)での指定も許容
-                        if (mode == "0")
-                            overwrite = false;
-                    }
+    case Op::USE_LED:
+    {
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        st.use_led = (ok && val != 0.0);
+        return next;
+    }
 
-                    ConfigureLog(kb, overwrite);
-                }
+    case Op::DEBUG:
+    {
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        st.debug_exec = (ok && val != 0.0);
+        g_script_debug = st.debug_exec;
+        if (st.debug_exec)
+            trace_enable(st);
+        else
+            st.trace.cur = nullptr;
+        printf("DEBUG: execute logs %s\r\n", st.debug_exec ? "ENABLED" : "DISABLED");
+        tud_task();
+        return next;
+    }
+
+    case Op::PROFILE:
+    {
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        if (ok)
+            profile_enable(st, val != 0.0);
+        printf("PROFILE: per-line profile %s\r\n", st.profile ? "ENABLED" : "DISABLED");
+        return next;
+    }
+
+    case Op::SET_LED:
+    {
+        tud_task();
+        if (in.exprs.size() >= 3)
+        {
+            auto r = eval_expression(st, in.exprs[0]);
+            auto g = eval_expression(st, in.exprs[1]);
+            auto b = eval_expression(st, in.exprs[2]);
+            if (r.first && g.first && b.first && st.use_led)
+            {
+                ApplyStripColor(clamp_int(static_cast<int>(round(r.second)), 0, 255),
+                                clamp_int(static_cast<int>(round(g.second)), 0, 255),
+                                clamp_int(static_cast<int>(round(b.second)), 0, 255));
+                tud_task();
             }
         }
-        return current_index + 1;
+        return next;
     }
 
-    // Mode
-    if (starts_with_cmd(line, "Mode"))
-    {
-        size_t p = line.find('(');
-        size_t q = line.rfind(')');
-        if (p != std::string::npos && q != std::string::npos && q > p)
+    case Op::KEY_PRESS:
+    case Op::KEY_RELEASE:
+    case Op::KEY_PUSH_FOR:
+    case Op::KEY_TYPE:
+        // debug: print USB/TinyUSB status before attempting HID ops
+        log_fmt(LOGF_USB_STATUS, (int)g_usb_mode, tud_mounted() ? 1 : 0, tud_hid_ready() ? 1 : 0, tud_suspended() ? 1 : 0);
+        tud_task();
+
+        if (in.op == Op::KEY_PRESS)
         {
-            std::string arg = trim(line.substr(p + 1, q - p - 1));
-            if (arg == "KeyMouse")
+            for (char c : in.text)
             {
-                tud_deinit(BOARD_TUD_RHPORT);
-                sleep_ms(100);
-                g_usb_mode = USB_MODE_HID;
-                Keyboard.begin();
-                Mouse.begin();
+                uint8_t code = (uint8_t)c;
+                Keyboard.press(code);
+                st.pressed_keys.insert(code);
+                tud_task();
             }
-            else if (arg == "ProController")
+        }
+        else if (in.op == Op::KEY_RELEASE)
+        {
+            for (char c : in.text)
             {
-                tud_deinit(BOARD_TUD_RHPORT);
-                sleep_ms(100);
-                g_usb_mode = USB_MODE_HID_Switch;
-                switchcontrollerpico_init();
+                uint8_t code = (uint8_t)c;
+                Keyboard.release(code);
+                st.pressed_keys.erase(code);
+                tud_task();
             }
         }
-        return current_index + 1;
-    }
+        else if (in.op == Op::KEY_PUSH_FOR)
+        {
+            // KeyPushFor(key, expr_seconds)
+            // ■ 変更: 押している間は待機としてスケジューラに制御を返し、再開時 (phase 1) に離す
+            if (in.exprs.empty() || in.ival == 0)
+                return next;
+            uint8_t uc = static_cast<uint8_t>(in.ival);
+            if (task.phase == 0)
+            {
+                auto [ok, val] = eval_expression(st, in.exprs[0]);
+                if (!ok)
+                    val = 0.0;
+                Keyboard.press(uc);
+                st.pressed_keys.insert(uc);
+                tud_task();
+                task.phase = 1;
+                task_hold_ms(st, seconds_to_ms(val));
+                return current_index;
+            }
+            task.phase = 0;
+            Keyboard.release(uc);
+            st.pressed_keys.erase(uc);
+            tud_task();
+        }
+        else
+        {
+            if (in.exprs.size() < 2)
+                return next;
+            // ■ 変更: 1 文字ごとの押下・解放の待機でスケジューラに制御を返す。
+            // phase = 2k+1: k 文字目を押して待機中 / phase = 2k+2: k 文字目を離して待機中
+            if (task.phase == 0)
+            {
+                // evaluate durations (allow expressions like Rand(0.01, Rand(0.02, 0.05)))
+                auto [ok1, press_d] = eval_expression(st, in.exprs[0]);
+                auto [ok2, release_d] = eval_expression(st, in.exprs[1]);
+                task.arg0 = ok1 ? press_d * 1000.0 : 50.0;
+                task.arg1 = ok2 ? release_d * 1000.0 : 50.0;
+            }
+            const size_t k = static_cast<size_t>(task.phase) / 2;
+            if (k >= in.text.size())
+            {
+                task.phase = 0;
+                return next;
+            }
+            // Emit characters using press/release so HID mapping path is used.
+            char c = in.text[k];
+            uint8_t code = static_cast<uint8_t>(c);
+            if (task.phase % 2 == 0)
+            {
+                // debug trace for diagnosis
+                log_fmt(LOGF_KEYTYPE_CHAR, (c >= 32 && c <= 126) ? c : '?', (unsigned)code);
+                maybe_tud_task(true);
+                // press-hold-release to respect durations
+                Keyboard.press(code);
+                st.pressed_keys.insert(code);
+                maybe_tud_task(true);
+                task_hold_ms(st, static_cast<uint32_t>(round(task.arg0)));
+            }
+            else
+            {
+                Keyboard.release(code);
+                st.pressed_keys.erase(code);
+                maybe_tud_task(true);
+                // wait release interval between characters
+                task_sleep_ms(st, static_cast<uint32_t>(round(task.arg1)));
+            }
+            ++task.phase;
+            return current_index;
+        }
+        return next;
 
-    // UseLED
-    if (starts_with_cmd(line, "UseLED"))
+    case Op::MOUSE_MOVE:
     {
-        size_t p = line.find('(');
-        size_t q = line.find(')');
-        if (p != std::string::npos && q != std::string::npos && q > p)
+        if (in.exprs.size() < 3)
+            return next;
+        auto [okx, vx] = eval_expression(st, in.exprs[0]);
+        auto [oky, vy] = eval_expression(st, in.exprs[1]);
+        auto [okr, vr] = eval_expression(st, in.exprs[2]);
+        if (okx && oky && okr)
         {
-            std::string arg = trim(line.substr(p + 1, q - p - 1));
-            auto [ok, val] = eval_expression(st, arg);
-            st.use_led = (ok && val != 0.0);
+            // 絶対座標移動をサポートしていないため、rel_expr に関わらず相対移動で代用する
+            (void)vr;
+            int ix = clamp_int(static_cast<int>(round(vx)), -128, 127);
+            int iy = clamp_int(static_cast<int>(round(vy)), -128, 127);
+            Mouse.move((signed char)ix, (signed char)iy, 0);
+            maybe_tud_task(true);
         }
-        return current_index + 1;
+        return next;
     }
 
-    // DEBUG
-    if (starts_with_cmd(line, "DEBUG"))
+    case Op::MOUSE_PRESS:
+        if (in.ival)
+            Mouse.press(in.ival);
+        maybe_tud_task(true);
+        return next;
+
+    case Op::MOUSE_RELEASE:
+        if (in.ival)
+            Mouse.release(in.ival);
+        maybe_tud_task(true);
+        return next;
+
+    case Op::MOUSE_PUSH_FOR:
     {
-        size_t p = line.find('(');
-        size_t q = line.find(')');
-        if (p != std::string::npos && q != std::string::npos && q > p)
+        // ■ 変更: 押している間は待機としてスケジューラに制御を返し、再開時 (phase 1) に離す
+        if (task.phase == 0)
         {
-            std::string arg = trim(line.substr(p + 1, q - p - 1));
-            auto [ok, val] = eval_expression(st, arg);
-            st.debug_exec = (ok && val != 0.0);
-            g_script_debug = st.debug_exec;
-            printf("DEBUG: execute logs %s\r\n", st.debug_exec ? "ENABLED" : "DISABLED");
+            auto [ok, val] = eval_expression(st, in.exprs[0]);
+            uint32_t ms = ok ? seconds_to_ms(val) : 0;
+            if (in.ival)
+                Mouse.press(in.ival);
             tud_task();
+            task.phase = 1;
+            task_hold_ms(st, ms);
+            return current_index;
         }
-        return current_index + 1;
+        task.phase = 0;
+        if (in.ival)
+            Mouse.release(in.ival);
+        tud_task();
+        return next;
     }
 
-    // SetLED
-    if (starts_with_cmd(line, "SetLED"))
+    // ■ 追加: 配列
+    case Op::DIM:
     {
-        size_t p = line.find('(');
-        size_t q = line.rfind(')');
-        if (p != std::string::npos && q != std::string::npos && q > p)
+        auto [ok, val] = eval_expression(st, in.exprs[0]);
+        if (!ok)
+            return next;
+        std::vector<double> &arr = st.arrays[in.ival];
+        std::vector<double>().swap(arr); // 再 DIM では先に古い領域を解放する
+        const char *current_line_str = line_cstr(st, st.current_line_index, "DIM");
+        if (!(val >= 1.0 && val <= 1048576.0))
         {
-            std::string args = line.substr(p + 1, q - p - 1);
-            auto parts = split_top_level_args(args);
-            tud_task();
-            if (parts.size() >= 3)
-            {
-                auto r = eval_expression(st, parts[0]);
-                auto g = eval_expression(st, parts[1]);
-                auto b = eval_expression(st, parts[2]);
-                if (r.first && g.first && b.first)
-                {
-                    if (st.use_led)
-                    {
-                        int ri = static_cast<int>(round(r.second));
-                        int gi = static_cast<int>(round(g.second));
-                        int bi = static_cast<int>(round(b.second));
-                        if (ri < 0)
-                            ri = 0;
-                        if (ri > 255)
-                            ri = 255;
-                        if (gi < 0)
-                            gi = 0;
-                        if (gi > 255)
-                            gi = 255;
-                        if (bi < 0)
-                            bi = 0;
-                        if (bi > 255)
-                            bi = 255;
-
-                        ApplyStripColor(ri, gi, bi);
-                        tud_task();
-                    }
-                }
-            }
+            SignalRuntimeError("DIM: size must be 1..1048576", st.current_line_index + 1, current_line_str, "");
+            st.end_flag = true;
+            return next;
         }
-        return current_index + 1;
+        size_t n = static_cast<size_t>(val);
+        if (!memory_guard_reserve(n * sizeof(double) + 4096))
+        {
+            SignalRuntimeError("Out of Memory (DIM)", st.current_line_index + 1, current_line_str, "");
+            st.end_flag = true;
+            return next;
+        }
+        arr.assign(n, 0.0);
+        log_fmt(LOGF_DIM, in.ival, (unsigned)n);
+        return next;
     }
 
-    // KeyPress(key) / KeyRelease(key) / KeyPushFor(key, expr) / KeyType("str", press, release)
-    if (starts_with_cmd(line, "KeyPress") || starts_with_cmd(line, "KeyRelease") ||
-        starts_with_cmd(line, "KeyPushFor") || starts_with_cmd(line, "KeyType"))
+    case Op::SET_ARRAY:
     {
-        // debug: print USB/TinyUSB status before attempting HID ops
-        printf("DBG: g_usb_mode=%d tud_mounted=%d tud_hid_ready=%d tud_suspended=%d\r\n",
-               (int)g_usb_mode, tud_mounted() ? 1 : 0, tud_hid_ready() ? 1 : 0, tud_suspended() ? 1 : 0);
-        tud_task();
-
-        // local helper: resolve token to an integer code (HID constant or ASCII)
-        auto resolve_code = [](const std::string &keytok) -> int
+        auto [ok_i, idx] = eval_expression(st, in.exprs[0]);
+        if (!ok_i)
+            return next;
+        auto [ok_v, val] = eval_expression(st, in.exprs[1]);
+        if (!ok_v)
+            return next;
+        g_expr_error = nullptr;
+        double *p = array_elem(in.ival, idx);
+        if (!p)
         {
-            if (keytok.empty())
-                return 0;
-            // numeric literal?
-            bool is_num = true;
-            for (char ch : keytok)
-                if (!(ch >= '0' && ch <= '9'))
-                {
-                    is_num = false;
-                    break;
-                }
-            if (is_num)
-                return atoi(keytok.c_str());
-            // mapped name
-            uint8_t mapped = key_name_to_hid(keytok);
-            if (mapped != 0)
-                return mapped;
-            // single character -> ascii
-            if (keytok.size() == 1)
-                return (int)keytok[0];
-            // fallback: attempt atoi (will yield 0)
-            return atoi(keytok.c_str());
-        };
-
-        // 引数リスト（()内）を抽出
-        size_t p = line.find('(');
-        size_t q = std::string::npos;
-        if (p == std::string::npos)
-            return current_index + 1;
-        // Use the last ')' in the line as the closing paren (search from end)
-        q = line.rfind(')');
-        if (q == std::string::npos || q <= p)
-            return current_index + 1;
-        std::string args = line.substr(p + 1, q - p - 1);
+            const char *current_line_str = line_cstr(st, st.current_line_index, "SET");
+            std::string expanded = expand_line_variables(st, current_line_str);
+            SignalRuntimeError(g_expr_error, st.current_line_index + 1, current_line_str, expanded.c_str());
+            st.end_flag = true;
+            return next;
+        }
+        *p = val;
+        return next;
+    }
 
-        if (starts_with_cmd(line, "KeyPress"))
+    case Op::LOAD_TABLE:
+        do_load_table(st, in);
+        return next;
+
+    // ■ 追加: 協調マルチタスク
+    case Op::SPAWN:
+    {
+        const char *current_line_str = line_cstr(st, current_index, "SPAWN");
+        if (in.target < 0)
         {
-            std::string keytok = trim(args);
-            // quoted string -> press each character and track as pressed
-            if (!keytok.empty() && keytok.front() == '\"' && keytok.back() == '\"')
-            {
-                std::string s = keytok.substr(1, keytok.size() - 2);
-                for (char c : s)
-                {
-                    uint8_t code = (uint8_t)c;
-                    Keyboard.press(code);
-                    st.pressed_keys.insert(code);
-                    tud_task();
-                }
-            }
-            else
-            {
-                int code = resolve_code(keytok);
-                if (code != 0)
-                {
-                    uint8_t uc = static_cast<uint8_t>(code);
-                    Keyboard.press(uc);
-                    st.pressed_keys.insert(uc);
-                    tud_task();
-                }
-            }
+            SignalRuntimeError("SPAWN: Label not found", current_index + 1, current_line_str, "");
+            st.end_flag = true;
+            return next;
         }
-        else if (starts_with_cmd(line, "KeyRelease"))
+        ScriptTask *nt = start_task(st, in.target);
+        if (!nt)
         {
-            std::string keytok = trim(args);
-            // quoted string -> release each character and clear tracking
-            if (!keytok.empty() && keytok.front() == '\"' && keytok.back() == '\"')
-            {
-                std::string s = keytok.substr(1, keytok.size() - 2);
-                for (char c : s)
-                {
-                    uint8_t code = (uint8_t)c;
-                    Keyboard.release(code);
-                    st.pressed_keys.erase(code);
-                    tud_task();
-                }
-            }
-            else
-            {
-                int code = resolve_code(keytok);
-                if (code != 0)
-                {
-                    uint8_t uc = static_cast<uint8_t>(code);
-                    Keyboard.release(uc);
-                    st.pressed_keys.erase(uc);
-                    tud_task();
-                }
+            SignalRuntimeError("SPAWN: Too many tasks (max 8)", current_index + 1, current_line_str, "");
+            st.end_flag = true;
+            return next;
+        }
+        log_fmt(LOGF_SPAWN, (int)(nt - st.tasks.data()), in.target + 1);
+        return next;
+    }
+
+    case Op::JOIN:
+        // SPAWN したタスク (自分以外) が残っていれば、それらが終わるまでスケジューラに待たせる (イベントハンドラは待たない)
+        for (size_t k = 1; k < st.tasks.size(); ++k)
+        {
+            if ((int)k != st.cur_task && st.tasks[k].alive && st.tasks[k].event < 0)
+            {
+                task.joining = true;
+                st.yield = true;
+                return current_index;
             }
         }
-        else if (starts_with_cmd(line, "KeyPushFor"))
+        task.joining = false;
+        return next;
+
+    // ■ 追加: イベントハンドラの登録・解除
+    case Op::ON_EVENT:
+    case Op::EVERY:
+    {
+        const char *current_line_str = line_cstr(st, current_index, in.op == Op::EVERY ? "EVERY" : "ON");
+        uint64_t period_us = 0;
+        if (in.op == Op::EVERY)
         {
-            // KeyPushFor(key, expr_seconds)
+            auto [ok, val] = eval_expression(st, in.exprs[0]);
+            if (!ok)
+                return next;
+            if (!(val > 0.0))
             {
-                auto parts = split_top_level_args(args);
-                if (parts.size() >= 2)
-                {
-                    std::string keytok = trim(parts[0]);
-                    std::string expr = trim(parts[1]);
-                    int code = 0;
-                    if (!keytok.empty() && keytok.front() == '\"' && keytok.back() == '\"')
-                    {
-                        std::string s = keytok.substr(1, keytok.size() - 2);
-                        if (!s.empty())
-                            code = (int)s[0];
-                    }
-                    else
-                    {
-                        code = resolve_code(keytok);
-                    }
-                    auto [ok, val] = eval_expression(st, expr);
-                    if (!ok)
-                        val = 0.0;
-                    if (code != 0)
-                    {
-                        uint8_t uc = static_cast<uint8_t>(code);
-                        Keyboard.press(uc);
-                        st.pressed_keys.insert(uc);
-                        tud_task();
-                        uint32_t ms = static_cast<uint32_t>(round(val * 1000.0));
-                        uint32_t rem = ms;
-                        while (rem)
-                        {
-                            uint32_t step = rem > 20 ? 20 : rem;
-                            sleep_ms(step);
-                            tud_task();
-                            rem -= step;
-                        }
-                        Keyboard.release(uc);
-                        st.pressed_keys.erase(uc);
-                        tud_task();
-                    }
-                }
+                set_event_handler(st, in.ival, -1, 0); // EVERY 0 GOSUB <label> で解除
+                return next;
             }
+            period_us = static_cast<uint64_t>(llround(val * 1000000.0));
+            if (period_us < EVERY_MIN_PERIOD_US)
+                period_us = EVERY_MIN_PERIOD_US;
         }
-        else if (starts_with_cmd(line, "KeyType"))
+        if (in.aux == 0 && in.target < 0)
         {
-            // KeyType("string", press_duration_expr, release_duration_expr)
-            // First argument MUST be a quoted string. Second/third arguments are expressions
-            // and are evaluated via eval_expression (supports Rand(), etc).
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
+            SignalRuntimeError(in.op == Op::EVERY ? "EVERY: Label not found" : "ON: Label not found", current_index + 1, current_line_str, "");
+            st.end_flag = true;
+            return next;
+        }
+        set_event_handler(st, in.ival, in.target, period_us);
+        log_fmt(LOGF_EVENT_SET, in.op == Op::EVERY ? "EVERY" : "ON", in.ival, in.target + 1);
+        return next;
+    }
 
-            // use top-level-aware splitter for arguments
-            std::string args = line.substr(p + 1, q - p - 1);
-            auto parts = split_top_level_args(args);
-            if (parts.size() < 3)
-                return current_index + 1;
+    case Op::MOUSERUN:
+    {
+        double time_scale = 1.0, angle = 0.0, scale = 1.0;
+        if (in.exprs.size() >= 3)
+        {
+            auto t = eval_expression(st, in.exprs[0]);
+            auto a = eval_expression(st, in.exprs[1]);
+            auto s = eval_expression(st, in.exprs[2]);
+            if (t.first)
+                time_scale = t.second;
+            if (a.first)
+                angle = a.second;
+            if (s.first)
+                scale = s.second;
+        }
+        // angle given in radians per spec
+        do_mouserun(st, in.text, time_scale, angle, scale);
+        return next;
+    }
 
-            // Parse first argument as a quoted string and unescape common sequences
-            std::string raw_first = trim(parts[0]);
-            if (raw_first.size() < 2 || raw_first.front() != '\"' || raw_first.back() != '\"')
-            {
-                // first argument must be quoted string per new requirement
-                return current_index + 1;
-            }
-            std::string inner = raw_first.substr(1, raw_first.size() - 2);
-            std::string s;
-            for (size_t i = 0; i < inner.size(); ++i)
-            {
-                char c = inner[i];
-                if (c == '\\' && i + 1 < inner.size())
-                {
-                    char n = inner[++i];
-                    switch (n)
-                    {
-                    case 'n':
-                        s.push_back('\n');
-                        break;
-                    case 'r':
-                        s.push_back('\r');
-                        break;
-                    case 't':
-                        s.push_back('\t');
-                        break;
-                    case '\\':
-                        s.push_back('\\');
-                        break;
-                    case '\"':
-                        s.push_back('\"');
-                        break;
-                    default:
-                        // unknown escape -> keep char as-is
-                        s.push_back(n);
-                        break;
-                    }
-                }
-                else
-                {
-                    s.push_back(c);
-                }
-            }
+    case Op::PROCON_PRESS:
+        SwitchController().pressButton(static_cast<Button>(in.ival));
+        maybe_tud_task(true);
+        return next;
 
-            // evaluate durations (allow expressions like Rand(0.01, Rand(0.02, 0.05)))
-            auto [ok1, press_d] = eval_expression(st, parts[1]);
-            auto [ok2, release_d] = eval_expression(st, parts[2]);
-            double press_ms = ok1 ? press_d * 1000.0 : 50.0;
-            double release_ms = ok2 ? release_d * 1000.0 : 50.0;
+    case Op::PROCON_RELEASE:
+        SwitchController().releaseButton(static_cast<Button>(in.ival));
+        maybe_tud_task(true);
+        return next;
 
-            // Emit characters using press/release so HID mapping path is used.
-            for (char c : s)
-            {
-                uint8_t code = static_cast<uint8_t>(c);
-                // debug trace for diagnosis
-                printf("KeyType: emit char '%c' (0x%02X)\r\n", (c >= 32 && c <= 126) ? c : '?', (unsigned)code);
-                maybe_tud_task(true);
-                // press-hold-release to respect durations
-                Keyboard.press(code);
-                st.pressed_keys.insert(code);
-                maybe_tud_task(true);
+    case Op::PROCON_PUSH_FOR:
+    {
+        // ■ 変更: 押している間は待機としてスケジューラに制御を返し、再開時 (phase 1) に離す
+        if (task.phase == 0)
+        {
+            auto [ok, val] = eval_expression(st, in.exprs[0]);
+            uint32_t ms = ok ? seconds_to_ms(val) : 0;
+            SwitchController().pressButton(static_cast<Button>(in.ival));
+            maybe_tud_task(true);
+            task.phase = 1;
+            task_hold_ms(st, ms);
+            return current_index;
+        }
+        task.phase = 0;
+        SwitchController().releaseButton(static_cast<Button>(in.ival));
+        maybe_tud_task(true);
+        return next;
+    }
 
-                uint32_t rem = static_cast<uint32_t>(round(press_ms));
-                while (rem)
-                {
-                    uint32_t step = rem > 20 ? 20 : rem;
-                    sleep_ms(step);
-                    tud_task();
-                    rem -= step;
-                }
+    case Op::PROCON_HAT:
+        // call SwitchController to set hat (reporting is handled by maybe_tud_task)
+        SwitchController().pressHatButton(static_cast<Hat>(in.ival));
+        maybe_tud_task(true);
+        return next;
 
-                Keyboard.release(code);
-                st.pressed_keys.erase(code);
+    case Op::PROCON_JOY:
+        if (in.exprs.size() >= 4)
+        {
+            auto lx = eval_expression(st, in.exprs[0]);
+            auto ly = eval_expression(st, in.exprs[1]);
+            auto rx = eval_expression(st, in.exprs[2]);
+            auto ry = eval_expression(st, in.exprs[3]);
+            if (lx.first && ly.first && rx.first && ry.first)
+            {
+                SwitchController().setStickState((int16_t)lx.second, (int16_t)ly.second, (int16_t)rx.second,
+                                                 (int16_t)ry.second);
+                // reporting is managed by maybe_tud_task
                 maybe_tud_task(true);
-
-                // wait release interval between characters
-                rem = static_cast<uint32_t>(round(release_ms));
-                while (rem)
-                {
-                    uint32_t step = rem > 20 ? 20 : rem;
-                    sleep_ms(step);
-                    tud_task();
-                    rem -= step;
-                }
             }
         }
-        return current_index + 1;
+        tud_task();
+        return next;
     }
 
-    // MouseMove(x_expr, y_expr, rel_expr)
-    if (starts_with_cmd(line, "MouseMove") || starts_with_cmd(line, "MousePress") ||
-        starts_with_cmd(line, "MouseRelease") || starts_with_cmd(line, "MousePushFor") ||
-        starts_with_cmd(line, "Mouserun"))
-    {
-        if (starts_with_cmd(line, "MouseMove"))
-        {
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string args = line.substr(p + 1, q - p - 1);
-            // split using top-level-aware helper
-            auto parts = split_top_level_args(args);
-            if (parts.size() >= 3)
-            {
-                auto [okx, vx] = eval_expression(st, parts[0]);
-                auto [oky, vy] = eval_expression(st, parts[1]);
-                auto [okr, vr] = eval_expression(st, parts[2]);
-                if (okx && oky && okr)
-                {
-                    bool rel = (vr != 0.0);
-                    if (rel)
-                    {
-                        int ix = static_cast<int>(round(vx));
-                        int iy = static_cast<int>(round(vy));
-                        if (ix < -128)
-                            ix = -128;
-                        if (ix > 127)
-                            ix = 127;
-                        if (iy < -128)
-                            iy = -128;
-                        if (iy > 127)
-                            iy = 127;
-                        Mouse.move((signed char)ix, (signed char)iy, 0);
-                        maybe_tud_task(true);
-                    }
-                    else
-                    {
-                        // 絶対座標移動をサポートしていないため、相対移動で代用する
-                        int ix = static_cast<int>(round(vx));
-                        int iy = static_cast<int>(round(vy));
-                        if (ix < -128)
-                            ix = -128;
-                        if (ix > 127)
-                            ix = 127;
-                        if (iy < -128)
-                            iy = -128;
-                        if (iy > 127)
-                            iy = 127;
-                        Mouse.move((signed char)ix, (signed char)iy, 0);
-                        maybe_tud_task(true);
-                    }
-                }
-            }
-        }
-        else if (starts_with_cmd(line, "MousePress"))
+    return next;
+}
+
+// ■ 追加: イベントが発生しているか (文の合間に呼ぶので、割り込みのフラグと時刻の比較だけで済ませる)
+static inline bool events_pending(const ScriptState &st)
+{
+    return g_event_pending || st.events_due || (st.every_next_us != UINT64_MAX && time_us_64() >= st.every_next_us);
+}
+
+// ■ 追加: 発生したイベントを集めてハンドラのタスクを起動する。起動したら true を返す。
+// 同じハンドラが実行中の間に起きたイベントはまとめて 1 回とみなし、タスクに空きが無いときは次の機会まで持ち越す。
+static bool dispatch_events(ScriptState &st, uint64_t now)
+{
+    if (g_event_pending)
+    {
+        uint32_t ints = save_and_disable_interrupts();
+        st.events_due |= g_event_pending;
+        g_event_pending = 0;
+        restore_interrupts(ints);
+    }
+    if (now >= st.every_next_us)
+    {
+        for (int ev = EVENT_EVERY; ev < EVENT_COUNT; ++ev)
         {
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string arg = trim(line.substr(p + 1, q - p - 1));
-            if (arg == "LEFT")
-                Mouse.press(MOUSE_LEFT);
-            else if (arg == "RIGHT")
-                Mouse.press(MOUSE_RIGHT);
-            else if (arg == "MIDDLE")
-                Mouse.press(MOUSE_MIDDLE);
-            maybe_tud_task(true);
+            EventHandler &h = st.events[ev];
+            if (!(st.events_armed & (1u << ev)) || now < h.due_us)
+                continue;
+            st.events_due |= 1u << ev;
+            h.due_us += h.period_us;
+            if (h.due_us <= now)
+                h.due_us = now + h.period_us; // 大きく遅れた分は追いかけない
         }
-        else if (starts_with_cmd(line, "MouseRelease"))
+        update_every_next(st);
+    }
+    st.events_due &= st.events_armed;
+
+    bool started = false;
+    for (int ev = 0; ev < EVENT_COUNT && st.events_due; ++ev)
+    {
+        const uint32_t bit = 1u << ev;
+        if (!(st.events_due & bit))
+            continue;
+        EventHandler &h = st.events[ev];
+        if (h.task >= 0 && st.tasks[h.task].alive && st.tasks[h.task].event == ev)
         {
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string arg = trim(line.substr(p + 1, q - p - 1));
-            if (arg == "LEFT")
-                Mouse.release(MOUSE_LEFT);
-            else if (arg == "RIGHT")
-                Mouse.release(MOUSE_RIGHT);
-            else if (arg == "MIDDLE")
-                Mouse.release(MOUSE_MIDDLE);
-            maybe_tud_task(true);
+            st.events_due &= ~bit; // ハンドラが実行中
+            continue;
         }
-        else if (starts_with_cmd(line, "MousePushFor"))
+        ScriptTask *t = start_task(st, h.target);
+        if (!t)
+            continue;
+        t->event = ev;
+        h.task = static_cast<int>(t - st.tasks.data());
+        st.urgent_task = h.task;
+        st.events_due &= ~bit;
+        started = true;
+    }
+    return started;
+}
+
+// ■ 追加: タスクスケジューラ
+// 実行可能なタスク (待機期限を過ぎ、JOIN 待ちでないもの) をラウンドロビンで選び、待機に入るか
+// TASK_SLICE 行を実行するまで続けて実行する。実行可能なタスクが無ければ最も早い期限まで USB を処理しながら眠る。
+// メインタスクが終わる (END または最終行を越える) とスクリプト全体が終了する。
+// ■ 変更: 文の合間とアイドル時にイベントを調べ、起動したハンドラのタスクを次に実行する。
+static void run_tasks(ScriptState &st)
+{
+    while (!st.end_flag)
+    {
+        const uint64_t now = time_us_64();
+        if (st.events_armed)
+            dispatch_events(st, now);
+        const int n = static_cast<int>(st.tasks.size());
+
+        int pick = -1;
+        uint64_t earliest = UINT64_MAX;
+        const int urgent = st.urgent_task;
+        st.urgent_task = -1;
+        if (urgent >= 0 && st.tasks[urgent].alive && st.tasks[urgent].wake_us <= now)
+            pick = urgent;
+        for (int k = 1; k <= n && pick < 0; ++k)
         {
-            // MousePushFor(button, expr)
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string args = line.substr(p + 1, q - p - 1);
+            const int id = (st.cur_task + k) % n;
+            const ScriptTask &t = st.tasks[id];
+            if (!t.alive)
+                continue;
+            if (t.joining)
             {
-                auto parts = split_top_level_args(args);
-                if (parts.size() < 2)
-                    return current_index + 1;
-                std::string button = trim(parts[0]);
-                std::string expr = trim(parts[1]);
-                auto [ok, val] = eval_expression(st, expr);
-                uint32_t ms = ok ? static_cast<uint32_t>(round(val * 1000.0)) : 0;
-                if (button == "LEFT")
-                    Mouse.press(MOUSE_LEFT);
-                else if (button == "RIGHT")
-                    Mouse.press(MOUSE_RIGHT);
-                else if (button == "MIDDLE")
-                    Mouse.press(MOUSE_MIDDLE);
-                tud_task();
-                uint32_t rem = ms;
-                while (rem)
-                {
-                    uint32_t step = rem > 20 ? 20 : rem;
-                    sleep_ms(step);
-                    tud_task();
-                    rem -= step;
-                }
-                if (button == "LEFT")
-                    Mouse.release(MOUSE_LEFT);
-                else if (button == "RIGHT")
-                    Mouse.release(MOUSE_RIGHT);
-                else if (button == "MIDDLE")
-                    Mouse.release(MOUSE_MIDDLE);
-                tud_task();
+                // 自分以外の SPAWN タスクが残っていれば待つ
+                bool others = false;
+                for (int j = 1; j < n; ++j)
+                    others = others || (j != id && st.tasks[j].alive && st.tasks[j].event < 0);
+                if (others)
+                    continue;
             }
+            if (t.wake_us <= now)
+                pick = id;
+            else if (t.wake_us < earliest)
+                earliest = t.wake_us;
         }
-        else if (starts_with_cmd(line, "Mouserun"))
-        {
-            // Mouserun(filename_string, time_scale_expr, angle_expr, scale_expr)
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string args = line.substr(p + 1, q - p - 1);
-            // parse first arg as quoted filename
-            size_t idx = 0;
-            while (idx < args.size() && isspace((unsigned char)args[idx]))
-                ++idx;
-            std::string filename;
-            if (idx < args.size() && args[idx] == '\"')
-            {
-                ++idx;
-                size_t j = idx;
-                while (j < args.size() && args[j] != '\"')
-                    ++j;
-                filename = args.substr(idx, j - idx);
-                idx = j + 1;
-                // skip any whitespace and a following comma so split_top_level_args
-                // does not see an initial empty token (was causing empty first part)
-                while (idx < args.size() && (isspace((unsigned char)args[idx]) || args[idx] == ','))
-                    ++idx;
-            }
-            // remaining splits by commas (top-level aware)
-            auto parts = split_top_level_args(args, idx, args.size());
-            double time_scale = 1.0, angle = 0.0, scale = 1.0;
-            if (parts.size() >= 3)
-            {
-                auto t = eval_expression(st, parts[0]);
-                auto a = eval_expression(st, parts[1]);
-                auto s = eval_expression(st, parts[2]);
-                if (t.first)
-                    time_scale = t.second;
-                if (a.first)
-                    angle = a.second;
-                if (s.first)
-                    scale = s.second;
-            }
-            // angle given in radians per spec
-            do_mouserun(st, filename, time_scale, angle, scale);
+
+        if (pick < 0)
+        {
+            if (earliest == UINT64_MAX && !st.events_armed)
+                break; // 全タスクが JOIN 待ち (起こり得ないが念のため)
+            // EVERY の期限でも起き、ボタンのハンドラがあるときは割り込みのフラグを見るため短く区切って眠る
+            if (st.every_next_us < earliest)
+                earliest = st.every_next_us;
+            // ■ 変更: USB は眠る前に処理し、最後の区間は期限ちょうどに起きる
+            tud_task();
+            const uint64_t t = time_us_64();
+            const uint64_t step = (g_event_watch || st.events_due) ? EVENT_IDLE_STEP_US : 20000;
+            if (earliest <= t)
+                continue;
+            // ■ 追加: 次の期限まで十分空いていれば溜まったログを書き込む
+            if (earliest - t >= LOG_IDLE_FLUSH_GAP_US && SystemLogIdle())
+                continue;
+            if (earliest - t <= step)
+                precise_sleep_until(earliest);
+            else
+                sleep_until(from_us_since_boot(t + step));
+            continue;
         }
-        return current_index + 1;
-    }
 
-    // ProController functions
-    if (starts_with_cmd(line, "ProConPress") || starts_with_cmd(line, "ProConRelease") ||
-        starts_with_cmd(line, "ProConPushFor") || starts_with_cmd(line, "ProConJoy") || starts_with_cmd(line, "ProConHat"))
-    {
-        if (starts_with_cmd(line, "ProConPress"))
-        {
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string arg = trim(line.substr(p + 1, q - p - 1));
-            // map button names to enum
-            Button b = Button::A;
-            if (arg == "A")
-                b = Button::A;
-            else if (arg == "B")
-                b = Button::B;
-            else if (arg == "X")
-                b = Button::X;
-            else if (arg == "Y")
-                b = Button::Y;
-            else if (arg == "L")
-                b = Button::L;
-            else if (arg == "R")
-                b = Button::R;
-            else if (arg == "ZL")
-                b = Button::ZL;
-            else if (arg == "ZR")
-                b = Button::ZR;
-            else if (arg == "MINUS")
-                b = Button::MINUS;
-            else if (arg == "PLUS")
-                b = Button::PLUS;
-            else if (arg == "LCLICK")
-                b = Button::LCLICK;
-            else if (arg == "RCLICK")
-                b = Button::RCLICK;
-            else if (arg == "HOME")
-                b = Button::HOME;
-            else if (arg == "CAPTURE")
-                b = Button::CAPTURE;
-            // call SwitchController
-            SwitchController().pressButton(b);
-            maybe_tud_task(true);
+        st.cur_task = pick;
+        if (st.tasks[pick].timed)
+        {
+            st.tasks[pick].timed = false;
+            record_overshoot(st.tasks[pick].wake_us, time_us_64());
         }
-        else if (starts_with_cmd(line, "ProConRelease"))
-        {
-            size_t p = line.find('(');
-            size_t q = line.find(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string arg = trim(line.substr(p + 1, q - p - 1));
-            Button b = Button::A;
-            if (arg == "A")
-                b = Button::A;
-            else if (arg == "B")
-                b = Button::B;
-            else if (arg == "X")
-                b = Button::X;
-            else if (arg == "Y")
-                b = Button::Y;
-            else if (arg == "L")
-                b = Button::L;
-            else if (arg == "R")
-                b = Button::R;
-            else if (arg == "ZL")
-                b = Button::ZL;
-            else if (arg == "ZR")
-                b = Button::ZR;
-            else if (arg == "MINUS")
-                b = Button::MINUS;
-            else if (arg == "PLUS")
-                b = Button::PLUS;
-            else if (arg == "LCLICK")
-                b = Button::LCLICK;
-            else if (arg == "RCLICK")
-                b = Button::RCLICK;
-            else if (arg == "HOME")
-                b = Button::HOME;
-            else if (arg == "CAPTURE")
-                b = Button::CAPTURE;
-            SwitchController().releaseButton(b);
-            maybe_tud_task(true);
+        if (st.tasks[pick].wait_line >= 0)
+        {
+            // ■ 追加: 待機していた時間を待機に入った行に計上する
+            if (st.profile)
+                st.prof[st.tasks[pick].wait_line].wait_us += time_us_64() - st.tasks[pick].wait_from;
+            st.tasks[pick].wait_line = -1;
         }
-        else if (starts_with_cmd(line, "ProConPushFor"))
+        st.yield = false;
+        for (int step = 0; step < TASK_SLICE && !st.end_flag && !st.yield; ++step)
         {
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string args = line.substr(p + 1, q - p - 1);
+            ScriptTask &t = st.tasks[pick];
+            if (st.profile)
             {
-                auto parts = split_top_level_args(args);
-                if (parts.size() < 2)
-                    return current_index + 1;
-                std::string bname = trim(parts[0]);
-                std::string expr = trim(parts[1]);
-                Button b = Button::A;
-                if (bname == "A")
-                    b = Button::A;
-                else if (bname == "B")
-                    b = Button::B;
-                else if (bname == "X")
-                    b = Button::X;
-                else if (bname == "Y")
-                    b = Button::Y;
-                else if (bname == "L")
-                    b = Button::L;
-                else if (bname == "R")
-                    b = Button::R;
-                else if (bname == "ZL")
-                    b = Button::ZL;
-                else if (bname == "ZR")
-                    b = Button::ZR;
-                else if (bname == "MINUS")
-                    b = Button::MINUS;
-                else if (bname == "PLUS")
-                    b = Button::PLUS;
-                else if (bname == "LCLICK")
-                    b = Button::LCLICK;
-                else if (bname == "RCLICK")
-                    b = Button::RCLICK;
-                else if (bname == "HOME")
-                    b = Button::HOME;
-                else if (bname == "CAPTURE")
-                    b = Button::CAPTURE;
-                auto [ok, val] = eval_expression(st, expr);
-                uint32_t ms = ok ? static_cast<uint32_t>(round(val * 1000.0)) : 0;
-                SwitchController().pressButton(b);
-                maybe_tud_task(true);
-                uint32_t rem = ms;
-                while (rem)
+                const int line = t.pc;
+                const bool resumed = t.phase != 0;
+                const uint64_t t0 = time_us_64();
+                t.pc = execute_line(st, t.pc);
+                const uint64_t t1 = time_us_64();
+                LineProfile &p = st.prof[line];
+                if (!resumed)
+                    ++p.count;
+                prof_add(p.exec_us, t1 - t0);
+                if (st.yield)
                 {
-                    uint32_t step = rem > 20 ? 20 : rem;
-                    sleep_ms(step);
-                    tud_task();
-                    rem -= step;
+                    t.wait_line = line;
+                    t.wait_from = t1;
                 }
-                SwitchController().releaseButton(b);
-                maybe_tud_task(true);
             }
-        }
-        else if (starts_with_cmd(line, "ProConHat"))
-        {
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string arg = trim(line.substr(p + 1, q - p - 1));
-            Hat h = Hat::CENTER;
-            if (arg == "UP")
-                h = Hat::UP;
-            else if (arg == "UP_RIGHT")
-                h = Hat::UP_RIGHT;
-            else if (arg == "RIGHT")
-                h = Hat::RIGHT;
-            else if (arg == "RIGHT_DOWN")
-                h = Hat::RIGHT_DOWN;
-            else if (arg == "DOWN")
-                h = Hat::DOWN;
-            else if (arg == "DOWN_LEFT")
-                h = Hat::DOWN_LEFT;
-            else if (arg == "LEFT")
-                h = Hat::LEFT;
-            else if (arg == "LEFT_UP")
-                h = Hat::LEFT_UP;
-            else if (arg == "CENTER" || arg == "NEUTRAL")
-                h = Hat::CENTER;
-            // call SwitchController to set hat (reporting is handled by maybe_tud_task)
-            SwitchController().pressHatButton(h);
-            maybe_tud_task(true);
-        }
-        else if (starts_with_cmd(line, "ProConJoy"))
-        {
-            size_t p = line.find('(');
-            size_t q = line.rfind(')');
-            if (p == std::string::npos || q == std::string::npos || q <= p)
-                return current_index + 1;
-            std::string args = line.substr(p + 1, q - p - 1);
-            // parse four expressions
-            auto parts = split_top_level_args(args);
-            if (parts.size() >= 4)
+            else
+                t.pc = execute_line(st, t.pc);
+            if (!t.alive)
+                break;
+            if (t.pc < 0 || t.pc >= (int)st.line_count)
             {
-                auto lx = eval_expression(st, parts[0]);
-                auto ly = eval_expression(st, parts[1]);
-                auto rx = eval_expression(st, parts[2]);
-                auto ry = eval_expression(st, parts[3]);
-                if (lx.first && ly.first && rx.first && ry.first)
-                {
-                    SwitchController().setStickState((int16_t)lx.second, (int16_t)ly.second, (int16_t)rx.second,
-                                                     (int16_t)ry.second);
-                    // reporting is managed by maybe_tud_task
-                    maybe_tud_task(true);
-                }
+                t.alive = false;
+                if (pick == 0)
+                    st.end_flag = true;
+                break;
             }
-            tud_task();
+            // ■ 追加: ハンドラを起動したら割り当てを打ち切り、ハンドラに制御を渡す
+            if (st.events_armed && events_pending(st) && dispatch_events(st, time_us_64()))
+                break;
         }
-        return current_index + 1;
     }
+}
 
-    // 未知のコマンドは無視する
-    return current_index + 1;
+// ■ 追加: プロファイルを実行時間の長い順に profile.txt へ書き出す (一度も実行・待機しなかった行は省く)
+static void write_profile(ScriptState &st, const char *filename, uint64_t elapsed_us)
+{
+    if (st.prof.empty())
+        return;
+    std::vector<int> order;
+    uint64_t total_exec = 0, total_eval = 0, total_wait = 0;
+    try
+    {
+        for (size_t i = 0; i < st.prof.size(); ++i)
+        {
+            const LineProfile &p = st.prof[i];
+            if (p.count == 0 && p.wait_us == 0)
+                continue;
+            order.push_back((int)i);
+            total_exec += p.exec_us;
+            total_eval += p.eval_us;
+            total_wait += p.wait_us;
+        }
+    }
+    catch (const std::bad_alloc &)
+    {
+        printf("PROFILE: not enough memory for the report\r\n");
+        return;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        const LineProfile &pa = st.prof[a], &pb = st.prof[b];
+        if (pa.exec_us != pb.exec_us)
+            return pa.exec_us > pb.exec_us;
+        if (pa.wait_us != pb.wait_us)
+            return pa.wait_us > pb.wait_us;
+        return a < b;
+    });
+
+    if (script_fs_mount() < 0)
+        return;
+    lfs_file_t f;
+    if (lfs_file_open(&g_lfs, &f, "profile.txt", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0)
+    {
+        script_fs_unmount();
+        printf("PROFILE: cannot open profile.txt\r\n");
+        return;
+    }
+    char buf[192];
+    int n = snprintf(buf, sizeof(buf),
+                     "# profile of %s: elapsed %llu us, exec %llu us (eval %llu us), wait %llu us\r\n"
+                     "# line\tcount\texec_us\tavg_us\teval_us\twait_us\ttext\r\n",
+                     filename, (unsigned long long)elapsed_us, (unsigned long long)total_exec,
+                     (unsigned long long)total_eval, (unsigned long long)total_wait);
+    lfs_file_write(&g_lfs, &f, buf, (lfs_size_t)std::min(n, (int)sizeof(buf) - 1));
+    for (int i : order)
+    {
+        const LineProfile &p = st.prof[i];
+        std::string text = trim(line_cstr(st, i, ""));
+        n = snprintf(buf, sizeof(buf), "%d\t%lu\t%lu\t%lu\t%lu\t%llu\t%.80s\r\n", i + 1, (unsigned long)p.count,
+                     (unsigned long)p.exec_us, (unsigned long)(p.count ? p.exec_us / p.count : 0), (unsigned long)p.eval_us,
+                     (unsigned long long)p.wait_us, text.c_str());
+        lfs_file_write(&g_lfs, &f, buf, (lfs_size_t)std::min(n, (int)sizeof(buf) - 1));
+        tud_task();
+    }
+    lfs_file_close(&g_lfs, &f);
+    script_fs_unmount();
+}
+
+// ■ 追加: トレースを古い順に trace.txt へ書き出す (スクリプトごとに 1 回)
+static void write_trace(ScriptState &st)
+{
+    TraceBuffer &tr = st.trace;
+    if (!tr.entries || tr.flushed)
+        return;
+    tr.flushed = true;
+    if (script_fs_mount() < 0)
+        return;
+    lfs_file_t f;
+    if (lfs_file_open(&g_lfs, &f, "trace.txt", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0)
+    {
+        script_fs_unmount();
+        return;
+    }
+    const uint32_t n = tr.total < TRACE_ENTRIES ? tr.total : TRACE_ENTRIES;
+    char buf[192];
+    int len = snprintf(buf, sizeof(buf), "# last %lu of %lu traced lines\r\n# t_us\tline\ttask\top\tkey\tvalue\ttext\r\n",
+                       (unsigned long)n, (unsigned long)tr.total);
+    lfs_file_write(&g_lfs, &f, buf, (lfs_size_t)std::min(len, (int)sizeof(buf) - 1));
+    for (uint32_t i = tr.total - n; i != tr.total; ++i)
+    {
+        const TraceEntry &e = tr.entries[i % TRACE_ENTRIES];
+        std::string text = trim(line_cstr(st, (int)e.line, ""));
+        char val[24];
+        if (std::isnan(e.value))
+            strcpy(val, "-");
+        else
+            snprintf(val, sizeof(val), "%.7g", (double)e.value);
+        len = snprintf(buf, sizeof(buf), "%lu\t%lu\t%u\t%u\t%ld\t%s\t%.80s\r\n", (unsigned long)e.t_us, (unsigned long)e.line + 1,
+                       (unsigned)e.task, (unsigned)e.op, (long)e.key, val, text.c_str());
+        lfs_file_write(&g_lfs, &f, buf, (lfs_size_t)std::min(len, (int)sizeof(buf) - 1));
+        tud_task();
+    }
+    lfs_file_close(&g_lfs, &f);
+    script_fs_unmount();
+}
+
+// ■ 追加: 実行中のスクリプト (SignalRuntimeError からトレースを書き出すため)
+static ScriptState *g_running_script = nullptr;
+
+// ランタイムエラーで停止する前に呼ばれる
+extern "C" void ScriptTraceFlush()
+{
+    if (g_running_script)
+        write_trace(*g_running_script);
+}
+
+// ■ 追加: 実行中のスクリプトを次の文の前で終わらせる (ホストのシミュレータが時間切れのときに呼ぶ)
+extern "C" void ScriptRequestStop()
+{
+    if (g_running_script)
+        g_running_script->end_flag = true;
+}
+
+// ■ 追加: 直前の ExecuteScript の実行統計
+static ScriptRunStats g_run_stats;
+
+void ScriptGetRunStats(ScriptRunStats *out)
+{
+    *out = g_run_stats;
+}
+
+static void run_stats_end(const ScriptState &st)
+{
+    g_run_stats.statements = st.executed_count;
+    g_run_stats.evals = st.eval_count;
+}
+
+// ■ 追加: ページ実行モードでスクリプトを開く (マウントとファイルは close_paged_script まで保持する)
+static bool open_paged_script(const char *filename, ScriptState &st)
+{
+    if (script_fs_mount() < 0)
+        return false;
+    int rc = lfs_file_open(&g_lfs, &st.pager.fp, filename, LFS_O_RDONLY);
+    if (rc < 0)
+    {
+        script_fs_unmount();
+        SignalRuntimeError("File Not Found", 0, filename, "");
+        return false;
+    }
+    st.pager.open = true;
+    st.paged = true;
+    return true;
 }
 
-// Read a whole file into lines vector
+static void close_paged_script(ScriptState &st)
+{
+    if (!st.pager.open)
+        return;
+    PagedScript &pg = st.pager;
+    uint32_t accesses = pg.hits + pg.misses;
+    printf("paged: %lu hits / %lu misses (hit rate %lu.%lu%%), stall %llu us\r\n",
+           (unsigned long)pg.hits, (unsigned long)pg.misses,
+           (unsigned long)(accesses ? (uint64_t)pg.hits * 100 / accesses : 0),
+           (unsigned long)(accesses ? (uint64_t)pg.hits * 1000 / accesses % 10 : 0),
+           (unsigned long long)pg.stall_us);
+    lfs_file_close(&g_lfs, &pg.fp);
+    pg.open = false;
+    script_fs_unmount();
+}
+
+// Read a whole file into the arena and split it into line views
+// ■ 変更: RAM に載らない場合はページ実行モードに切り替える
 static bool load_script_file(const char *filename, ScriptState &st)
 {
     st.lines.clear();
+    st.arena.reset();
     printf("load_script_file: opening '%s'\r\n", filename);
     tud_task();
 
-    int err = lfs_mount(&g_lfs, &lfs_pico_flash_config);
+    int err = script_fs_mount();
     if (err < 0)
         return false;
 
@@ -1895,7 +5640,7 @@ static bool load_script_file(const char *filename, ScriptState &st)
     int rc = lfs_file_open(&g_lfs, &fp, filename, LFS_O_RDONLY);
     if (rc < 0)
     {
-        lfs_unmount(&g_lfs);
+        script_fs_unmount();
         printf("load_script_file: failed to open '%s' (rc=%d)\r\n", filename, rc);
 
         // ファイルオープンエラーも通知
@@ -1907,57 +5652,68 @@ static bool load_script_file(const char *filename, ScriptState &st)
     lfs_soff_t file_size = lfs_file_size(&g_lfs, &fp);
     uint32_t free_mem = get_free_memory();
 
-    // 必要なメモリ概算: ファイル生データ + std::string/vectorのオーバーヘッド(約2倍と見積もる) + 安全マージン(4KB)
-    uint32_t estimated_req = (uint32_t)file_size * 2 + 4096;
+    // ■ 変更: 必要なメモリ概算: ファイル生データ (arena, 終端用 +1) + 安全マージン(4KB)
+    // 行ごとの std::string 確保が無くなったため、以前の「約2倍」の見積もりは不要。行テーブルは行数確定後に別途チェックする。
+    // 空き F バイトで全体を読み込めるファイルの大きさ S (L 行、RP2040 では string_view が 8 バイト):
+    //   以前: 2S + 4096 <= F                  -> S <= (F - 4096) / 2
+    //   現在: S + 1 + 4096 <= F かつ 8L + 4096 <= F - (S + 1) -> S + 8L <= F - 4097
+    //   平均 30 文字 (改行込み 31 バイト) の行なら S <= (F - 4097) * 31 / 39 ≒ 0.79 (F - 4097) (F = 100000 で 47952 -> 76230 バイト)
+    // コンパイル後の命令 (1 行 1 Instr) は見積もりに含まないので、実際の上限はこれより小さい。
+    uint32_t estimated_req = (uint32_t)file_size + 1 + 4096;
 
     if (free_mem < estimated_req)
     {
-        printf("load_script_file: File too large (%ld bytes), Free: %lu, Req: %lu\r\n", file_size, free_mem, estimated_req);
+        printf("load_script_file: File too large (%ld bytes), Free: %lu, Req: %lu -> paged mode\r\n", file_size, free_mem, estimated_req);
         lfs_file_close(&g_lfs, &fp);
-        lfs_unmount(&g_lfs);
-
-        char msg[64];
-        snprintf(msg, sizeof(msg), "Script too large (%ld bytes)", file_size);
-        SignalRuntimeError(msg, 0, filename, "Memory insufficient for load");
-        return false;
+        bool ok = open_paged_script(filename, st);
+        script_fs_unmount();
+        return ok;
     }
 
-    // read entire file into lines without using f_gets
-    char buf[256];
-    std::string accum;
-    int br = 0;
-
-    // 読み込み中のメモリ確保エラーも呼び出し元の try-catch で捕捉させる
-    while (true)
+    // ファイル全体を arena へ直接読み込む (読み込み中のメモリ確保エラーも呼び出し元の try-catch で捕捉させる)
+    st.arena.reset(new char[(size_t)file_size + 1]);
+    char *buf = st.arena.get();
+    size_t total = 0;
+    while (total < (size_t)file_size)
     {
-        br = (int)lfs_file_read(&g_lfs, &fp, buf, sizeof(buf));
+        size_t chunk = (size_t)file_size - total;
+        if (chunk > 4096)
+            chunk = 4096;
+        int br = (int)lfs_file_read(&g_lfs, &fp, buf + total, (lfs_size_t)chunk);
         if (br <= 0)
             break;
-        for (int i = 0; i < br; ++i)
-        {
-            char c = buf[i];
-            if (c == '\r')
-                continue;
-            if (c == '\n')
-            {
-                st.lines.emplace_back(accum + '\n');
-                accum.clear();
-            }
-            else
-            {
-                accum.push_back(c);
-            }
-        }
+        total += (size_t)br;
+        tud_task();
     }
-    if (!accum.empty())
+    lfs_file_close(&g_lfs, &fp);
+
+    // 行数を数えて行テーブルを一度だけ確保する
+    size_t line_count = 0;
+    for (size_t i = 0; i < total; ++i)
     {
-        st.lines.emplace_back(accum + '\n');
-        accum.clear();
+        if (buf[i] == '\n')
+            ++line_count;
     }
-    printf("load_script_file: loaded %zu lines from '%s'\r\n", st.lines.size(), filename);
+    if (total > 0 && buf[total - 1] != '\n')
+        ++line_count;
+
+    uint32_t table_req = (uint32_t)(line_count * sizeof(std::string_view)) + 4096;
+    free_mem = get_free_memory();
+    if (free_mem < table_req)
+    {
+        printf("load_script_file: Too many lines (%zu), Free: %lu, Req: %lu -> paged mode\r\n", line_count, free_mem, table_req);
+        st.arena.reset();
+        bool ok = open_paged_script(filename, st);
+        script_fs_unmount();
+        return ok;
+    }
+    script_fs_unmount();
+
+    st.lines.reserve(line_count);
+    split_lines_in_place(buf, total, st.lines);
+    st.line_count = st.lines.size();
+    printf("load_script_file: loaded %zu lines (%ld bytes) from '%s'\r\n", st.lines.size(), file_size, filename);
     tud_task();
-    lfs_file_close(&g_lfs, &fp);
-    lfs_unmount(&g_lfs);
     return true;
 }
 // 公開エントリポイント
@@ -1972,53 +5728,100 @@ bool ExecuteScript(const char *filename)
     ScriptState st;
     st.debug_exec = false;
     g_script_debug = st.debug_exec;
+    SystemLogBegin();
 
     // ■ 追加: スタックの事前予約 (16KB確保)
     // これにより実行中の再確保(realloc)が発生しなくなり、PANICを防げる
-    st.gosub_stack.reserve(MAX_STACK_DEPTH);
+    // ■ 変更: タスク表も予約し、tasks[0] をメインタスクとする
+    st.tasks.reserve(MAX_TASKS);
+    st.tasks.emplace_back();
+    st.tasks[0].alive = true;
+    st.tasks[0].gosub_stack.reserve(MAX_STACK_DEPTH);
+
+    // 最初の行で必ず完全チェックさせる
+    g_mem_budget = 0;
 
     if (!load_script_file(filename, st))
     {
         printf("ExecuteScript: failed to open '%s'\r\n", filename);
+        run_stats_end(st);
+        SystemLogEnd();
         g_script_debug = false;
         return false;
     }
 
     g_script_start_time = get_absolute_time();
     g_script_start_us = time_us_64();
+    const int32_t tail_us = g_timing.tail_us; // 較正値は次のスクリプトに引き継ぐ
+    g_timing = TimingStats();
+    g_timing.tail_us = tail_us;
 
+    st.end_flag = false;
+    g_script_arrays = &st.arrays;
+    g_running_script = &st;
     prepass_script(st);
+    compile_script(st);
+    // ■ 変更: メインタスクの時間軸はコンパイルの後から (プリパス・コンパイルの時間を最初の待機で取り戻さない)
+    st.tasks[0].anchor_us = time_us_64();
 
-    int pc = 0;
-    st.end_flag = false;
-    g_rand_engine.seed((uint64_t)to_ms_since_boot(g_script_start_time) ^ (uint64_t)(uintptr_t)filename);
+    // ■ 変更: 既定のエンジンに戻し、ROSC の乱数ビットから種を作る (Seed(n) で上書きできる)
+    g_rand_kind = RandEngineKind::XOSHIRO128;
+    rand_seed(rand_entropy_seed() ^ (uint64_t)(uintptr_t)filename);
+    if (SCRIPT_PROFILE)
+        profile_enable(st, true);
 
     try
     {
-        while (!st.end_flag && pc >= 0 && pc < (int)st.lines.size())
-        {
-            pc = execute_line(st, pc);
-        }
+        run_tasks(st);
     }
     catch (const std::bad_alloc &e)
     {
         // メモリ確保失敗 (Out of memory) を捕捉
-        const char *line_str = (st.current_line_index >= 0 && st.current_line_index < (int)st.lines.size())
-                                   ? st.lines[st.current_line_index].c_str()
-                                   : "Unknown";
+        const char *line_str = line_cstr(st, st.current_line_index, "Unknown");
         SignalRuntimeError("Out of Memory (std::bad_alloc)", st.current_line_index + 1, line_str, "System Halted");
     }
     catch (const std::exception &e)
     {
         // その他のC++例外
-        const char *line_str = (st.current_line_index >= 0 && st.current_line_index < (int)st.lines.size())
-                                   ? st.lines[st.current_line_index].c_str()
-                                   : "Unknown";
+        const char *line_str = line_cstr(st, st.current_line_index, "Unknown");
         SignalRuntimeError("System Exception", st.current_line_index + 1, line_str, e.what());
     }
 
+    stop_events();
+    SystemLogEnd(); // 溜まっているログを書き切る (マウントはログと共有しているので、以下の書き込みと食い違わない)
+    write_profile(st, filename, time_us_64() - g_script_start_us); // ページ実行モードの行テキストはキャッシュにあるものだけ
+    write_trace(st);
+    close_paged_script(st);
+
+    // ■ 追加: オプティマイザの効果 (DEBUG 時は log.txt にも残る)
+    if (!st.paged)
+    {
+        printf("optimizer: %lu evaluations eliminated (%lu memo reuses, %lu folded), %lu memo recomputes\r\n",
+               (unsigned long)(st.opt_memo_hits + st.opt_folded_evals), (unsigned long)st.opt_memo_hits,
+               (unsigned long)st.opt_folded_evals, (unsigned long)st.opt_memo_evals);
+    }
+    if (st.num_mode != NumMode::DOUBLE)
+    {
+        printf("Numeric(%s): %lu expressions native, %lu via tinyexpr\r\n", st.num_mode == NumMode::FLOAT32 ? "FLOAT32" : "FIXED16_16",
+               (unsigned long)st.num_native_exprs, (unsigned long)st.num_fallback_exprs);
+    }
+
+    // ■ 追加: 待機の精度
+    if (g_timing.waits)
+    {
+        printf("timing: %lu waits, overshoot avg %lu us / max %lu us, %lu waits >= 100 us late (tail %ld us)\r\n",
+               (unsigned long)g_timing.waits, (unsigned long)(g_timing.overshoot_sum_us / g_timing.waits),
+               (unsigned long)g_timing.overshoot_max_us, (unsigned long)g_timing.late_100us, (long)g_timing.tail_us);
+    }
+
+    uint64_t elapsed_us = time_us_64() - g_script_start_us;
+    printf("ExecuteScript: %lu lines in %llu us (%llu lines/s)\r\n", (unsigned long)st.executed_count,
+           (unsigned long long)elapsed_us, elapsed_us ? (unsigned long long)st.executed_count * 1000000ull / elapsed_us : 0ull);
     printf("ExecuteScript: finished '%s'\r\n", filename);
+    run_stats_end(st);
     tud_task();
     g_script_debug = false;
+    g_script_arrays = nullptr;
+    g_running_script = nullptr;
     return true;
 }
\ No newline at end of file
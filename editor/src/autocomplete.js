@@ -39,11 +39,11 @@ export function checkAutocomplete(inputEl, acList) {
     if (contextCmd && AC_CONSTANTS[contextCmd]) {
         candidates = AC_CONSTANTS[contextCmd].filter(c => c.startsWith(word.toUpperCase()));
     } else {
-        // Global AC (Labels for GOTO/GOSUB)
+        // Global AC (Labels for GOTO/GOSUB/SPAWN)
         // Check if previous word is GOTO or GOSUB
         let lineStart = text.lastIndexOf('\n', start - 1) + 1;
         let linePrefix = text.substring(lineStart, start).trim().toUpperCase();
-        if (linePrefix.endsWith("GOTO") || linePrefix.endsWith("GOSUB") || linePrefix.includes("GOTO ")) {
+        if (linePrefix.endsWith("GOTO") || linePrefix.endsWith("GOSUB") || linePrefix.endsWith("SPAWN") || linePrefix.includes("GOTO ")) {
             candidates = Array.from(state.definedLabels.keys()).filter(l => l.toUpperCase().startsWith(word.toUpperCase()));
         }
     }
@@ -1,14 +1,15 @@
 export const COMMANDS = [
-    "LABEL", "GOTO", "IF", "GOSUB", "RETURN", "WAIT", "END",
-    "SET", "PRINT", "DEBUG", "REM", "LogConfig",
-    "Mode", "UseLED", "SetLED",
+    "LABEL", "GOTO", "IF", "GOSUB", "RETURN", "WAIT", "WAITUS", "WAITUNTIL", "AT", "END", "SPAWN", "JOIN", "ON", "EVERY",
+    "FOR", "NEXT", "WHILE", "WEND", "ELSE", "ENDIF",
+    "SET", "SETI", "DIM", "LoadTable", "PRINT", "DEBUG", "PROFILE", "REM", "LogConfig",
+    "Mode", "UseLED", "SetLED", "Numeric", "Seed", "RandEngine", "TimingResync",
     "KeyPress", "KeyRelease", "KeyPushFor", "KeyType",
     "MouseMove", "MousePress", "MouseRelease", "MousePushFor", "Mouserun",
     "ProConPress", "ProConRelease", "ProConPushFor", "ProConHat", "ProConJoy"
 ];
 
 export const BUILTIN_FUNCS = new Set([
-    "ispressed", "rand", "gettime",
+    "ispressed", "rand", "randint", "randnormal", "gettime", "gettimeus",
     "abs", "acos", "asin", "atan", "atan2", "ceil", "clamp", "cos", "cosh", "cot",
     "deg2rad", "e", "exp", "floor", "ln", "log10", "max", "min", "mod", "pi",
     "pow", "power", "rad2deg", "round", "sign", "sin", "sinh", "sqr", "sqrt",
@@ -22,6 +23,8 @@ export const AC_CONSTANTS = {
     "MouseRelease": ["LEFT", "RIGHT", "MIDDLE"],
     "MousePushFor": ["LEFT", "RIGHT", "MIDDLE"],
     "Mode": ["KeyMouse", "ProController"],
+    "Numeric": ["DOUBLE", "FLOAT32", "FIXED16_16"],
+    "RandEngine": ["XOSHIRO128", "MT19937"],
     "ProConPress": ["A", "B", "X", "Y", "L", "R", "ZL", "ZR", "MINUS", "PLUS", "HOME", "CAPTURE", "LCLICK", "RCLICK", "UP", "DOWN", "LEFT", "RIGHT"],
     "ProConRelease": ["A", "B", "X", "Y", "L", "R", "ZL", "ZR", "MINUS", "PLUS", "HOME", "CAPTURE", "LCLICK", "RCLICK"],
     "ProConPushFor": ["A", "B", "X", "Y", "L", "R", "ZL", "ZR", "MINUS", "PLUS", "HOME", "CAPTURE", "LCLICK", "RCLICK"],
@@ -80,7 +83,7 @@ export const AC_CONSTANTS = {
 };
 // LogConfigの第2引数用定数 (AC_CONSTANTSのキーとして登録されていないためここで定義して補完には出ないがバリデーション用として考慮するか、あるいはAC_CONSTANTSに追加するか)
 // 簡易的に定数セットを作っておきます
-export const LOG_CONSTANTS = ["OVERWRITE", "STOP"];
+export const LOG_CONSTANTS = ["OVERWRITE", "STOP", "TEXT", "BINARY"];
 
 // Build VALID_CONSTANTS from all values in AC_CONSTANTS, converting to uppercase
 export const VALID_CONSTANTS = new Set(
@@ -91,6 +94,8 @@ export const VALID_CONSTANTS = new Set(
 // Types: "constant" = only specific constants, "string" = only string literals, "expr" = any expression, "key" = constant/char/string
 export const COMMAND_ARG_TYPES = {
     "Mode": ["constant"],           // Mode(KeyMouse) or Mode(ProController)
+    "Numeric": ["constant"],        // Numeric(FLOAT32)
+    "RandEngine": ["constant"],     // RandEngine(MT19937)
     "MousePress": ["constant"],     // MousePress(LEFT)
     "MouseRelease": ["constant"],   // MouseRelease(RIGHT)
     "MousePushFor": ["constant", "expr"],  // MousePushFor(LEFT, 100)
@@ -105,5 +110,6 @@ export const COMMAND_ARG_TYPES = {
     "KeyPushFor": ["key", "expr"],
     
     "KeyType": ["string", "expr", "expr"],
-    "LogConfig": ["expr", "constant_custom"] // custom handler for LogConfig
+    "LoadTable": ["string", "expr", "expr"],
+    "LogConfig": ["expr", "constant_custom", "constant_custom"] // custom handler for LogConfig
 };
\ No newline at end of file
@@ -22,14 +22,30 @@ export function analyzeCode(text) {
             const p = t.split(/\s+/);
             if (p[1]) state.definedLabels.set(p[1], i + 1);
         }
-        if (t.toUpperCase().startsWith('SET')) {
+        const up = t.toUpperCase();
+        if (up.startsWith('SET') || /^FOR\s/.test(up)) {
             const eq = t.indexOf('=');
-            if (eq > 3) {
-                const v = t.substring(3, eq).trim();
+            const kwLen = /^SETI\s/.test(up) ? 4 : 3;
+            if (eq > kwLen) {
+                const v = t.substring(kwLen, eq).trim();
                 const vName = v.split(/\s+/)[0];
                 if (!state.definedVars.has(vName)) state.definedVars.set(vName, i + 1);
             }
         }
+        // DIM name(size) / LoadTable("file", name, count) で作られる配列と変数
+        const dim = t.match(/^DIM\s+([a-zA-Z_][a-zA-Z0-9_]*)\s*\(/i);
+        if (dim && !state.definedVars.has(dim[1])) state.definedVars.set(dim[1], i + 1);
+        const lt = t.match(/^LoadTable\s*\(\s*"[^"]*"\s*,\s*([a-zA-Z_][a-zA-Z0-9_]*)\s*(?:,\s*([a-zA-Z_][a-zA-Z0-9_]*))?/i);
+        if (lt) {
+            if (!state.definedVars.has(lt[1])) state.definedVars.set(lt[1], i + 1);
+            if (lt[2] && !state.definedVars.has(lt[2])) state.definedVars.set(lt[2], i + 1);
+        }
+        // WAITUNTIL cond, timeout, poll, result の結果を受け取る変数
+        if (/^WAITUNTIL\s/i.test(t)) {
+            const wu = splitArguments(t.substring(9));
+            const rv = wu.length === 4 ? wu[3].trim() : "";
+            if (/^[a-zA-Z_][a-zA-Z0-9_]*$/.test(rv) && !state.definedVars.has(rv)) state.definedVars.set(rv, i + 1);
+        }
     });
 
     // Pass 2: Rendering
@@ -142,7 +158,7 @@ function renderLine(line, cmdPure, lineStartIndex) {
         let args = restRaw;
         let argsGlobalStart = lineStartIndex + restStartIdx;
 
-        if (cmdPure === "SET") {
+        if (cmdPure === "SET" || cmdPure === "SETI") {
             const eq = args.indexOf('=');
             if (eq !== -1) {
                 const vPart = args.substring(0, eq);
@@ -163,31 +179,95 @@ function renderLine(line, cmdPure, lineStartIndex) {
                 html += `<span class="other">${escapeHtml(args)}</span>`;
                 if (!error) error = "= が必要です";
             }
-        } else if (cmdPure === "GOTO" || cmdPure === "GOSUB") {
+        } else if (cmdPure === "GOTO" || cmdPure === "GOSUB" || cmdPure === "SPAWN") {
             const lbl = args.trim();
             html += `<span class="label-ref">${escapeHtml(args)}</span>`;
             if (!state.definedLabels.has(lbl) && !error) error = "未定義ラベル";
+        } else if (cmdPure === "ON" || cmdPure === "EVERY") {
+            // ON PRESS|RELEASE GOSUB <label> / ON PRESS|RELEASE OFF / EVERY <sec> GOSUB <label>
+            const m = args.match(/^(.*?)\bGOSUB\b(.*)$/i);
+            if (cmdPure === "ON" && /^\s*(PRESS|RELEASE)\s+OFF\s*$/i.test(args)) {
+                html += `<span class="arg">${escapeHtml(args)}</span>`;
+            } else if (m) {
+                if (cmdPure === "ON") {
+                    html += `<span class="arg">${escapeHtml(m[1])}</span>`;
+                    if (!/^\s*(PRESS|RELEASE)\s*$/i.test(m[1]) && !error) error = "ON PRESS または ON RELEASE を指定してください";
+                } else {
+                    html += colorizeArgs(m[1], argsGlobalStart);
+                    const err = validateExpr(m[1]);
+                    if (err && !error) error = err;
+                }
+                html += `<span class="func">${escapeHtml(args.substr(m[1].length, 5))}</span>`;
+                html += `<span class="label-ref">${escapeHtml(m[2])}</span>`;
+                if (!state.definedLabels.has(m[2].trim()) && !error) error = "未定義ラベル";
+            } else {
+                html += colorizeArgs(args, argsGlobalStart);
+                if (!error) error = cmdPure === "ON" ? "ON PRESS|RELEASE GOSUB ラベル の形式で記述してください" : "EVERY 秒 GOSUB ラベル の形式で記述してください";
+            }
         } else if (cmdPure === "IF") {
             const gt = args.toUpperCase().indexOf("GOTO");
+            const thenM = args.match(/\bTHEN\s*$/i);
             if (gt !== -1) {
-                const expr = args.substring(0, gt);
+                let expr = args.substring(0, gt);
+                const thenG = expr.match(/\bTHEN\s*$/i);
+                if (thenG) expr = expr.substring(0, thenG.index);
                 const lblPart = args.substring(gt + 4);
                 html += colorizeArgs(expr, argsGlobalStart);
+                if (thenG) html += `<span class="func">${escapeHtml(args.substring(thenG.index, gt))}</span>`;
                 html += `<span class="func">GOTO</span>`;
                 html += `<span class="label-ref">${escapeHtml(lblPart)}</span>`;
 
                 const err = validateExpr(expr);
                 if (err && !error) error = err;
                 if (!state.definedLabels.has(lblPart.trim()) && !error) error = "未定義ラベル";
+            } else if (thenM) {
+                // ブロック IF (IF <expr> THEN ... ELSE ... ENDIF)
+                const expr = args.substring(0, thenM.index);
+                html += colorizeArgs(expr, argsGlobalStart);
+                html += `<span class="func">${escapeHtml(args.substring(thenM.index))}</span>`;
+                const err = validateExpr(expr);
+                if (err && !error) error = err;
+            } else {
+                html += colorizeArgs(args, argsGlobalStart);
+                if (!error) error = "GOTO または THEN が必要です";
+            }
+        } else if (cmdPure === "FOR") {
+            // FOR <var> = <start> TO <limit> [STEP <step>]
+            const m = args.match(/^(\s*[a-zA-Z_][a-zA-Z0-9_]*\s*)=(.*?)\bTO\b(.*?)(?:\bSTEP\b(.*))?$/i);
+            if (m) {
+                html += `<span class="var">${escapeHtml(m[1])}</span><span class="func">=</span>`;
+                const p2 = m[1].length + 1;
+                const p3 = p2 + m[2].length + 2;
+                const p4 = p3 + m[3].length + 4;
+                html += colorizeArgs(m[2], argsGlobalStart + p2);
+                html += `<span class="func">${escapeHtml(args.substr(p3 - 2, 2))}</span>` + colorizeArgs(m[3], argsGlobalStart + p3);
+                if (m[4] !== undefined) html += `<span class="func">${escapeHtml(args.substr(p4 - 4, 4))}</span>` + colorizeArgs(m[4], argsGlobalStart + p4);
+                for (const part of [m[2], m[3], m[4]]) {
+                    if (part === undefined) continue;
+                    const err = validateExpr(part);
+                    if (err && !error) error = err;
+                }
             } else {
                 html += colorizeArgs(args, argsGlobalStart);
-                if (!error) error = "GOTO が必要です";
+                if (!error) error = "FOR 変数 = 開始 TO 終了 [STEP 増分] の形式で記述してください";
+            }
+        } else if (cmdPure === "WAITUNTIL") {
+            // WAITUNTIL <cond>, <timeout>, <poll>[, <var>]
+            html += colorizeArgs(args, argsGlobalStart);
+            const parts = splitArguments(args);
+            if (parts.length < 3 || parts.length > 4) {
+                if (!error) error = "WAITUNTIL 条件, タイムアウト秒, 間隔秒[, 結果変数] の形式で記述してください";
+            } else {
+                for (const part of parts.slice(0, 3)) {
+                    const err = validateExpr(part);
+                    if (err && !error) error = err;
+                }
             }
         } else if (cmdPure === "LABEL") {
             html += `<span class="label-def">${escapeHtml(args)}</span>`;
         } else {
             html += colorizeArgs(args, argsGlobalStart);
-            if (cmdPure === "WAIT") {
+            if (cmdPure === "WAIT" || cmdPure === "WAITUS" || cmdPure === "AT" || cmdPure === "WHILE") {
                 const err = validateExpr(args);
                 if (err && !error) error = err;
             }
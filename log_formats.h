@@ -0,0 +1,106 @@
+#pragma once
+// ■ 追加: バイナリログ (LogConfig(..., BINARY)) の書式表
+// ファームウェアは書式を整形せず「書式番号・時刻・引数の生の値」だけを log.bin に書き、
+// ホスト側の tools/log_decode.cpp が同じ表を使ってテキストに戻す。
+// 書式を追加するときは末尾に足すこと (番号が変わると古い log.bin を読めなくなる)。
+//
+// log.bin の形式 (リトルエンディアン)
+//   ファイル先頭: "PLOG" , 版 (1 バイト), 予約 (1 バイト), 書式の数 (2 バイト)
+//   レコード    : 書式番号 (1 バイト), 前のレコードからの経過 ms (varint), 引数...
+//   引数        : 整数      -> zigzag varint
+//                 浮動小数  -> 整数値なら (zigzag << 1) の varint、それ以外は varint 1 の後に double の 8 バイト
+//                 文字列    -> 長さ (1 バイト) + 本体
+//   LOGF_SYNC は経過 ms の代わりに起動からの ms を 4 バイトで持ち、書き込みのまとまりごとに先頭に置かれる。
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_FORMAT_LIST(X)                                        \
+    X(LOGF_SYNC, "")                                              \
+    X(LOGF_TEXT, "%s")                                            \
+    X(LOGF_PRINT, "PRINT: %.10g\r\n")                             \
+    X(LOGF_AT_LATE, "AT: %lld us late\r\n")                       \
+    X(LOGF_KEYTYPE_CHAR, "KeyType: emit char '%c' (0x%02X)\r\n")  \
+    X(LOGF_DIM, "DIM: array %d = %u elements\r\n")                \
+    X(LOGF_SPAWN, "SPAWN: task %d at line %d\r\n")                \
+    X(LOGF_EVENT_SET, "%s: event %d -> line %d\r\n")              \
+    X(LOGF_USB_STATUS, "DBG: g_usb_mode=%d tud_mounted=%d tud_hid_ready=%d tud_suspended=%d\r\n")
+
+enum LogFormatId : uint8_t
+{
+#define LOG_FORMAT_ID(id, fmt) id,
+    LOG_FORMAT_LIST(LOG_FORMAT_ID)
+#undef LOG_FORMAT_ID
+    LOGF_COUNT
+};
+
+static const char *const kLogFormats[LOGF_COUNT] = {
+#define LOG_FORMAT_STR(id, fmt) fmt,
+    LOG_FORMAT_LIST(LOG_FORMAT_STR)
+#undef LOG_FORMAT_STR
+};
+
+static const char kLogBinMagic[4] = {'P', 'L', 'O', 'G'};
+static const uint8_t kLogBinVersion = 1;
+
+enum class LogArg : uint8_t
+{
+    NONE,
+    INT32,
+    INT64,
+    DOUBLE,
+    STRING
+};
+
+// 書式の次の変換指定の種類を返し、p をその直後に進める。spec には '%' の位置を入れる ('%%' は飛ばす)
+// '*' による幅・精度の指定には対応しない
+static inline LogArg log_next_arg(const char *&p, const char **spec = nullptr)
+{
+    while (*p)
+    {
+        if (*p != '%')
+        {
+            ++p;
+            continue;
+        }
+        const char *begin = p++;
+        if (*p == '%')
+        {
+            ++p;
+            continue;
+        }
+        while (*p && strchr("-+ #0", *p))
+            ++p;
+        while ((*p >= '0' && *p <= '9') || *p == '.')
+            ++p;
+        int longs = 0;
+        while (*p == 'l' || *p == 'h' || *p == 'z' || *p == 'j' || *p == 't')
+            longs += (*p++ == 'l');
+        const char c = *p ? *p++ : '\0';
+        if (spec)
+            *spec = begin;
+        switch (c)
+        {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+        case 'p':
+            return longs >= 2 ? LogArg::INT64 : LogArg::INT32; // RP2040 では long / size_t は 32 ビット
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+            return LogArg::DOUBLE;
+        case 's':
+            return LogArg::STRING;
+        default:
+            break;
+        }
+    }
+    return LogArg::NONE;
+}
@@ -0,0 +1,12 @@
+#pragma once
+// ■ 追加: 直前の ExecuteScript の実行統計 (ホストのベンチマーク sim/bench_main.cpp が読む)
+// ヒープの統計はインタプリタでは取らない (ホストでは sim/hal/sim_heap.cpp が operator new / delete を数える)
+#include <stdint.h>
+
+struct ScriptRunStats
+{
+    uint64_t statements; // 実行した文の数 (待機からの再開も 1 回と数える)
+    uint64_t evals;      // eval_expression の呼び出し回数
+};
+
+void ScriptGetRunStats(ScriptRunStats *out);
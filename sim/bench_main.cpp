@@ -0,0 +1,323 @@
+// インタプリタのベンチマーク: 同梱のサンプルスクリプトを仮想時計 (待ちは即座に終わる) で実行し、
+// 文/秒・eval_expression 呼び出し/秒・ヒープの最大使用量・1 文あたりの確保回数を測る。
+// 結果は JSON / CSV で書き出すので、ScriptProcessor.cpp の性能の変化を記録して比べられる。
+//
+// usage: pico_bench [options] [name=script.txt[,file...] ...]
+//   スクリプトを省略すると同梱のサンプル (kSamples) を実行する
+//   -n, --repeat N        各スクリプトを N 回実行し、最も速かった回を採る (既定 3)
+//   -t, --time-limit SEC  仮想時計で SEC 秒を過ぎたら止める (終わらないスクリプト用。既定 60、rainbow は 2)
+//       --json PATH       結果を JSON で書く ("-" なら標準出力。--json も --csv も無ければ標準出力に JSON)
+//       --csv PATH        結果を CSV で書く
+//       --label TEXT      結果に付ける名前 (コミット名など)
+//   -i, --image PATH      フラッシュの像 (既定 pico_bench.img。実行のたびにフォーマットする)
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include "pico/stdlib.h"
+#include "script_stats.h"
+#include "hal/sim_hal.h"
+
+extern bool ExecuteScript(const char *filename);
+extern "C" void ScriptRequestStop();
+
+#ifndef SIM_SAMPLES_DIR
+#define SIM_SAMPLES_DIR "."
+#endif
+
+struct BenchCase
+{
+    std::string name;
+    std::vector<std::string> files;    // 先頭が実行するスクリプト、残りはスクリプトが読むファイル
+    uint32_t button_period_ms = 0;     // 0 以外なら、この周期で BOOTSEL を 100 ms 押す
+    double time_limit_s = 0;           // 0 なら --time-limit の値
+};
+
+// 同梱のサンプル。mouserun_stream.txt は Mouserun のデータなので mouserun_play.txt から再生する
+// rainbow は WAIT の無い無限ループで、仮想時計では 1 秒でも数百万文になるため短く打ち切る
+static const struct
+{
+    const char *name;
+    const char *script;
+    const char *data;
+    uint32_t button_period_ms;
+    double time_limit_s;
+} kSamples[] = {
+    {"spirograph", "spirograph.txt", nullptr, 0, 0},
+    {"rainbow", "rainbow.txt", nullptr, 0, 2},
+    {"circle_mouse", "circle_mouse.txt", nullptr, 0, 0},
+    {"gosub_test", "gosub_test.txt", nullptr, 5000, 0},
+    {"mouserun_stream", "mouserun_play.txt", "mouserun_stream.txt", 0, 0},
+    {"key_test", "key_test.txt", nullptr, 0, 0},
+};
+
+struct BenchResult
+{
+    std::string name;
+    std::string status; // finished / time_limit / error
+    double wall_us = 0;
+    uint64_t virtual_us = 0;
+    unsigned long hid_reports = 0;
+    ScriptRunStats stats = {};
+    // ヒープ (sim_heap.cpp が ExecuteScript の前後で数えた値)
+    uint64_t allocs = 0;
+    uint64_t alloc_bytes = 0;
+    size_t heap_base = 0; // 開始時に確保中だったバイト数
+    size_t heap_peak = 0; // 実行中に確保中だったバイト数の最大
+};
+
+static bool g_time_limit_hit = false;
+
+static void on_time_limit()
+{
+    g_time_limit_hit = true;
+    ScriptRequestStop();
+}
+
+static bool run_once(const BenchCase &c, const char *image, double time_limit_s, BenchResult &r)
+{
+    if (c.time_limit_s > 0)
+        time_limit_s = c.time_limit_s;
+    std::vector<const char *> paths;
+    for (const std::string &f : c.files)
+        paths.push_back(f.c_str());
+    if (!sim_flash_open(image) || !sim_flash_import(paths, true))
+        return false;
+
+    sim_button_clear();
+    if (c.button_period_ms)
+    {
+        const uint64_t period_us = (uint64_t)c.button_period_ms * 1000;
+        for (uint64_t t = period_us; t < (uint64_t)(time_limit_s * 1e6); t += period_us)
+            sim_button_add(t, t + 100000);
+    }
+    sim_clear_runtime_error();
+    g_time_limit_hit = false;
+    sim_clock_reset(true);
+    sim_clock_set_limit((uint64_t)(time_limit_s * 1e6), on_time_limit);
+    const unsigned long reports = sim_hid_report_count();
+
+    sim_heap_reset_peak();
+    const SimHeapStats h0 = sim_heap_stats();
+    const auto t0 = std::chrono::steady_clock::now();
+    const bool ok = ExecuteScript(sim_base_name(paths[0]));
+    const auto t1 = std::chrono::steady_clock::now();
+    const SimHeapStats h1 = sim_heap_stats();
+
+    r.name = c.name;
+    r.status = (!ok || sim_runtime_error_seen()) ? "error" : (g_time_limit_hit ? "time_limit" : "finished");
+    r.wall_us = std::chrono::duration<double, std::micro>(t1 - t0).count();
+    r.virtual_us = sim_now_us();
+    r.hid_reports = sim_hid_report_count() - reports;
+    ScriptGetRunStats(&r.stats);
+    r.allocs = h1.allocs - h0.allocs;
+    r.alloc_bytes = h1.bytes - h0.bytes;
+    r.heap_base = h0.live;
+    r.heap_peak = h1.peak;
+    sim_clock_set_limit(UINT64_MAX, nullptr);
+    sim_flash_close();
+    return true;
+}
+
+static double per_sec(uint64_t n, double wall_us)
+{
+    return wall_us > 0 ? (double)n * 1e6 / wall_us : 0.0;
+}
+
+static std::string json_escape(const std::string &s)
+{
+    std::string out;
+    for (char ch : s)
+    {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        if ((unsigned char)ch >= 0x20)
+            out += ch;
+    }
+    return out;
+}
+
+static void write_json(FILE *fp, const std::string &label, int repeat, double time_limit_s, const std::vector<BenchResult> &results)
+{
+    fprintf(fp, "{\n  \"format\": 1,\n  \"label\": \"%s\",\n  \"repeat\": %d,\n  \"time_limit_s\": %g,\n  \"results\": [\n",
+            json_escape(label).c_str(), repeat, time_limit_s);
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult &r = results[i];
+        const ScriptRunStats &s = r.stats;
+        fprintf(fp,
+                "    {\"name\": \"%s\", \"status\": \"%s\", \"wall_us\": %.0f, \"virtual_ms\": %llu, "
+                "\"statements\": %llu, \"statements_per_sec\": %.0f, \"evals\": %llu, \"evals_per_sec\": %.0f, "
+                "\"allocs\": %llu, \"allocs_per_statement\": %.4f, \"alloc_bytes\": %llu, "
+                "\"heap_base_bytes\": %lu, \"heap_peak_bytes\": %lu, \"hid_reports\": %lu}%s\n",
+                json_escape(r.name).c_str(), r.status.c_str(), r.wall_us, (unsigned long long)(r.virtual_us / 1000),
+                (unsigned long long)s.statements, per_sec(s.statements, r.wall_us), (unsigned long long)s.evals,
+                per_sec(s.evals, r.wall_us), (unsigned long long)r.allocs,
+                s.statements ? (double)r.allocs / (double)s.statements : 0.0, (unsigned long long)r.alloc_bytes,
+                (unsigned long)r.heap_base, (unsigned long)r.heap_peak, r.hid_reports, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+static void write_csv(FILE *fp, const std::string &label, const std::vector<BenchResult> &results)
+{
+    fprintf(fp, "label,name,status,wall_us,virtual_ms,statements,statements_per_sec,evals,evals_per_sec,"
+                "allocs,allocs_per_statement,alloc_bytes,heap_base_bytes,heap_peak_bytes,hid_reports\n");
+    for (const BenchResult &r : results)
+    {
+        const ScriptRunStats &s = r.stats;
+        fprintf(fp, "%s,%s,%s,%.0f,%llu,%llu,%.0f,%llu,%.0f,%llu,%.4f,%llu,%lu,%lu,%lu\n", label.c_str(), r.name.c_str(),
+                r.status.c_str(), r.wall_us, (unsigned long long)(r.virtual_us / 1000), (unsigned long long)s.statements,
+                per_sec(s.statements, r.wall_us), (unsigned long long)s.evals, per_sec(s.evals, r.wall_us),
+                (unsigned long long)r.allocs, s.statements ? (double)r.allocs / (double)s.statements : 0.0,
+                (unsigned long long)r.alloc_bytes, (unsigned long)r.heap_base, (unsigned long)r.heap_peak, r.hid_reports);
+    }
+}
+
+static bool write_file(const char *path, const std::function<void(FILE *)> &body)
+{
+    FILE *fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "bench: cannot create %s\n", path);
+        return false;
+    }
+    body(fp);
+    if (fp != stdout)
+        fclose(fp);
+    return true;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options] [name=script.txt[,file...] ...]\n"
+            "  -n, --repeat N        runs per script, the fastest is reported (default 3)\n"
+            "  -t, --time-limit SEC  stop a script after SEC seconds of virtual time (default 60)\n"
+            "      --json PATH       write JSON results (\"-\" for stdout, the default)\n"
+            "      --csv PATH        write CSV results\n"
+            "      --label TEXT      label stored with the results\n"
+            "  -i, --image PATH      scratch flash image (default pico_bench.img)\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    int repeat = 3;
+    double time_limit_s = 60;
+    const char *json_path = nullptr;
+    const char *csv_path = nullptr;
+    const char *image = "pico_bench.img";
+    std::string label;
+    std::vector<BenchCase> cases;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *a = argv[i];
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(2);
+            }
+            return argv[++i];
+        };
+        if (!strcmp(a, "-n") || !strcmp(a, "--repeat"))
+            repeat = std::max(1, atoi(value()));
+        else if (!strcmp(a, "-t") || !strcmp(a, "--time-limit"))
+            time_limit_s = atof(value());
+        else if (!strcmp(a, "--json"))
+            json_path = value();
+        else if (!strcmp(a, "--csv"))
+            csv_path = value();
+        else if (!strcmp(a, "--label"))
+            label = value();
+        else if (!strcmp(a, "-i") || !strcmp(a, "--image"))
+            image = value();
+        else if (a[0] == '-')
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        else
+        {
+            // name=script.txt,data.csv (name= は省略可)
+            BenchCase c;
+            std::string spec = a;
+            const size_t eq = spec.find('=');
+            if (eq != std::string::npos)
+            {
+                c.name = spec.substr(0, eq);
+                spec = spec.substr(eq + 1);
+            }
+            for (size_t pos = 0; pos <= spec.size();)
+            {
+                const size_t comma = std::min(spec.find(',', pos), spec.size());
+                if (comma > pos)
+                    c.files.push_back(spec.substr(pos, comma - pos));
+                pos = comma + 1;
+            }
+            if (c.files.empty())
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            if (c.name.empty())
+                c.name = sim_base_name(c.files[0].c_str());
+            cases.push_back(c);
+        }
+    }
+    if (cases.empty())
+    {
+        for (const auto &s : kSamples)
+        {
+            BenchCase c;
+            c.name = s.name;
+            c.files.push_back(std::string(SIM_SAMPLES_DIR) + "/" + s.script);
+            if (s.data)
+                c.files.push_back(std::string(SIM_SAMPLES_DIR) + "/" + s.data);
+            c.button_period_ms = s.button_period_ms;
+            c.time_limit_s = s.time_limit_s;
+            cases.push_back(c);
+        }
+    }
+
+    sim_log_quiet(true);
+    std::vector<BenchResult> results;
+    bool ok = true;
+    for (const BenchCase &c : cases)
+    {
+        BenchResult best;
+        for (int k = 0; k < repeat; ++k)
+        {
+            BenchResult r;
+            if (!run_once(c, image, time_limit_s, r))
+            {
+                fprintf(stderr, "bench: %s: cannot set up the flash image\n", c.name.c_str());
+                return 1;
+            }
+            if (k == 0 || r.wall_us < best.wall_us)
+                best = r;
+        }
+        ok = ok && best.status != "error";
+        const ScriptRunStats &s = best.stats;
+        fprintf(stderr, "%-16s %-10s %9.1f ms %11.0f stmt/s %11.0f eval/s %7.3f alloc/stmt  heap peak %7lu B\n",
+                best.name.c_str(), best.status.c_str(), best.wall_us / 1000, per_sec(s.statements, best.wall_us),
+                per_sec(s.evals, best.wall_us), s.statements ? (double)best.allocs / (double)s.statements : 0.0,
+                (unsigned long)best.heap_peak);
+        results.push_back(best);
+    }
+
+    if (!json_path && !csv_path)
+        json_path = "-";
+    if (json_path && !write_file(json_path, [&](FILE *fp) { write_json(fp, label, repeat, time_limit_s, results); }))
+        ok = false;
+    if (csv_path && !write_file(csv_path, [&](FILE *fp) { write_csv(fp, label, results); }))
+        ok = false;
+    return ok ? 0 : 1;
+}
+
@@ -0,0 +1,6 @@
+# Run by the timing target before anything else (cmake -DGOLDEN=<file> -P check_golden.cmake):
+# stop with a clear message instead of letting hid_timing fail on a missing golden trace
+if (NOT EXISTS "${GOLDEN}")
+    message(FATAL_ERROR "Golden trace ${GOLDEN} is missing.\n"
+        "Record it first on the baseline commit: cmake --build <build-dir> --target golden")
+endif()
@@ -0,0 +1,94 @@
+#pragma once
+// ホスト用シミュレータの TinyUSB_Mouse_and_Keyboard.h
+// API とキーコードはライブラリ (Arduino の Keyboard / Mouse 互換) と同じ。
+// 押す・離す・動かすたびに送るはずのレポートを HID の記録 (sim_hid.cpp) に書く。
+#include <stdint.h>
+#include <stddef.h>
+
+#define MOUSE_LEFT 1
+#define MOUSE_RIGHT 2
+#define MOUSE_MIDDLE 4
+#define MOUSE_ALL (MOUSE_LEFT | MOUSE_RIGHT | MOUSE_MIDDLE)
+
+#define KEY_LEFT_CTRL 0x80
+#define KEY_LEFT_SHIFT 0x81
+#define KEY_LEFT_ALT 0x82
+#define KEY_LEFT_GUI 0x83
+#define KEY_RIGHT_CTRL 0x84
+#define KEY_RIGHT_SHIFT 0x85
+#define KEY_RIGHT_ALT 0x86
+#define KEY_RIGHT_GUI 0x87
+
+#define KEY_UP_ARROW 0xDA
+#define KEY_DOWN_ARROW 0xD9
+#define KEY_LEFT_ARROW 0xD8
+#define KEY_RIGHT_ARROW 0xD7
+#define KEY_BACKSPACE 0xB2
+#define KEY_TAB 0xB3
+#define KEY_RETURN 0xB0
+#define KEY_ESC 0xB1
+#define KEY_INSERT 0xD1
+#define KEY_DELETE 0xD4
+#define KEY_PAGE_UP 0xD3
+#define KEY_PAGE_DOWN 0xD6
+#define KEY_HOME 0xD2
+#define KEY_END 0xD5
+#define KEY_CAPS_LOCK 0xC1
+#define KEY_PRINT_SCREEN 0xCE
+#define KEY_SCROLL_LOCK 0xCF
+#define KEY_PAUSE 0xD0
+#define KEY_NUM_LOCK 0xDB
+#define KEY_F1 0xC2
+#define KEY_F2 0xC3
+#define KEY_F3 0xC4
+#define KEY_F4 0xC5
+#define KEY_F5 0xC6
+#define KEY_F6 0xC7
+#define KEY_F7 0xC8
+#define KEY_F8 0xC9
+#define KEY_F9 0xCA
+#define KEY_F10 0xCB
+#define KEY_F11 0xCC
+#define KEY_F12 0xCD
+#define KEY_HENKAN 0xE0
+#define KEY_MUHENKAN 0xE1
+#define KEY_ZENKAKU_HANKAKU 0xE2
+#define KEY_KATAKANA_HIRAGANA 0xE3
+
+// キーボードのレポート: 修飾キーのビット, 予約, 押しているキー 6 個
+// (キーは press() に渡したコードのまま記録し、HID の usage には変換しない)
+class Keyboard_
+{
+public:
+    void begin(void);
+    void end(void);
+    size_t press(uint8_t k);
+    size_t release(uint8_t k);
+    void releaseAll(void);
+    size_t write(uint8_t k);
+
+private:
+    void sendReport();
+    uint8_t _modifiers = 0;
+    uint8_t _keys[6] = {};
+};
+
+// マウスのレポート: ボタンのビット, X, Y, ホイール
+class Mouse_
+{
+public:
+    void begin(void);
+    void end(void);
+    void click(uint8_t b = MOUSE_LEFT);
+    void move(signed char x, signed char y, signed char wheel = 0);
+    void press(uint8_t b = MOUSE_LEFT);
+    void release(uint8_t b = MOUSE_LEFT);
+    bool isPressed(uint8_t b = MOUSE_LEFT);
+
+private:
+    void sendReport(signed char x, signed char y, signed char wheel);
+    uint8_t _buttons = 0;
+};
+
+extern Keyboard_ Keyboard;
+extern Mouse_ Mouse;
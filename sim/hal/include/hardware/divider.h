@@ -0,0 +1,6 @@
+#pragma once
+// ホスト用シミュレータの hardware/divider.h (ハードウェア除算器の代わりに普通の除算を使う)
+#include <stdint.h>
+
+static inline int32_t hw_divider_s32_quotient_inlined(int32_t a, int32_t b) { return a / b; }
+static inline int32_t hw_divider_s32_remainder_inlined(int32_t a, int32_t b) { return a % b; }
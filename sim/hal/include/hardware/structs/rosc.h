@@ -0,0 +1,21 @@
+#pragma once
+// ホスト用シミュレータの hardware/structs/rosc.h
+// RANDOMBIT は読むたびに決まった疑似乱数列の次のビットを返す (--rosc-seed で列を変えられる)
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" uint32_t sim_rosc_randombit(void);
+
+struct sim_rosc_randombit_reg
+{
+    operator uint32_t() const { return sim_rosc_randombit(); }
+};
+
+typedef struct
+{
+    sim_rosc_randombit_reg randombit;
+} rosc_hw_t;
+
+static const rosc_hw_t sim_rosc_hw = {};
+#define rosc_hw (&sim_rosc_hw)
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+// ホスト用シミュレータの hardware/sync.h
+// 禁止している間は繰り返しタイマーのコールバックを呼ばない (sim_clock.cpp)
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    uint32_t save_and_disable_interrupts(void);
+    void restore_interrupts(uint32_t status);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+// ホスト用シミュレータの pico/stdlib.h
+// ScriptProcessor.cpp と SwitchControllerPico が使う時刻・スリープ・タイマーだけを用意する。
+// 時刻は sim/hal/sim_clock.cpp の仮想時計 (起動からの us) で進む。
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    uint64_t time_us_64(void);
+    void sleep_us(uint64_t us);
+    void sleep_until(absolute_time_t t);
+    void tight_loop_contents(void); // 仮想時計では 1 us のスリープとして扱う
+
+    static inline uint32_t time_us_32(void) { return (uint32_t)time_us_64(); }
+    static inline void sleep_ms(uint32_t ms) { sleep_us((uint64_t)ms * 1000); }
+    static inline absolute_time_t get_absolute_time(void) { return time_us_64(); }
+    static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t / 1000); }
+    static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+    static inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+    static inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) { return t + us; }
+    static inline absolute_time_t delayed_by_ms(absolute_time_t t, uint32_t ms) { return t + (uint64_t)ms * 1000; }
+    static inline absolute_time_t make_timeout_time_us(uint64_t us) { return time_us_64() + us; }
+    static inline absolute_time_t make_timeout_time_ms(uint32_t ms) { return time_us_64() + (uint64_t)ms * 1000; }
+    static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return (int64_t)(to - from); }
+    static inline void busy_wait_us(uint64_t us) { sleep_us(us); }
+    static inline void busy_wait_until(absolute_time_t t) { sleep_until(t); }
+
+    // 繰り返しタイマー (SDK と同じく delay_us が負なら開始時刻の間隔、正なら終了から次の開始までの間隔)
+    // 割り込みの代わりに、時刻を読んだとき・スリープ中に期限の来たものを呼ぶ
+    typedef struct repeating_timer repeating_timer_t;
+    typedef bool (*repeating_timer_callback_t)(repeating_timer_t *rt);
+    struct repeating_timer
+    {
+        int64_t delay_us;
+        repeating_timer_callback_t callback;
+        void *user_data;
+        uint64_t sim_due_us; // シミュレータ用: 次に呼ぶ時刻
+    };
+    bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out);
+    bool cancel_repeating_timer(repeating_timer_t *timer);
+    static inline bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out)
+    {
+        return add_repeating_timer_us((int64_t)delay_ms * 1000, callback, user_data, out);
+    }
+
+#ifdef __cplusplus
+}
+#endif
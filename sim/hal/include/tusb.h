@@ -0,0 +1,26 @@
+#pragma once
+// ホスト用シミュレータの tusb.h
+// 常に接続済み・送信可能として振る舞い、tud_hid_report の中身は HID の記録 (sim_hid.cpp) に渡す
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BOARD_TUD_RHPORT 0
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    bool tusb_init(void);
+    bool tud_init(uint8_t rhport);
+    bool tud_deinit(uint8_t rhport);
+    void tud_task(void);
+    bool tud_ready(void);
+    bool tud_mounted(void);
+    bool tud_suspended(void);
+    bool tud_hid_ready(void);
+    bool tud_hid_report(uint8_t report_id, void const *report, uint16_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,224 @@
+// ホスト用シミュレータの時計・スリープ・繰り返しタイマー・割り込み禁止・ROSC
+//
+// ■ 追加: 仮想時計 (既定)
+// 時刻はスリープしたときだけ進む離散事象の時計で、sleep_until はタイマーの期限を順に処理しながら
+// 期限まで一気に進めて即座に戻る。何時間も WAIT するスクリプトも数秒で終わり、HID の記録の時刻は
+// 実機で期限どおりに動いたときの値になる (毎回同じ)。
+// precise_sleep_until の最後の空回り (tight_loop_contents) は 1 us ずつのスリープとして扱い、期限ちょうどで抜ける。
+// スリープせずに時刻を読み続けるループ (IsPressed の待ちなど) で止まらないよう、
+// スリープから SPIN_FREE_READS 回を超えた読み出しでは 1 回ごとに 1 us 進める (CPU の実行時間の代わり)。
+// --realtime のときは実時間に合わせて進む。
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "hardware/structs/rosc.h"
+#include "sim_hal.h"
+
+static std::chrono::steady_clock::time_point g_boot = std::chrono::steady_clock::now();
+
+// 登録中の繰り返しタイマー (期限は各タイマーの sim_due_us)
+static std::vector<repeating_timer_t *> g_timers;
+static int g_irq_disabled = 0;      // save_and_disable_interrupts の入れ子の深さ
+static bool g_in_callback = false; // コールバックの中で時刻を読んでも再入しない
+
+static uint64_t g_rosc_state = 0x9E3779B97F4A7C15ull;
+
+// 実機の時計 (time_us_64) は起動からの時刻で、スクリプトはボタンを押した後に始まるため 0 にはならない。
+// ScriptProcessor.cpp は g_script_start_us == 0 を「実行中でない」として扱う (GetTime が 0 を返す) ので、
+// HAL の時計は SIM_START_US から始め、記録・ボタン・時間切れに使う sim_now_us はそこからの時刻にする。
+static const uint64_t SIM_START_US = 1000000;
+
+static bool g_virtual = true;
+static uint64_t g_virtual_us = SIM_START_US;
+static const uint32_t SPIN_FREE_READS = 64; // スリープ後、時刻を進めずに読める回数
+static uint32_t g_spin_reads = 0;
+
+static uint64_t g_limit_us = UINT64_MAX; // これを過ぎたら g_on_limit を呼ぶ
+static void (*g_on_limit)() = nullptr;
+
+static uint64_t clock_now_us()
+{
+    if (g_virtual)
+        return g_virtual_us;
+    return SIM_START_US + (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_boot).count();
+}
+
+static void check_limit(uint64_t now)
+{
+    if (now >= g_limit_us && g_on_limit)
+    {
+        g_limit_us = UINT64_MAX;
+        g_on_limit();
+    }
+}
+
+// 仮想時計を t まで進める
+static void advance_to(uint64_t t)
+{
+    if (t <= g_virtual_us)
+        return;
+    g_virtual_us = t;
+    g_spin_reads = 0;
+    check_limit(t);
+}
+
+// 期限の来たタイマーを期限の早い順に呼ぶ (実機の割り込みの代わり)
+static void fire_timers(uint64_t now)
+{
+    if (g_irq_disabled || g_in_callback)
+        return;
+    g_in_callback = true;
+    for (;;)
+    {
+        repeating_timer_t *next = nullptr;
+        for (repeating_timer_t *t : g_timers)
+        {
+            if (t->sim_due_us <= now && (!next || t->sim_due_us < next->sim_due_us))
+                next = t;
+        }
+        if (!next)
+            break;
+        const bool again = next->callback(next);
+        // コールバックの中で cancel されていることがある
+        auto it = std::find(g_timers.begin(), g_timers.end(), next);
+        if (it == g_timers.end())
+            continue;
+        if (!again)
+        {
+            g_timers.erase(it);
+            continue;
+        }
+        if (next->delay_us < 0)
+            next->sim_due_us += (uint64_t)(-next->delay_us);
+        else
+            next->sim_due_us = clock_now_us() + (uint64_t)next->delay_us;
+    }
+    g_in_callback = false;
+}
+
+static uint64_t next_timer_due()
+{
+    uint64_t due = UINT64_MAX;
+    for (repeating_timer_t *t : g_timers)
+        due = std::min(due, t->sim_due_us);
+    return due;
+}
+
+void sim_clock_reset(bool virtual_time)
+{
+    g_virtual = virtual_time;
+    g_virtual_us = SIM_START_US;
+    g_spin_reads = 0;
+    g_boot = std::chrono::steady_clock::now();
+    g_timers.clear();
+    g_irq_disabled = 0;
+}
+
+void sim_clock_set_limit(uint64_t limit_us, void (*on_limit)())
+{
+    g_limit_us = limit_us == UINT64_MAX ? limit_us : SIM_START_US + limit_us;
+    g_on_limit = on_limit;
+}
+
+uint64_t sim_now_us()
+{
+    return clock_now_us() - SIM_START_US;
+}
+
+void sim_rosc_seed(uint64_t seed)
+{
+    g_rosc_state = seed ? seed : 0x9E3779B97F4A7C15ull;
+}
+
+extern "C" uint64_t time_us_64(void)
+{
+    if (g_virtual && ++g_spin_reads > SPIN_FREE_READS)
+        ++g_virtual_us;
+    const uint64_t now = clock_now_us();
+    check_limit(now);
+    fire_timers(now);
+    return now;
+}
+
+extern "C" void sleep_until(absolute_time_t t)
+{
+    if (g_virtual)
+    {
+        // 期限までにあるタイマーの期限に順に進めながらコールバックを呼ぶ
+        for (;;)
+        {
+            fire_timers(g_virtual_us);
+            if (g_virtual_us >= t)
+                return;
+            uint64_t wake = std::min<uint64_t>(t, next_timer_due());
+            if (wake <= g_virtual_us) // 割り込み禁止中・コールバック中はタイマーを待たない
+                wake = t;
+            advance_to(wake);
+        }
+    }
+    for (;;)
+    {
+        const uint64_t now = time_us_64();
+        if (now >= t)
+            return;
+        uint64_t wake = std::min<uint64_t>(t, next_timer_due());
+        if (wake <= now) // 割り込み禁止中・コールバック中はタイマーを待たない
+            wake = t;
+        std::this_thread::sleep_for(std::chrono::microseconds(wake - now));
+    }
+}
+
+extern "C" void tight_loop_contents(void)
+{
+    if (g_virtual)
+        sleep_until(g_virtual_us + 1);
+}
+
+extern "C" void sleep_us(uint64_t us)
+{
+    sleep_until(clock_now_us() + us);
+}
+
+extern "C" bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out)
+{
+    if (!out || !callback || delay_us == 0)
+        return false;
+    out->delay_us = delay_us;
+    out->callback = callback;
+    out->user_data = user_data;
+    out->sim_due_us = clock_now_us() + (uint64_t)(delay_us < 0 ? -delay_us : delay_us);
+    if (std::find(g_timers.begin(), g_timers.end(), out) == g_timers.end())
+        g_timers.push_back(out);
+    return true;
+}
+
+extern "C" bool cancel_repeating_timer(repeating_timer_t *timer)
+{
+    auto it = std::find(g_timers.begin(), g_timers.end(), timer);
+    if (it == g_timers.end())
+        return false;
+    g_timers.erase(it);
+    return true;
+}
+
+extern "C" uint32_t save_and_disable_interrupts(void)
+{
+    return (uint32_t)g_irq_disabled++;
+}
+
+extern "C" void restore_interrupts(uint32_t status)
+{
+    g_irq_disabled = (int)status;
+}
+
+// xorshift64* の最上位ビットを RANDOMBIT として返す
+extern "C" uint32_t sim_rosc_randombit(void)
+{
+    g_rosc_state ^= g_rosc_state >> 12;
+    g_rosc_state ^= g_rosc_state << 25;
+    g_rosc_state ^= g_rosc_state >> 27;
+    return (uint32_t)((g_rosc_state * 0x2545F4914F6CDD1Dull) >> 63);
+}
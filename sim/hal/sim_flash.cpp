@@ -0,0 +1,219 @@
+// ホスト用シミュレータのフラッシュ: lfs_pico_flash_config の読み書き先をファイル (フラッシュの像) にする
+// 形状 (ブロックの大きさ・数) は pico-littlefs-usb の littlefs_driver.c に合わせること。
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "lfs.h"
+#include "sim_hal.h"
+
+#ifndef SIM_FLASH_BLOCK_SIZE
+#define SIM_FLASH_BLOCK_SIZE 4096
+#endif
+#ifndef SIM_FLASH_BLOCK_COUNT
+#define SIM_FLASH_BLOCK_COUNT 128
+#endif
+#define SIM_FLASH_PAGE_SIZE 256
+
+static FILE *g_flash_fp = nullptr;
+
+static int flash_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    if (!g_flash_fp || fseek(g_flash_fp, (long)(block * c->block_size + off), SEEK_SET) != 0)
+        return LFS_ERR_IO;
+    return fread(buffer, 1, size, g_flash_fp) == size ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+// NOR フラッシュと同じく、書き込みは 1 のビットを 0 にすることしかできない
+static int flash_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    std::vector<uint8_t> cur(size);
+    if (flash_read(c, block, off, cur.data(), size) != LFS_ERR_OK)
+        return LFS_ERR_IO;
+    const uint8_t *src = (const uint8_t *)buffer;
+    for (lfs_size_t i = 0; i < size; ++i)
+        cur[i] &= src[i];
+    if (fseek(g_flash_fp, (long)(block * c->block_size + off), SEEK_SET) != 0)
+        return LFS_ERR_IO;
+    return fwrite(cur.data(), 1, size, g_flash_fp) == size ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int flash_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    std::vector<uint8_t> ff(c->block_size, 0xFF);
+    if (!g_flash_fp || fseek(g_flash_fp, (long)(block * c->block_size), SEEK_SET) != 0)
+        return LFS_ERR_IO;
+    return fwrite(ff.data(), 1, ff.size(), g_flash_fp) == ff.size() ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int flash_sync(const struct lfs_config *)
+{
+    return g_flash_fp && fflush(g_flash_fp) == 0 ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+extern const struct lfs_config lfs_pico_flash_config;
+const struct lfs_config lfs_pico_flash_config = {
+    .context = nullptr,
+    .read = flash_read,
+    .prog = flash_prog,
+    .erase = flash_erase,
+    .sync = flash_sync,
+    .read_size = 1,
+    .prog_size = SIM_FLASH_PAGE_SIZE,
+    .block_size = SIM_FLASH_BLOCK_SIZE,
+    .block_count = SIM_FLASH_BLOCK_COUNT,
+    .block_cycles = 500,
+    .cache_size = SIM_FLASH_PAGE_SIZE,
+    .lookahead_size = 16,
+};
+
+// Pico_AutoInput.cpp の fs と参照カウント付きマウント (インタプリタが使う。シミュレータのログはフラッシュに書かない)
+lfs_t fs;
+static int g_fs_mount_refs = 0;
+
+extern "C" int SharedFsMount()
+{
+    if (g_fs_mount_refs == 0)
+    {
+        int err = lfs_mount(&fs, &lfs_pico_flash_config);
+        if (err < 0)
+            return err;
+    }
+    ++g_fs_mount_refs;
+    return 0;
+}
+
+extern "C" void SharedFsUnmount()
+{
+    if (g_fs_mount_refs > 0 && --g_fs_mount_refs == 0)
+        lfs_unmount(&fs);
+}
+
+bool sim_flash_open(const char *path)
+{
+    sim_flash_close();
+    const long image_size = (long)SIM_FLASH_BLOCK_SIZE * SIM_FLASH_BLOCK_COUNT;
+    g_flash_fp = fopen(path, "r+b");
+    if (g_flash_fp)
+    {
+        fseek(g_flash_fp, 0, SEEK_END);
+        if (ftell(g_flash_fp) == image_size)
+            return true;
+        fprintf(stderr, "sim: %s is not a %ld byte flash image\n", path, image_size);
+        sim_flash_close();
+        return false;
+    }
+    g_flash_fp = fopen(path, "w+b");
+    if (!g_flash_fp)
+        return false;
+    std::vector<uint8_t> ff(SIM_FLASH_BLOCK_SIZE, 0xFF);
+    for (int i = 0; i < SIM_FLASH_BLOCK_COUNT; ++i)
+        fwrite(ff.data(), 1, ff.size(), g_flash_fp);
+    return fflush(g_flash_fp) == 0;
+}
+
+void sim_flash_close()
+{
+    if (g_flash_fp)
+        fclose(g_flash_fp);
+    g_flash_fp = nullptr;
+}
+
+const char *sim_base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// ホストのファイルを像の直下に同じ名前で書き込む
+static bool import_file(lfs_t *lfs, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "sim: cannot open %s\n", path);
+        return false;
+    }
+    lfs_file_t f;
+    bool ok = lfs_file_open(lfs, &f, sim_base_name(path), LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) == 0;
+    if (ok)
+    {
+        char buf[1024];
+        size_t n;
+        while (ok && (n = fread(buf, 1, sizeof(buf), fp)) > 0)
+            ok = lfs_file_write(lfs, &f, buf, (lfs_size_t)n) == (lfs_ssize_t)n;
+        ok = lfs_file_close(lfs, &f) == 0 && ok;
+    }
+    fclose(fp);
+    if (!ok)
+        fprintf(stderr, "sim: cannot write %s to the image (full?)\n", sim_base_name(path));
+    return ok;
+}
+
+bool sim_flash_import(const std::vector<const char *> &paths, bool format)
+{
+    lfs_t lfs;
+    if (format || lfs_mount(&lfs, &lfs_pico_flash_config) != 0)
+    {
+        if (lfs_format(&lfs, &lfs_pico_flash_config) != 0 || lfs_mount(&lfs, &lfs_pico_flash_config) != 0)
+        {
+            fprintf(stderr, "sim: cannot format the flash image\n");
+            return false;
+        }
+    }
+    bool ok = true;
+    for (const char *path : paths)
+        ok = import_file(&lfs, path) && ok;
+    lfs_unmount(&lfs);
+    return ok;
+}
+
+static bool export_files(lfs_t *lfs, const std::string &dir)
+{
+    mkdir(dir.c_str(), 0777); // 既にあれば失敗するだけ
+    lfs_dir_t d;
+    if (lfs_dir_open(lfs, &d, "/") != 0)
+        return false;
+    bool ok = true;
+    struct lfs_info info;
+    while (lfs_dir_read(lfs, &d, &info) > 0)
+    {
+        if (info.type != LFS_TYPE_REG)
+            continue;
+        lfs_file_t f;
+        if (lfs_file_open(lfs, &f, info.name, LFS_O_RDONLY) != 0)
+        {
+            ok = false;
+            continue;
+        }
+        const std::string out = dir + "/" + info.name;
+        FILE *fp = fopen(out.c_str(), "wb");
+        if (fp)
+        {
+            char buf[1024];
+            lfs_ssize_t n;
+            while ((n = lfs_file_read(lfs, &f, buf, sizeof(buf))) > 0)
+                fwrite(buf, 1, (size_t)n, fp);
+            fclose(fp);
+        }
+        else
+        {
+            fprintf(stderr, "sim: cannot create %s\n", out.c_str());
+            ok = false;
+        }
+        lfs_file_close(lfs, &f);
+    }
+    lfs_dir_close(lfs, &d);
+    return ok;
+}
+
+bool sim_flash_export(const char *dir)
+{
+    lfs_t lfs;
+    if (lfs_mount(&lfs, &lfs_pico_flash_config) != 0)
+        return false;
+    const bool ok = export_files(&lfs, dir);
+    lfs_unmount(&lfs);
+    return ok;
+}
@@ -0,0 +1,58 @@
+#pragma once
+// ホスト用シミュレータ (sim/) の HAL シムの設定口
+// pico/stdlib.h などのシムヘッダが置き換える関数の中身は sim_*.cpp にあり、
+// sim_main.cpp はここの関数で時計・HID の記録・BOOTSEL ボタン・フラッシュの像を用意してから ExecuteScript を呼ぶ。
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// --- 仮想時計 (sim_clock.cpp) ---
+// 時刻は起動 (sim_clock_reset) からの us (time_us_64 はこれに 1 秒を足した値)。
+// virtual_time なら待ちは即座に終わり、時刻だけが期限まで進む。
+// false なら実時間に合わせて進む。
+void sim_clock_reset(bool virtual_time);
+// 時刻が limit_us を過ぎたら on_limit を 1 回呼ぶ (無限ループのスクリプトを止める用)
+void sim_clock_set_limit(uint64_t limit_us, void (*on_limit)());
+// 現在の時刻 (time_us_64 と違い、タイマーを呼ばず仮想時計も進めない。記録用)
+uint64_t sim_now_us();
+void sim_rosc_seed(uint64_t seed);
+
+// --- HID の記録 (sim_hid.cpp) ---
+// 1 行に 1 レポート: "<時刻 us> <機器> <レポートの 16 進バイト列>"
+// 機器は kbd (修飾キー, 予約, キー x6) / mouse (ボタン, X, Y, ホイール) / switch (Pro コンのレポート) / led (R, G, B。色が変わったときだけ)
+bool sim_hid_open(const char *path); // "-" なら標準出力
+void sim_hid_close();
+void sim_hid_record(const char *device, const void *report, size_t len);
+unsigned long sim_hid_report_count();
+
+// --- BOOTSEL ボタン (sim_hid.cpp) ---
+// [press_us, release_us) の間だけ押されている
+void sim_button_add(uint64_t press_us, uint64_t release_us);
+void sim_button_clear();
+
+// --- フラッシュの像 (sim_flash.cpp) ---
+// lfs_pico_flash_config の読み書き先をファイルにする。無ければ消去済み (0xFF) の像を作る。
+bool sim_flash_open(const char *path);
+void sim_flash_close();
+// ホストのファイルを像の直下に同じ名前で書き込む (format なら先にフォーマットする。マウントできない像もフォーマットする)
+bool sim_flash_import(const std::vector<const char *> &paths, bool format);
+// 像の直下のファイルをホストのディレクトリ dir にコピーする
+bool sim_flash_export(const char *dir);
+const char *sim_base_name(const char *path);
+
+// --- ログ・エラー (sim_log.cpp) ---
+bool sim_runtime_error_seen();
+void sim_clear_runtime_error();
+void sim_log_quiet(bool quiet); // true ならログ (SystemLog / DEBUG の出力) を捨てる
+
+// --- ヒープの統計 (sim_heap.cpp) ---
+// operator new / delete を置き換えて数える (ホストのみ。ファームウェアは置き換えない)
+struct SimHeapStats
+{
+    uint64_t allocs; // operator new の回数
+    uint64_t bytes;  // 要求したバイト数の合計
+    size_t live;     // 確保中のバイト数
+    size_t peak;     // 確保中のバイト数の最大 (sim_heap_reset_peak から)
+};
+SimHeapStats sim_heap_stats();
+void sim_heap_reset_peak();
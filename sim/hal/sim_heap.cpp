@@ -0,0 +1,75 @@
+// ヒープの統計 (ホストのみ): operator new / delete を置き換えて確保の回数・バイト数・確保中の量を数える
+// ファームウェアは operator new を置き換えない。ベンチマーク (pico_bench) と pico_sim の統計表示用。
+// 確保中の量を数えるため、ブロックの前にサイズを置く (malloc_usable_size が無い macOS でも動くように)
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include "sim_hal.h"
+
+namespace
+{
+const size_t HEADER = alignof(std::max_align_t);
+SimHeapStats g_stats = {};
+
+void *counted_alloc(size_t size) noexcept
+{
+    char *p = static_cast<char *>(malloc(size + HEADER));
+    if (!p)
+        return nullptr;
+    *reinterpret_cast<size_t *>(p) = size;
+    ++g_stats.allocs;
+    g_stats.bytes += size;
+    g_stats.live += size;
+    g_stats.peak = std::max(g_stats.peak, g_stats.live);
+    return p + HEADER;
+}
+
+void counted_free(void *ptr) noexcept
+{
+    if (!ptr)
+        return;
+    char *p = static_cast<char *>(ptr) - HEADER;
+    g_stats.live -= *reinterpret_cast<size_t *>(p);
+    free(p);
+}
+} // namespace
+
+SimHeapStats sim_heap_stats()
+{
+    return g_stats;
+}
+
+void sim_heap_reset_peak()
+{
+    g_stats.peak = g_stats.live;
+}
+
+void *operator new(size_t size)
+{
+    void *p = counted_alloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size);
+}
+
+void operator delete(void *p) noexcept { counted_free(p); }
+void operator delete[](void *p) noexcept { counted_free(p); }
+void operator delete(void *p, size_t) noexcept { counted_free(p); }
+void operator delete[](void *p, size_t) noexcept { counted_free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { counted_free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { counted_free(p); }
@@ -0,0 +1,222 @@
+// ホスト用シミュレータの USB (TinyUSB)・キーボード・マウス・LED・BOOTSEL ボタン
+// 送るはずだった HID レポートを時刻付きで記録する。
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "pico/stdlib.h"
+#include "tusb.h"
+#include "usb_descriptors.h"
+#include "TinyUSB_Mouse_and_Keyboard/TinyUSB_Mouse_and_Keyboard.h"
+#include "sim_hal.h"
+
+usb_mode_t g_usb_mode = USB_MODE_HID;
+
+Keyboard_ Keyboard;
+Mouse_ Mouse;
+
+class WS2812;
+WS2812 *ledStrip1 = nullptr;
+
+static FILE *g_hid_fp = nullptr;
+static unsigned long g_hid_reports = 0;
+
+struct ButtonPress
+{
+    uint64_t press_us, release_us;
+};
+static std::vector<ButtonPress> g_button;
+
+// --- HID の記録 ---
+
+bool sim_hid_open(const char *path)
+{
+    sim_hid_close();
+    g_hid_fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!g_hid_fp)
+        return false;
+    fprintf(g_hid_fp, "# time_us device report\n");
+    return true;
+}
+
+void sim_hid_close()
+{
+    if (g_hid_fp && g_hid_fp != stdout)
+        fclose(g_hid_fp);
+    else if (g_hid_fp)
+        fflush(g_hid_fp);
+    g_hid_fp = nullptr;
+}
+
+void sim_hid_record(const char *device, const void *report, size_t len)
+{
+    ++g_hid_reports;
+    if (!g_hid_fp)
+        return;
+    fprintf(g_hid_fp, "%llu %s", (unsigned long long)sim_now_us(), device);
+    const uint8_t *p = (const uint8_t *)report;
+    for (size_t i = 0; i < len; ++i)
+        fprintf(g_hid_fp, " %02x", p[i]);
+    fputc('\n', g_hid_fp);
+}
+
+unsigned long sim_hid_report_count()
+{
+    return g_hid_reports;
+}
+
+// --- TinyUSB (常に接続済み) ---
+
+extern "C" bool tusb_init(void) { return true; }
+extern "C" bool tud_init(uint8_t) { return true; }
+extern "C" bool tud_deinit(uint8_t) { return true; }
+extern "C" void tud_task(void) {}
+extern "C" bool tud_ready(void) { return true; }
+extern "C" bool tud_mounted(void) { return true; }
+extern "C" bool tud_suspended(void) { return false; }
+extern "C" bool tud_hid_ready(void) { return true; }
+
+// SwitchControllerPico (NintendoSwitchControllPico.cpp) が送る Pro コンのレポート
+extern "C" bool tud_hid_report(uint8_t, void const *report, uint16_t len)
+{
+    sim_hid_record("switch", report, len);
+    return true;
+}
+
+// --- キーボード ---
+
+void Keyboard_::begin(void) {}
+void Keyboard_::end(void) {}
+
+void Keyboard_::sendReport()
+{
+    uint8_t report[8] = {_modifiers, 0};
+    memcpy(report + 2, _keys, sizeof(_keys));
+    sim_hid_record("kbd", report, sizeof(report));
+}
+
+size_t Keyboard_::press(uint8_t k)
+{
+    if (k >= KEY_LEFT_CTRL && k <= KEY_RIGHT_GUI)
+        _modifiers |= (uint8_t)(1u << (k - KEY_LEFT_CTRL));
+    else if (!memchr(_keys, k, sizeof(_keys)))
+    {
+        uint8_t *slot = (uint8_t *)memchr(_keys, 0, sizeof(_keys));
+        if (!slot)
+            return 0;
+        *slot = k;
+    }
+    sendReport();
+    return 1;
+}
+
+size_t Keyboard_::release(uint8_t k)
+{
+    if (k >= KEY_LEFT_CTRL && k <= KEY_RIGHT_GUI)
+        _modifiers &= (uint8_t)~(1u << (k - KEY_LEFT_CTRL));
+    else
+    {
+        for (uint8_t &key : _keys)
+        {
+            if (key == k)
+                key = 0;
+        }
+    }
+    sendReport();
+    return 1;
+}
+
+void Keyboard_::releaseAll(void)
+{
+    _modifiers = 0;
+    memset(_keys, 0, sizeof(_keys));
+    sendReport();
+}
+
+size_t Keyboard_::write(uint8_t k)
+{
+    const size_t n = press(k);
+    release(k);
+    return n;
+}
+
+// --- マウス ---
+
+void Mouse_::begin(void) {}
+void Mouse_::end(void) {}
+
+void Mouse_::sendReport(signed char x, signed char y, signed char wheel)
+{
+    const uint8_t report[4] = {_buttons, (uint8_t)x, (uint8_t)y, (uint8_t)wheel};
+    sim_hid_record("mouse", report, sizeof(report));
+}
+
+void Mouse_::click(uint8_t b)
+{
+    press(b);
+    release(b);
+}
+
+void Mouse_::move(signed char x, signed char y, signed char wheel)
+{
+    sendReport(x, y, wheel);
+}
+
+void Mouse_::press(uint8_t b)
+{
+    if ((_buttons | b) == _buttons)
+        return;
+    _buttons |= b;
+    sendReport(0, 0, 0);
+}
+
+void Mouse_::release(uint8_t b)
+{
+    if ((_buttons & ~b) == _buttons)
+        return;
+    _buttons &= (uint8_t)~b;
+    sendReport(0, 0, 0);
+}
+
+bool Mouse_::isPressed(uint8_t b)
+{
+    return (_buttons & b) != 0;
+}
+
+// --- LED (Pico_AutoInput.cpp の ApplyStripColor の代わり) ---
+// 同じ色を毎ループ設定するスクリプトが多いため、色が変わったときだけ記録する
+
+static int g_led_rgb = -1;
+
+void ApplyStripColor(int r, int g, int b)
+{
+    auto clamp = [](int v) { return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v)); };
+    const uint8_t rgb[3] = {clamp(r), clamp(g), clamp(b)};
+    const int packed = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+    if (packed == g_led_rgb)
+        return;
+    g_led_rgb = packed;
+    sim_hid_record("led", rgb, sizeof(rgb));
+}
+
+// --- BOOTSEL ボタン ---
+
+void sim_button_add(uint64_t press_us, uint64_t release_us)
+{
+    g_button.push_back({press_us, release_us});
+}
+
+void sim_button_clear()
+{
+    g_button.clear();
+}
+
+bool bb_get_bootsel_button()
+{
+    const uint64_t now = sim_now_us();
+    for (const ButtonPress &b : g_button)
+    {
+        if (now >= b.press_us && now < b.release_us)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,81 @@
+// ホスト用シミュレータのログとエラー通知 (Pico_AutoInput.cpp の SystemLog / SignalRuntimeError の代わり)
+// ログは UART の代わりに標準出力へ出す。LogConfig の設定 (log.txt / log.bin への保存) は模擬しない。
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include "pico/stdlib.h"
+#include "log_formats.h"
+#include "sim_hal.h"
+
+extern "C" void ScriptTraceFlush();
+
+static bool g_runtime_error = false;
+static bool g_quiet = false;
+
+bool sim_runtime_error_seen()
+{
+    return g_runtime_error;
+}
+
+void sim_log_quiet(bool quiet)
+{
+    g_quiet = quiet;
+}
+
+void sim_clear_runtime_error()
+{
+    g_runtime_error = false;
+}
+
+extern "C" void ConfigureLog(uint32_t size_kb, bool overwrite, bool binary)
+{
+    if (g_quiet)
+        return;
+    printf("sim: LogConfig(%lu, %s, %s) ignored, log goes to stdout\n", (unsigned long)size_kb,
+           overwrite ? "OVERWRITE" : "STOP", binary ? "BINARY" : "TEXT");
+}
+
+extern "C" void SystemLog(const char *fmt, ...)
+{
+    if (g_quiet)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+extern "C" void SystemLogFmt(unsigned id, ...)
+{
+    if (g_quiet || id == LOGF_SYNC || id >= LOGF_COUNT)
+        return;
+    va_list args;
+    va_start(args, id);
+    vprintf(kLogFormats[id], args);
+    va_end(args);
+}
+
+extern "C" void SystemLogBegin() {}
+
+extern "C" void SystemLogEnd()
+{
+    fflush(stdout);
+}
+
+extern "C" bool SystemLogIdle()
+{
+    return false;
+}
+
+// 実機は LED を点滅させて止まるが、シミュレータは表示してトレースを書き出すだけ (ExecuteScript はそのまま終わる)
+extern "C" void SignalRuntimeError(const char *msg, int line_num, const char *line_content, const char *expanded_content)
+{
+    g_runtime_error = true;
+    fprintf(stderr, "\n!!! RUNTIME ERROR !!! [%lu ms]\n", (unsigned long)to_ms_since_boot(get_absolute_time()));
+    fprintf(stderr, "Line : %d\n", line_num);
+    fprintf(stderr, "Cmd  : %s\n", line_content);
+    if (expanded_content && strlen(expanded_content) > 0)
+        fprintf(stderr, "Vals : %s\n", expanded_content);
+    fprintf(stderr, "Msg  : %s\n", msg);
+    ScriptTraceFlush();
+}
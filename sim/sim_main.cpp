@@ -0,0 +1,173 @@
+// ホスト用シミュレータ: ScriptProcessor.cpp のインタプリタを PC 上で実行する
+// スクリプトと使うファイルをフラッシュの像 (littlefs) に書き込んでから ExecuteScript を呼び、
+// 送られるはずだった HID レポートを時刻付きでファイルに記録する。
+// 時計は既定で仮想時計なので、WAIT などの待ちは即座に終わる (記録の時刻は実機どおり)。
+//
+// usage: pico_sim [options] script.txt [file ...]
+//   -i, --image PATH      フラッシュの像 (既定 pico_sim.img。無ければ作ってフォーマットする)
+//       --format          像をフォーマットし直してから書き込む
+//   -o, --hid PATH        HID レポートの記録先 (既定 hid.txt。"-" なら標準出力)
+//   -b, --button MS[:MS]  起動から MS ms で BOOTSEL を押す (離す時刻の既定は 100 ms 後)。何回でも指定できる
+//       --switch          ProController モードで始める (既定は KeyMouse)
+//   -x, --export DIR      終了後、像の直下のファイル (profile.txt, trace.txt など) を DIR にコピーする
+//       --rosc-seed N     ROSC の RANDOMBIT の疑似乱数列を変える
+//       --realtime        仮想時計を使わず実時間で動かす
+//   -t, --time-limit SEC  時刻が SEC 秒を過ぎたらスクリプトを止める (終わらないスクリプト用)
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "pico/stdlib.h"
+#include "usb_descriptors.h"
+#include "script_stats.h"
+#include "hal/sim_hal.h"
+
+extern bool ExecuteScript(const char *filename);
+extern "C" void ScriptRequestStop();
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options] script.txt [file ...]\n"
+            "  -i, --image PATH      flash image (default pico_sim.img)\n"
+            "      --format          format the image before importing files\n"
+            "  -o, --hid PATH        HID report record (default hid.txt, \"-\" for stdout)\n"
+            "  -b, --button MS[:MS]  press BOOTSEL at MS ms after boot (released 100 ms later or at the 2nd MS)\n"
+            "      --switch          start in ProController mode\n"
+            "  -x, --export DIR      copy the files in the image root to DIR after the run\n"
+            "      --rosc-seed N     seed of the simulated ROSC random bits\n"
+            "      --realtime        follow the wall clock instead of the virtual clock\n"
+            "  -t, --time-limit SEC  stop when the (virtual) clock passes SEC seconds\n",
+            argv0);
+}
+
+// Ctrl-C などで止めたときも、そこまでの HID の記録を残す
+static void on_signal(int sig)
+{
+    sim_hid_close();
+    _Exit(128 + sig);
+}
+
+static bool g_time_limit_hit = false;
+
+static void on_stuck()
+{
+    sim_hid_close();
+    fprintf(stderr, "sim: script did not stop within 60 s after the time limit\n");
+    fflush(stdout);
+    _Exit(1);
+}
+
+// 次の文の前で止める。1 つの文の中で止まらないときは、さらに 60 秒進んだところで打ち切る
+static void on_time_limit()
+{
+    g_time_limit_hit = true;
+    ScriptRequestStop();
+    sim_clock_set_limit(sim_now_us() + 60000000ull, on_stuck);
+}
+
+int main(int argc, char **argv)
+{
+    const char *image = "pico_sim.img";
+    const char *hid = "hid.txt";
+    const char *export_dir = nullptr;
+    bool format = false;
+    bool virtual_time = true;
+    double time_limit_s = 0;
+    std::vector<const char *> files;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *a = argv[i];
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(2);
+            }
+            return argv[++i];
+        };
+        if (!strcmp(a, "-i") || !strcmp(a, "--image"))
+            image = value();
+        else if (!strcmp(a, "--format"))
+            format = true;
+        else if (!strcmp(a, "-o") || !strcmp(a, "--hid"))
+            hid = value();
+        else if (!strcmp(a, "-b") || !strcmp(a, "--button"))
+        {
+            char *end;
+            const uint64_t press_ms = strtoull(value(), &end, 10);
+            const uint64_t release_ms = *end == ':' ? strtoull(end + 1, nullptr, 10) : press_ms + 100;
+            sim_button_add(press_ms * 1000, release_ms * 1000);
+        }
+        else if (!strcmp(a, "--switch"))
+            g_usb_mode = USB_MODE_HID_Switch;
+        else if (!strcmp(a, "-x") || !strcmp(a, "--export"))
+            export_dir = value();
+        else if (!strcmp(a, "--rosc-seed"))
+            sim_rosc_seed(strtoull(value(), nullptr, 0));
+        else if (!strcmp(a, "--realtime"))
+            virtual_time = false;
+        else if (!strcmp(a, "-t") || !strcmp(a, "--time-limit"))
+            time_limit_s = atof(value());
+        else if (a[0] == '-' && a[1])
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        else
+            files.push_back(a);
+    }
+    if (files.empty())
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!sim_flash_open(image))
+    {
+        fprintf(stderr, "sim: cannot open flash image %s\n", image);
+        return 1;
+    }
+    if (!sim_flash_import(files, format))
+        return 1;
+    if (!sim_hid_open(hid))
+    {
+        fprintf(stderr, "sim: cannot create %s\n", hid);
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    sim_clock_reset(virtual_time);
+    if (time_limit_s > 0)
+        sim_clock_set_limit((uint64_t)(time_limit_s * 1e6), on_time_limit);
+    const auto wall_start = std::chrono::steady_clock::now();
+    const char *script = sim_base_name(files[0]);
+    sim_heap_reset_peak();
+    const SimHeapStats heap_start = sim_heap_stats();
+    bool ok = ExecuteScript(script) && !sim_runtime_error_seen();
+    const SimHeapStats heap_end = sim_heap_stats();
+    const uint64_t elapsed_us = sim_now_us();
+    const long long wall_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wall_start).count();
+    sim_hid_close();
+    fprintf(stderr, "sim: %s %s after %llu ms (%lld ms wall clock), %lu HID reports\n", script,
+            !ok ? "failed" : (g_time_limit_hit ? "stopped at the time limit" : "finished"),
+            (unsigned long long)(elapsed_us / 1000), wall_ms, sim_hid_report_count());
+    ScriptRunStats stats;
+    ScriptGetRunStats(&stats);
+    fprintf(stderr, "sim: %llu statements, %llu evaluations, %llu allocations, heap peak %lu bytes (%lu at start)\n",
+            (unsigned long long)stats.statements, (unsigned long long)stats.evals, (unsigned long long)(heap_end.allocs - heap_start.allocs),
+            (unsigned long)heap_end.peak, (unsigned long)heap_start.live);
+
+    if (export_dir && !sim_flash_export(export_dir))
+    {
+        fprintf(stderr, "sim: export to %s failed\n", export_dir);
+        ok = false;
+    }
+    sim_flash_close();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,484 @@
+// HID レポートの時刻を基準の記録 (ゴールデン) と比べるホスト用ツール
+// KeyType / WAIT / Mouserun などの出力タイミングが変わっていないかを数字で確かめる。
+//
+// build: g++ -std=c++17 -O2 -o hid_timing hid_timing.cpp   (sim/ のビルドでも作られる)
+// usage: hid_timing [options] golden.txt capture.txt
+//   記録の形式は次のどちらでもよい (1 行ごとに判別する)
+//     - シミュレータ (pico_sim -o) の記録: "<時刻 us> <kbd|mouse|switch|led> <16 進バイト列>"
+//     - 実機を Linux の usbmon で取った記録 (cat /sys/kernel/debug/usb/usbmon/<bus>u > cap.txt)
+//       割り込み IN の完了 (C Ii:...) だけを読み、レポート ID と長さから kbd / mouse / switch に分ける
+//   --devices LIST   比べる機器 (既定 kbd,mouse,switch。led はシミュレータにしか無い)
+//   --tolerance US   1 件の時刻のずれの許容値 (既定 2000 us)。超えたら、または欠落・余分があれば終了コード 1
+//   --window N       一致しないときに先を探す件数 (既定 64)
+//   --usb-dev B:D    usbmon の記録から読む機器 (バス番号:デバイス番号。既定は全部)
+//   --events PATH    1 件ごとの結果を CSV で書く
+//   -v               欠落・余分・許容値を超えたレポートを表示する
+//
+// 2 つの記録は最初に一致したレポートで時刻を揃え、以降の各レポートについて
+//   誤差   = (capture の時刻 - 揃えたずれ) - golden の時刻   (正なら遅れ)
+//   ジッタ = 直前の一致からの間隔の差の絶対値
+//   ドリフト = 最後に一致したレポートの誤差 (記録全体で積み上がったずれ)
+// を集計する。
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct Report
+{
+    int64_t t_us;
+    std::string device;
+    std::vector<uint8_t> bytes;
+
+    bool same(const Report &o) const { return device == o.device && bytes == o.bytes; }
+};
+
+// 実機のレポートの形 (usb_descriptors.cpp の RID_KEYBOARD / RID_MOUSE と NintendoSwitchControllPico.h)
+static const uint8_t RID_KEYBOARD = 1;
+static const uint8_t RID_MOUSE = 2;
+static const size_t KEYBOARD_REPORT_LEN = 8;     // 修飾キー, 予約, キー x6
+static const size_t MOUSE_REPORT_LEN = 4;        // ボタン, X, Y, ホイール (水平ホイールは比べない)
+static const size_t MOUSE_WIRE_LEN = 1 + MOUSE_REPORT_LEN + 1; // USB 上ではレポート ID と水平ホイールが付く
+static const size_t SWITCH_REPORT_LEN = 8;       // USB_JoystickReport_Input_t
+
+static std::vector<std::string> split(const std::string &s, char sep)
+{
+    std::vector<std::string> out;
+    size_t pos = 0;
+    while (pos <= s.size())
+    {
+        size_t end = s.find(sep, pos);
+        if (end == std::string::npos)
+            end = s.size();
+        if (end > pos)
+            out.push_back(s.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return out;
+}
+
+static bool parse_hex(const std::string &tok, std::vector<uint8_t> &out)
+{
+    if (tok.size() % 2)
+        return false;
+    for (size_t i = 0; i < tok.size(); i += 2)
+    {
+        char *end;
+        const std::string pair = tok.substr(i, 2);
+        const unsigned long v = strtoul(pair.c_str(), &end, 16);
+        if (*end)
+            return false;
+        out.push_back((uint8_t)v);
+    }
+    return true;
+}
+
+// "<時刻 us> <機器> <バイト列>"
+static bool parse_sim_line(const std::vector<std::string> &tok, Report &r)
+{
+    char *end;
+    r.t_us = strtoll(tok[0].c_str(), &end, 10);
+    if (*end || tok.size() < 2)
+        return false;
+    r.device = tok[1];
+    for (size_t i = 2; i < tok.size(); ++i)
+    {
+        if (!parse_hex(tok[i], r.bytes))
+            return false;
+    }
+    return true;
+}
+
+// "<urb> <時刻 us> C Ii:<bus>:<dev>:<ep> <status> <len> = <ワード> ..."
+// 戻り値: 1 = レポート, 0 = 読み飛ばす行, -1 = usbmon の行ではない
+static int parse_usbmon_line(const std::vector<std::string> &tok, const std::string &usb_dev, Report &r)
+{
+    if (tok.size() < 4 || tok[2].size() != 1 || !strchr("SCE", tok[2][0]) || tok[3].find(':') == std::string::npos)
+        return -1;
+    if (tok[2] != "C" || tok[3].compare(0, 3, "Ii:") != 0)
+        return 0;
+    if (!usb_dev.empty() && tok[3].compare(3, usb_dev.size() + 1, usb_dev + ":") != 0)
+        return 0;
+    size_t i = 4;
+    while (i < tok.size() && tok[i] != "=")
+        ++i;
+    if (i == tok.size())
+        return 0;
+    std::vector<uint8_t> data;
+    for (++i; i < tok.size(); ++i)
+    {
+        if (!parse_hex(tok[i], data))
+            return 0;
+    }
+    r.t_us = strtoll(tok[1].c_str(), nullptr, 10);
+    // 長さで先に分ける (Pro コンのレポートは ID を持たず、先頭のボタンのバイトが RID_MOUSE と同じ値になりうる)
+    if (data.size() == SWITCH_REPORT_LEN)
+    {
+        r.device = "switch";
+        r.bytes = data;
+    }
+    else if (data.size() == KEYBOARD_REPORT_LEN + 1 && data[0] == RID_KEYBOARD)
+    {
+        r.device = "kbd";
+        r.bytes.assign(data.begin() + 1, data.end());
+    }
+    else if (data.size() == MOUSE_WIRE_LEN && data[0] == RID_MOUSE)
+    {
+        r.device = "mouse";
+        r.bytes.assign(data.begin() + 1, data.begin() + 1 + MOUSE_REPORT_LEN);
+    }
+    else
+        return 0;
+    return 1;
+}
+
+static bool load_trace(const char *path, const std::vector<std::string> &devices, const std::string &usb_dev,
+                       std::vector<Report> &out)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    char line[1024];
+    int line_num = 0;
+    int64_t usbmon_base = 0, usbmon_prev = -1;
+    bool ok = true;
+    while (fgets(line, sizeof(line), fp))
+    {
+        ++line_num;
+        std::string s = line;
+        while (!s.empty() && (s.back() == '\n' || s.back() == '\r'))
+            s.pop_back();
+        std::replace(s.begin(), s.end(), '\t', ' ');
+        const std::vector<std::string> tok = split(s, ' ');
+        if (tok.empty() || tok[0][0] == '#')
+            continue;
+        Report r;
+        const int usbmon = parse_usbmon_line(tok, usb_dev, r);
+        if (usbmon == 0)
+            continue;
+        if (usbmon > 0)
+        {
+            // usbmon の時刻は 32 ビットで一周する
+            if (usbmon_prev >= 0 && r.t_us < usbmon_prev)
+                usbmon_base += 1ll << 32;
+            usbmon_prev = r.t_us;
+            r.t_us += usbmon_base;
+        }
+        else if (!parse_sim_line(tok, r))
+        {
+            fprintf(stderr, "%s:%d: not a HID record\n", path, line_num);
+            ok = false;
+            break;
+        }
+        if (std::find(devices.begin(), devices.end(), r.device) != devices.end())
+            out.push_back(r);
+    }
+    fclose(fp);
+    return ok;
+}
+
+struct Event
+{
+    enum Kind
+    {
+        MATCH,
+        MISSED, // golden にあって capture に無い
+        EXTRA,  // capture にだけある
+    } kind;
+    const Report *golden;
+    const Report *capture;
+    int64_t error_us; // MATCH のみ
+};
+
+// 内容が同じレポートを順に対応付ける。食い違ったら window 件先まで探し、近い方で合わせ直す
+static std::vector<Event> match_traces(const std::vector<Report> &g, const std::vector<Report> &c, size_t window)
+{
+    std::vector<Event> ev;
+    size_t i = 0, j = 0;
+    while (i < g.size() || j < c.size())
+    {
+        if (i < g.size() && j < c.size() && g[i].same(c[j]))
+        {
+            ev.push_back({Event::MATCH, &g[i++], &c[j++], 0});
+            continue;
+        }
+        size_t skip_g = 0, skip_c = 0;
+        for (size_t k = 1; k <= window && !skip_g && !skip_c; ++k)
+        {
+            if (j < c.size() && i + k < g.size() && g[i + k].same(c[j]))
+                skip_g = k;
+            else if (i < g.size() && j + k < c.size() && c[j + k].same(g[i]))
+                skip_c = k;
+        }
+        if (!skip_g && !skip_c)
+        {
+            // 見つからなければ 1 件ずつ欠落と余分にする
+            skip_g = i < g.size() ? 1 : 0;
+            skip_c = j < c.size() ? 1 : 0;
+        }
+        for (; skip_g; --skip_g)
+            ev.push_back({Event::MISSED, &g[i++], nullptr, 0});
+        for (; skip_c; --skip_c)
+            ev.push_back({Event::EXTRA, nullptr, &c[j++], 0});
+    }
+    return ev;
+}
+
+struct Summary
+{
+    size_t matched = 0, missed = 0, extra = 0;
+    double error_sum = 0;
+    int64_t drift_us = 0;
+    std::vector<int64_t> abs_error, jitter;
+};
+
+// 昇順に並べた値の最近順位法の百分位
+static int64_t percentile(const std::vector<int64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)std::ceil(p / 100.0 * (double)sorted.size());
+    return sorted[rank ? rank - 1 : 0];
+}
+
+static void summarize(const std::vector<Event> &ev, const std::string &device, Summary &s)
+{
+    const Event *prev = nullptr;
+    for (const Event &e : ev)
+    {
+        const Report *r = e.golden ? e.golden : e.capture;
+        if (!device.empty() && r->device != device)
+            continue;
+        if (e.kind == Event::MISSED)
+        {
+            ++s.missed;
+            continue;
+        }
+        if (e.kind == Event::EXTRA)
+        {
+            ++s.extra;
+            continue;
+        }
+        ++s.matched;
+        s.error_sum += (double)e.error_us;
+        s.abs_error.push_back(std::llabs(e.error_us));
+        s.drift_us = e.error_us;
+        if (prev)
+            s.jitter.push_back(std::llabs(e.error_us - prev->error_us));
+        prev = &e;
+    }
+    std::sort(s.abs_error.begin(), s.abs_error.end());
+    std::sort(s.jitter.begin(), s.jitter.end());
+}
+
+static void print_row(const char *name, const Summary &s)
+{
+    printf("%-7s %7zu %6zu %6zu %+9.0f %8lld %8lld %8lld %8lld %8lld %8lld %8lld %8lld %+9lld\n", name, s.matched,
+           s.missed, s.extra, s.matched ? s.error_sum / (double)s.matched : 0.0,
+           (long long)percentile(s.abs_error, 50), (long long)percentile(s.abs_error, 90),
+           (long long)percentile(s.abs_error, 99), (long long)(s.abs_error.empty() ? 0 : s.abs_error.back()),
+           (long long)percentile(s.jitter, 50), (long long)percentile(s.jitter, 90), (long long)percentile(s.jitter, 99),
+           (long long)(s.jitter.empty() ? 0 : s.jitter.back()), (long long)s.drift_us);
+}
+
+static std::string hex_string(const std::vector<uint8_t> &bytes)
+{
+    std::string out;
+    char buf[4];
+    for (uint8_t b : bytes)
+    {
+        snprintf(buf, sizeof(buf), out.empty() ? "%02x" : " %02x", b);
+        out += buf;
+    }
+    return out;
+}
+
+static bool write_events(const char *path, const std::vector<Event> &ev, int64_t offset_us)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "%s: cannot create\n", path);
+        return false;
+    }
+    static const char *const kind_name[] = {"match", "missed", "extra"};
+    fprintf(fp, "index,status,device,golden_us,capture_us,error_us,report\n");
+    for (size_t i = 0; i < ev.size(); ++i)
+    {
+        const Event &e = ev[i];
+        const Report *r = e.golden ? e.golden : e.capture;
+        std::string g = e.golden ? std::to_string(e.golden->t_us) : "";
+        std::string c = e.capture ? std::to_string(e.capture->t_us - offset_us) : "";
+        std::string err = e.kind == Event::MATCH ? std::to_string(e.error_us) : "";
+        fprintf(fp, "%zu,%s,%s,%s,%s,%s,%s\n", i, kind_name[e.kind], r->device.c_str(), g.c_str(), c.c_str(),
+                err.c_str(), hex_string(r->bytes).c_str());
+    }
+    fclose(fp);
+    return true;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options] golden.txt capture.txt\n"
+            "  --devices LIST   devices to compare (default kbd,mouse,switch)\n"
+            "  --tolerance US   allowed |error| per report (default 2000)\n"
+            "  --window N       reports to look ahead when resynchronising (default 64)\n"
+            "  --usb-dev B:D    usbmon captures: only read this bus:device\n"
+            "  --events PATH    write per-report results as CSV\n"
+            "  -v               list missed, extra and out-of-tolerance reports\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> devices = {"kbd", "mouse", "switch"};
+    int64_t tolerance_us = 2000;
+    size_t window = 64;
+    std::string usb_dev;
+    const char *events_path = nullptr;
+    bool verbose = false;
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *a = argv[i];
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc)
+            {
+                usage(argv[0]);
+                exit(2);
+            }
+            return argv[++i];
+        };
+        if (!strcmp(a, "--devices"))
+            devices = split(value(), ',');
+        else if (!strcmp(a, "--tolerance"))
+            tolerance_us = strtoll(value(), nullptr, 10);
+        else if (!strcmp(a, "--window"))
+            window = (size_t)std::max(1l, strtol(value(), nullptr, 10));
+        else if (!strcmp(a, "--usb-dev"))
+            usb_dev = value();
+        else if (!strcmp(a, "--events"))
+            events_path = value();
+        else if (!strcmp(a, "-v"))
+            verbose = true;
+        else if (a[0] == '-' && a[1])
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        else
+            paths.push_back(a);
+    }
+    if (paths.size() != 2)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    // usbmon はデバイス番号を 3 桁で書く ("Ii:1:005:1")
+    if (!usb_dev.empty())
+    {
+        const size_t colon = usb_dev.find(':');
+        if (colon == std::string::npos)
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%s:%03d", usb_dev.substr(0, colon).c_str(), atoi(usb_dev.c_str() + colon + 1));
+        usb_dev = buf;
+    }
+
+    std::vector<Report> golden, capture;
+    if (!load_trace(paths[0], devices, usb_dev, golden) || !load_trace(paths[1], devices, usb_dev, capture))
+        return 2;
+    if (golden.empty())
+    {
+        fprintf(stderr, "%s: no reports for the selected devices\n", paths[0]);
+        return 2;
+    }
+
+    std::vector<Event> ev = match_traces(golden, capture, window);
+    // 最初に一致したレポートで時刻を揃える
+    int64_t offset_us = 0;
+    bool aligned = false;
+    for (Event &e : ev)
+    {
+        if (e.kind != Event::MATCH)
+            continue;
+        if (!aligned)
+        {
+            offset_us = e.capture->t_us - e.golden->t_us;
+            aligned = true;
+        }
+        e.error_us = e.capture->t_us - offset_us - e.golden->t_us;
+    }
+
+    auto span_ms = [](const std::vector<Report> &v) {
+        return v.empty() ? 0.0 : (double)(v.back().t_us - v.front().t_us) / 1000.0;
+    };
+    printf("golden : %s (%zu reports over %.1f ms)\n", paths[0], golden.size(), span_ms(golden));
+    printf("capture: %s (%zu reports over %.1f ms)\n", paths[1], capture.size(), span_ms(capture));
+    if (aligned)
+        printf("offset : capture = golden %+lld us (aligned on the first matching report)\n\n", (long long)offset_us);
+    else
+        printf("offset : no report matches\n\n");
+
+    printf("%-7s %7s %6s %6s %9s %8s %8s %8s %8s %8s %8s %8s %8s %9s\n", "device", "matched", "missed", "extra",
+           "err mean", "err p50", "err p90", "err p99", "err max", "jit p50", "jit p90", "jit p99", "jit max", "drift");
+    Summary all;
+    summarize(ev, "", all);
+    print_row("all", all);
+    for (const std::string &d : devices)
+    {
+        Summary s;
+        summarize(ev, d, s);
+        if (s.matched + s.missed + s.extra)
+            print_row(d.c_str(), s);
+    }
+    const double golden_span_us = (double)(golden.back().t_us - golden.front().t_us);
+    printf("\n(us; err = |capture - golden| after alignment, jit = change of err between consecutive matches)\n");
+    printf("drift  : %+lld us over %.1f ms (%+.1f ppm)\n", (long long)all.drift_us, golden_span_us / 1000.0,
+           golden_span_us > 0 ? (double)all.drift_us * 1e6 / golden_span_us : 0.0);
+
+    if (verbose)
+    {
+        int shown = 0;
+        for (const Event &e : ev)
+        {
+            const bool late = e.kind == Event::MATCH && std::llabs(e.error_us) > tolerance_us;
+            if (e.kind == Event::MATCH && !late)
+                continue;
+            if (++shown > 50)
+            {
+                printf("  ...\n");
+                break;
+            }
+            const Report *r = e.golden ? e.golden : e.capture;
+            if (e.kind == Event::MISSED)
+                printf("  missed at %lld us: %s %s\n", (long long)r->t_us, r->device.c_str(), hex_string(r->bytes).c_str());
+            else if (e.kind == Event::EXTRA)
+                printf("  extra  at %lld us: %s %s\n", (long long)(r->t_us - offset_us), r->device.c_str(),
+                       hex_string(r->bytes).c_str());
+            else
+                printf("  %+6lld us at %lld us: %s %s\n", (long long)e.error_us, (long long)e.golden->t_us,
+                       r->device.c_str(), hex_string(r->bytes).c_str());
+        }
+    }
+
+    if (events_path && !write_events(events_path, ev, offset_us))
+        return 2;
+
+    const int64_t max_error = all.abs_error.empty() ? 0 : all.abs_error.back();
+    const bool pass = all.missed == 0 && all.extra == 0 && max_error <= tolerance_us;
+    printf("result : %s (tolerance %lld us)\n", pass ? "PASS" : "FAIL", (long long)tolerance_us);
+    return pass ? 0 : 1;
+}
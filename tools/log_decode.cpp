@@ -0,0 +1,231 @@
+// log.bin (LogConfig(<size>, <mode>, BINARY) で記録したバイナリログ) をテキストに戻すホスト用ツール
+// ファームウェアと同じ書式表 (log_formats.h) を使うので、書式を追加したら作り直すこと。
+//
+// build: g++ -std=c++17 -O2 -I.. -o log_decode log_decode.cpp   (tools/ で実行)
+// usage: log_decode [-t] log.bin [logbak.bin ...]
+//        -t  各行の先頭に起動からの時刻 [ms] を付ける
+//        ローテーションで古くなった logbak.bin を先に渡すと時系列順に出力される
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "log_formats.h"
+
+struct Reader
+{
+    const std::vector<uint8_t> &buf;
+    size_t pos = 0;
+    bool ok = true;
+
+    uint8_t byte()
+    {
+        if (pos >= buf.size())
+        {
+            ok = false;
+            return 0;
+        }
+        return buf[pos++];
+    }
+    uint64_t varint()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            const uint8_t b = byte();
+            v |= (uint64_t)(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+        ok = false;
+        return v;
+    }
+    int64_t zigzag() { return unzigzag(varint()); }
+    static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+    void bytes(void *dst, size_t n)
+    {
+        if (pos + n > buf.size())
+        {
+            ok = false;
+            memset(dst, 0, n);
+            pos = buf.size();
+            return;
+        }
+        memcpy(dst, &buf[pos], n);
+        pos += n;
+    }
+};
+
+// '%%' を '%' にしながら書式の地の文を出力する
+static void put_literal(std::string &out, const char *begin, const char *end)
+{
+    for (const char *q = begin; q < end; ++q)
+    {
+        out += *q;
+        if (q[0] == '%' && q + 1 < end && q[1] == '%')
+            ++q;
+    }
+}
+
+// 変換指定から長さ修飾子を取り除き、ホストの型に合わせて整形する
+static void put_arg(std::string &out, const char *spec, const char *spec_end, LogArg kind, Reader &r)
+{
+    std::string f;
+    for (const char *q = spec; q < spec_end - 1; ++q)
+    {
+        if (!strchr("lhzjt", *q))
+            f += *q;
+    }
+    const char conv = spec_end[-1];
+    char buf[512];
+    switch (kind)
+    {
+    case LogArg::INT32:
+    case LogArg::INT64:
+    {
+        int64_t v = r.zigzag();
+        if (kind == LogArg::INT32)
+            v = (int32_t)v;
+        if (conv == 'c')
+            snprintf(buf, sizeof(buf), (f + 'c').c_str(), (int)v);
+        else if (conv == 'd' || conv == 'i')
+            snprintf(buf, sizeof(buf), (f + "ll" + conv).c_str(), (long long)v);
+        else
+        {
+            const unsigned long long u = kind == LogArg::INT32 ? (unsigned long long)(uint32_t)v : (unsigned long long)v;
+            snprintf(buf, sizeof(buf), (f + "ll" + (conv == 'p' ? 'x' : conv)).c_str(), u);
+        }
+        break;
+    }
+    case LogArg::DOUBLE:
+    {
+        const uint64_t v = r.varint();
+        double d;
+        if (v == 1)
+            r.bytes(&d, sizeof(d));
+        else
+            d = (double)Reader::unzigzag(v >> 1);
+        snprintf(buf, sizeof(buf), (f + conv).c_str(), d);
+        break;
+    }
+    default:
+    {
+        const uint8_t n = r.byte();
+        std::string str(n, '\0');
+        r.bytes(&str[0], n);
+        snprintf(buf, sizeof(buf), (f + 's').c_str(), str.c_str());
+        break;
+    }
+    }
+    out += buf;
+}
+
+static bool decode_file(const char *path, bool stamps)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    std::vector<uint8_t> buf;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        buf.insert(buf.end(), chunk, chunk + n);
+    fclose(fp);
+
+    if (buf.size() < 8 || memcmp(buf.data(), kLogBinMagic, 4) != 0)
+    {
+        fprintf(stderr, "%s: not a binary log\n", path);
+        return false;
+    }
+    if (buf[4] != kLogBinVersion)
+        fprintf(stderr, "%s: version %u (decoder expects %u)\n", path, buf[4], kLogBinVersion);
+    const unsigned formats = buf[6] | (buf[7] << 8);
+    if (formats > LOGF_COUNT)
+        fprintf(stderr, "%s: written with %u formats, decoder knows %u (rebuild log_decode)\n", path, formats, (unsigned)LOGF_COUNT);
+
+    Reader r{buf, 8};
+    uint32_t now_ms = 0;
+    std::string line;
+    bool at_line_start = true;
+    while (r.pos < buf.size())
+    {
+        const size_t rec_pos = r.pos;
+        const uint8_t id = r.byte();
+        if (id == LOGF_SYNC)
+        {
+            r.bytes(&now_ms, sizeof(now_ms));
+            continue;
+        }
+        if (id >= LOGF_COUNT)
+        {
+            fprintf(stderr, "%s: unknown format %u at offset %zu\n", path, id, rec_pos);
+            return false;
+        }
+        now_ms += (uint32_t)r.varint();
+
+        std::string text;
+        const char *fmt = kLogFormats[id];
+        const char *p = fmt, *lit = fmt, *spec = nullptr;
+        for (LogArg a; (a = log_next_arg(p, &spec)) != LogArg::NONE; lit = p)
+        {
+            put_literal(text, lit, spec);
+            put_arg(text, spec, p, a, r);
+        }
+        put_literal(text, lit, fmt + strlen(fmt));
+        if (!r.ok)
+        {
+            fprintf(stderr, "%s: truncated record at offset %zu\n", path, rec_pos);
+            return false;
+        }
+
+        // ログの 1 行は複数回の出力に分かれることがあるため、時刻は行の先頭にだけ付ける
+        for (char c : text)
+        {
+            if (at_line_start && c != '\r' && c != '\n')
+            {
+                if (stamps)
+                {
+                    char ts[24];
+                    snprintf(ts, sizeof(ts), "[%lu ms] ", (unsigned long)now_ms);
+                    line += ts;
+                }
+                at_line_start = false;
+            }
+            line += c;
+            if (c == '\n')
+            {
+                fputs(line.c_str(), stdout);
+                line.clear();
+                at_line_start = true;
+            }
+        }
+    }
+    fputs(line.c_str(), stdout);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool stamps = false;
+    int files = 0;
+    bool ok = true;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-t") == 0)
+        {
+            stamps = true;
+            continue;
+        }
+        ok = decode_file(argv[i], stamps) && ok;
+        ++files;
+    }
+    if (files == 0)
+    {
+        fprintf(stderr, "usage: %s [-t] log.bin [logbak.bin ...]\n", argv[0]);
+        return 2;
+    }
+    return ok ? 0 : 1;
+}